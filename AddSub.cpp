@@ -17,13 +17,14 @@
 // - Swap so that we always subtract smaller value from the larger
 // - Subtract mantissa with borrow, check for zero result, normalize, done.
 
-TREG add_sub(TREG x, TREG y, bool is_sub)
+template<int M>
+TReg<M> add_sub(const TReg<M> &x, const TReg<M> &y, bool is_sub)
 {
-    TREG result(is_sub ? (x.fp - y.fp) : (x.fp + y.fp));
+    TReg<M> result;
 
-    TASR scratch1(x); // scratch1 == Augend == x
-    TASR scratch2(y); // scratch2 == Addend == y
-    TASR scratch3; // result
+    TAsr<M> scratch1(x); // scratch1 == Augend == x
+    TAsr<M> scratch2(y); // scratch2 == Addend == y
+    TAsr<M> scratch3; // result
     scratch_clear(scratch3);
 
     bool x_is_0 = scratch_is_0(scratch1);
@@ -33,7 +34,7 @@ TREG add_sub(TREG x, TREG y, bool is_sub)
     if (y_is_0)
     {
         // Return the x value
-        memcpy(result.mant, scratch1.mant, MAX_MANT);
+        memcpy(result.mant, scratch1.mant, M);
         result.sign = x.sign;
         result.exps = x.exps;
 
@@ -47,7 +48,7 @@ TREG add_sub(TREG x, TREG y, bool is_sub)
     if (x_is_0)
     {
         // Return the y value
-        memcpy(result.mant, scratch2.mant, MAX_MANT);
+        memcpy(result.mant, scratch2.mant, M);
         result.sign = y.sign ^ is_sub; // Notice the ^ is_sub !
         result.exps = y.exps;
 
@@ -61,34 +62,32 @@ TREG add_sub(TREG x, TREG y, bool is_sub)
     if (exp_x < exp_y) // Shift right mantissa x
     {
         uint8_t shift = exp_y - exp_x;
-        if (shift >= MAX_MANT)
+        if (shift >= M)
         {
             // Return the y value
-            memcpy(result.mant, scratch2.mant, MAX_MANT);
+            memcpy(result.mant, scratch2.mant, M);
             result.sign = y.sign ^ is_sub; // Notice the ^ is_sub !
             result.exps = y.exps;
 
             return result;
         }
-        while (shift--)
-            scratch_shr(scratch1);
+        scratch_shr(scratch1, shift);
 
         result.exps = exp_y; // Result exponent is that of the 'y' term
     }
     else if (exp_x >= exp_y) // Shift right mantissa y
     {
         uint8_t shift = exp_x - exp_y;
-        if (shift >= MAX_MANT)
+        if (shift >= M)
         {
             // Return the x value
-            memcpy(result.mant, scratch1.mant, MAX_MANT);
+            memcpy(result.mant, scratch1.mant, M);
             result.sign = x.sign;
             result.exps = x.exps;
 
             return result;
         }
-        while (shift--)
-            scratch_shr(scratch2);
+        scratch_shr(scratch2, shift);
 
         result.exps = exp_x; // Result exponent is that of the 'x' term
     }
@@ -105,7 +104,7 @@ TREG add_sub(TREG x, TREG y, bool is_sub)
         // ----------- ADDITION OPERATION -----------
         // Add individual mantissa BCD digits, with carry to overflow
         bool carry = 0;
-        for (int k = MAX_MANT - 1; k >= 0; k--)
+        for (int k = M - 1; k >= 0; k--)
         {
             char bcd1 = scratch1.mant[k] - '0';
             char bcd2 = scratch2.mant[k] - '0';
@@ -134,7 +133,7 @@ TREG add_sub(TREG x, TREG y, bool is_sub)
         // Subtract individual mantissa BCD digits, with borrow
         // The borrow will never undeflow the final value since we are always subtracting a smaller mantissa from the larger one
         bool borrow = 0;
-        for (int k = MAX_MANT - 1; k >= 0; k--)
+        for (int k = M - 1; k >= 0; k--)
         {
             // Subtract the smaller mantissa from the larger
             char bcd1 = scratch1.mant[k] - '0';
@@ -164,14 +163,24 @@ TREG add_sub(TREG x, TREG y, bool is_sub)
         }
     }
 
-    memcpy(result.mant, scratch3.mant, MAX_MANT);
+    memcpy(result.mant, scratch3.mant, M);
+    exp_range(result); // A carry out of E+99, or a cancellation below E-99
 
     return result;
 }
 
-TREG add_sub(const char *a, const char *b, bool is_sub)
+#define INSTANTIATE(M) \
+    template TReg<M> add_sub(const TReg<M> &, const TReg<M> &, bool);
+PROOF_WIDTHS(INSTANTIATE)
+
+TVERIF add_sub(const TVERIF &x, const TVERIF &y, bool is_sub)
+{
+    return TVERIF(add_sub(x.reg, y.reg, is_sub), is_sub ? (x.fp - y.fp) : (x.fp + y.fp));
+}
+
+TVERIF add_sub(const char *a, const char *b, bool is_sub)
 {
-    return add_sub(input(a), input(b), is_sub);
+    return add_sub(TVERIF(a), TVERIF(b), is_sub);
 }
 
 void add_sub_test()
@@ -179,29 +188,7 @@ void add_sub_test()
     std::cout << "ADDITION / SUBTRACTION TEST\n";
     const std::string h1 = " Operand 1       OP Operand 2         Internal normalized    Exp    ID  Internal printed          Verification value\n";
 
-    // Input buffer: 16 characters
-    //   0123456789012345
-    static std::vector<std::string> tests = { // Non-exponential numbers
-        " 1              ",
-        " 1.000000000001 ",
-        " 1.0000000000001",
-        " 1.2345678901234",
-        " 1234567890123.4",
-        " 123456789012345",
-        " 9              ",
-        " 99             ",
-        " 99999999999999 ",
-        " 999999999999999",
-        " 0              ",
-        " 0.1            ",
-        " 0.01           ",
-        " 0.0000000000001",
-        " 0.0000000000009",
-        " 0.1234567890123",
-        " 3.1415926535897",
-        " 2.7182818284590",
-    };
-
+    const std::deque<TCORPUSNUMBER> &c = corpus();
     static const std::string op[2] = {"Addition", "Subtraction"};
     static const std::string header[4] = {
         " of non-exponential numbers:",
@@ -220,20 +207,11 @@ void add_sub_test()
             std::cout << op[addition] << header[signs] << "\n";
             std::cout << h1;
             // Combine each number from the test set with each other
-            for (std::string &s : tests)
+            corpus_cross(c, signs, [&](const TVERIF &x, const TVERIF &y)
             {
-                for (std::string &t : tests)
-                {
-                    std::string s2 = s;
-                    if (signs & 1)
-                        s2[0] = '-';
-                    std::string t2 = t;
-                    if (signs & 2)
-                        t2[0] = '-';
-                    std::cout << s2 << (addition ? " - " : " + ") << t2;
-                    add_sub(s2.c_str(), t2.c_str(), addition).print(test_number++);
-                }
-            }
+                std::cout << x.src << (addition ? " - " : " + ") << y.src;
+                add_sub(x, y, addition).print(test_number++);
+            });
         }
     }
 #endif
@@ -245,28 +223,12 @@ void add_sub_test()
     rnd.seed(43); // Reproducible random number seed
     for (int test_number = 1; test_number <= 500; test_number++)
     {
-        int index1 = rnd() % tests.size();
-        int index2 = rnd() % tests.size();
+        int index1 = rnd() % c.size();
+        int index2 = rnd() % c.size();
         int op = rnd() % 2; // Addition, subtraction
 
-        std::string s1 = tests[index1].substr(0, 12);
-        s1[1] = rdigit(10);
-        if (s1[2] == ' ')
-            s1[2] = '.';
-        s1[3] = rdigit(10);
-        s1[0] = (rnd() & 1) ? ' ' : '-';
-        // Needs to be in a separate line for rnd() consistency across the platforms
-        char e1 = rdigit(2), e2 = rdigit(10);
-        s1 = s1 + "E" + ((rnd() & 1) ? '-' : '+') + e1 + e2;
-
-        std::string s2 = tests[index2].substr(0, 12);
-        s2[1] = rdigit(10);
-        if (s2[2] == ' ')
-            s2[2] = '.';
-        s2[3] = rdigit(10);
-        s2[0] = (rnd() & 1) ? ' ' : '-';
-        e1 = rdigit(2), e2 = rdigit(10);
-        s2 = s2 + "E" + ((rnd() & 1) ? '-' : '+') + e1 + e2;
+        std::string s1 = random_operand(rnd, c[index1].src[0]);
+        std::string s2 = random_operand(rnd, c[index2].src[0]);
 
         std::cout << s1 << (op ? " - " : " + ") << s2;
         add_sub(s1.c_str(), s2.c_str(), op).print(test_number);
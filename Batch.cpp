@@ -0,0 +1,342 @@
+/*  Copyright (C) 2021  Goran Devic
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+*/
+#include "Common.h"
+
+// Batch operations on packed registers:
+// - Operands and results are structures of arrays (TBATCH): mantissas, signs and exponents in separate buffers
+// - Each operation runs in passes over all lanes: signs, exponents and zero checks first, then the
+//   mantissa digit math, then the normalization. The alignment and the normalization of the addition
+//   and subtraction are lane kernels too (batch_align, batch_normalize); the lanes are sorted by their
+//   effective operation in between, so batch_adc and batch_sbc run back to back over the lanes that need
+//   them. The multiplication runs all its partial product rows through batch_adc
+// - The scratch space is owned by the caller (TBATCHWORK), the operations do not allocate in the steady state
+// - The exponents saturate the same way as exp_add() and exp_sub(); their range is checked for all lanes at
+//   once, and only the lanes outside of the range go through exp_range()
+// - Results are bit-exact with add_sub(), mult() and div() of the packed engine
+
+// Loads a batch from the user input buffers; the buffers which do not pass the validation of the lean
+// parser go through the reference parser
+void input(const char *const *in, size_t n, TBATCH &result)
+{
+    result.resize(n);
+    for (size_t i = 0; i < n; i++)
+    {
+        TPREG r;
+        if (!input_packed(in[i], r))
+            r = pack(input(in[i]));
+        result.set(i, r);
+    }
+}
+
+// Saturates the lanes with a range flag set, see exp_range()
+static void batch_saturate(TBATCH &result)
+{
+    for (size_t i = 0; i < result.size(); i++)
+    {
+        if (result.flags[i] & (FLAG_OVERFLOW | FLAG_UNDERFLOW))
+        {
+            TPREG r = result.get(i);
+            exp_range(r);
+            result.set(i, r);
+        }
+    }
+}
+
+// Last pass of the multiplication and the division: the range flags of all lanes are computed without
+// branching, and only a batch with a lane outside of the range goes over its lanes again to saturate them
+static void batch_exp_range(TBATCH &result)
+{
+    size_t n = result.size();
+    uint8_t any = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        int pow = int(result.exps[i]) - 128;
+        uint8_t flag = uint8_t((pow > EXP_MAX) * FLAG_OVERFLOW | (pow < -EXP_MAX) * FLAG_UNDERFLOW);
+        result.flags[i] |= flag;
+        any |= flag;
+    }
+    if (any)
+        batch_saturate(result);
+}
+
+// Scalar alignment pass of the lanes from first on, see add_sub() in Packed.cpp for the heuristic. It
+// does not branch per lane: the selections are bit masks
+void batch_align_scalar(const TBATCH &x, const TBATCH &y, bool is_sub, TBATCH &result, TPASR *a, TPASR *b, uint8_t *op, size_t first)
+{
+    for (size_t i = first; i < x.size(); i++)
+    {
+        TPASR scratch1 = x.mant[i];
+        TPASR scratch2 = y.mant[i];
+        uint8_t exp_x = x.exps[i];
+        uint8_t exp_y = y.exps[i];
+        bool x_lt_y = exp_x < exp_y;
+
+        // Terms which are zero or too small to be aligned return the other term
+        unsigned shift = x_lt_y ? exp_y - exp_x : exp_x - exp_y;
+        bool x_is_0 = scratch1 == 0, y_is_0 = scratch2 == 0, too_small = shift >= MAX_MANT;
+        bool return_x = y_is_0 | (!x_is_0 & !x_lt_y & too_small);
+        bool return_y = !return_x & (x_is_0 | too_small);
+        bool done = return_x | return_y;
+        shift = 4 * shift * !done;
+        result.mant[i] = scratch2 ^ ((scratch1 ^ scratch2) & (TPASR(0) - return_x));
+        scratch1 = (scratch1 >> (shift * x_lt_y)) & PACKED_MANT_MASK;
+        scratch2 = (scratch2 >> (shift * !x_lt_y)) & PACKED_MANT_MASK;
+
+        // Subtract smaller from the larger value
+        bool is_addition = (x.sign[i] == y.sign[i]) ^ is_sub;
+        bool swap = !is_addition & !packed_is_greater_or_equal(scratch1, scratch2);
+        TPASR swapped = (scratch1 ^ scratch2) & (TPASR(0) - swap);
+        a[i] = scratch1 ^ swapped;
+        b[i] = scratch2 ^ swapped;
+        op[i] = uint8_t(!done * (1 + !is_addition));
+
+        uint8_t exp_r = x_lt_y ? exp_y : exp_x;
+        exp_x ^= (exp_x ^ 128) & -uint8_t(x_is_0); // Make it a true 0 (not potentially a negative zero)
+        result.sign[i] = uint8_t((return_x & x.sign[i] & !x_is_0) | (return_y & (y.sign[i] ^ is_sub)) | (!done & (x.sign[i] ^ swap))); // Notice the ^ is_sub !
+        result.exps[i] = uint8_t((exp_x & -uint8_t(return_x)) | (exp_y & -uint8_t(return_y)) | (exp_r & -uint8_t(!done)));
+        result.flags[i] = 0;
+    }
+}
+
+void add_sub(const TBATCH &x, const TBATCH &y, bool is_sub, TBATCH &result, TBATCHWORK &work)
+{
+    size_t n = x.size();
+    result.resize(n);
+    work.resize(n);
+    const TPASR *aligned_x = work.x.data(), *aligned_y = work.y.data();
+    const uint8_t *op = work.op.data();
+    TPASR *a = work.a.data(), *b = work.b.data(), *r = work.r.data();
+    uint8_t *c = work.c.data(), *zeros = work.zeros.data();
+    uint32_t *lane = work.lane.data();
+    TPASR *r_mant = result.mant.data();
+    uint8_t *r_sign = result.sign.data(), *r_exps = result.exps.data(), *r_flags = result.flags.data();
+
+    // Pass 1: zero terms, exponent alignment and the effective operation of every lane
+    batch_align(x, y, is_sub, result, work.x.data(), work.y.data(), work.op.data());
+
+    // Pass 2: sort the lanes by their effective operation, the additions fill the kernel operands from
+    // the front and the subtractions from the back. The operands of every lane are stored, but only the
+    // lanes with a digit math step advance the counts, the others are overwritten by the next lane
+    size_t adds = 0, subs = n;
+    for (size_t i = 0; i < n; i++)
+    {
+        size_t k = op[i] == 1 ? adds : subs - 1;
+        a[k] = aligned_x[i];
+        b[k] = aligned_y[i];
+        lane[k] = uint32_t(i);
+        adds += op[i] == 1;
+        subs -= op[i] == 2;
+    }
+
+    // Pass 3: mantissa digit math, every lane runs only the kernels of its effective operation
+    batch_adc(a, b, r, c, adds);
+    batch_sbc(a + subs, b + subs, r + subs, c + subs, n - subs);
+    batch_normalize(r + subs, zeros + subs, n - subs);
+
+    // Pass 4: store the sums and the differences. Only these lanes can leave the exponent range, a
+    // sum by overflowing and a difference by underflowing; their range flags are set here
+    uint8_t any = 0;
+    for (size_t k = 0; k < adds; k++)
+    {
+        // If we have a carry set after the MSB digit, we need to insert "1" as the topmost digit
+        size_t i = lane[k];
+        r_mant[i] = ((r[k] >> (4 * c[k])) | (TPASR(c[k]) << 60)) & PACKED_MANT_MASK;
+        r_exps[i] += c[k];
+        uint8_t flag = uint8_t((int(r_exps[i]) - 128 > EXP_MAX) * FLAG_OVERFLOW);
+        r_flags[i] = flag;
+        any |= flag;
+    }
+    for (size_t k = subs; k < n; k++)
+    {
+        size_t i = lane[k];
+        bool is_0 = zeros[k] == 16; // Make the result true 0
+        r_mant[i] = r[k] & PACKED_MANT_MASK;
+        r_exps[i] = is_0 ? 128 : uint8_t(r_exps[i] - zeros[k]);
+        r_sign[i] &= !is_0;
+        uint8_t flag = uint8_t((int(r_exps[i]) - 128 < -EXP_MAX) * FLAG_UNDERFLOW);
+        r_flags[i] = flag;
+        any |= flag;
+    }
+
+    // Pass 5: saturate the lanes outside of the exponent range
+    if (any)
+        batch_saturate(result);
+}
+
+// The digit math is the same as packed_mult_mant(), one lane kernel call at a time for all lanes: the
+// multiples of the multiplicands first, then the partial product rows, MSB to LSB multiplier digit
+void mult(const TBATCH &x, const TBATCH &y, TBATCH &result, TBATCHWORK &work)
+{
+    size_t n = x.size();
+    result.resize(n);
+    work.resize(n);
+    TPASR *acc = work.a.data(), *row = work.b.data(), *multiplier = work.r.data(), *multiple = work.multiple.data();
+    uint8_t *c = work.c.data();
+    uint32_t *lane = work.lane.data();
+    size_t lanes = 0; // Number of lanes with both terms non-zero
+
+    // Pass 1: signs and exponents of all lanes, the lanes with a non-zero product go to the kernels
+    for (size_t i = 0; i < n; i++)
+    {
+        bool is_0 = (x.mant[i] == 0) || (y.mant[i] == 0);
+        result.sign[i] = x.sign[i] ^ y.sign[i];
+        result.exps[i] = is_0 ? 128 : uint8_t(exp_saturate(x.exps[i] + y.exps[i] - 256) + 128); // Same as exp_add()
+        result.flags[i] = 0;
+        result.mant[i] = 0; // Return zero
+        if (is_0)
+            continue;
+        multiple[lanes] = 0;
+        multiple[n + lanes] = x.mant[i] >> 4; // Aligned one digit to the right, see packed_mult_mant()
+        multiplier[lanes] = y.mant[i];
+        acc[lanes] = 0;
+        lane[lanes++] = uint32_t(i);
+    }
+
+    // Pass 2: mantissa digit math of all lanes; the multiples and the rows never carry out
+    for (int d = 2; d < 10; d++)
+        batch_adc(multiple + (d - 1) * n, multiple + n, multiple + d * n, c, lanes);
+    for (int j = MAX_MANT - 1; j >= 0; j--) // Index of y.mant
+    {
+        for (size_t k = 0; k < lanes; k++)
+        {
+            acc[k] >>= 4;
+            row[k] = multiple[((multiplier[k] >> (60 - 4 * j)) & 0xF) * n + k];
+        }
+        batch_adc(acc, row, acc, c, lanes);
+    }
+
+    // Pass 3: normalization
+    for (size_t k = 0; k < lanes; k++)
+    {
+        size_t i = lane[k];
+        TPASR scratch3 = acc[k];
+        if ((scratch3 >> 60) == 0)
+            scratch3 <<= 4;
+        else
+            result.exps[i]++;
+        result.mant[i] = scratch3 & PACKED_MANT_MASK;
+    }
+
+    // Pass 4: exponent range
+    batch_exp_range(result);
+}
+
+void div(const TBATCH &x, const TBATCH &y, TBATCH &result)
+{
+    size_t n = x.size();
+    result.resize(n);
+
+    // Pass 1: signs and exponents of all lanes
+    for (size_t i = 0; i < n; i++)
+    {
+        bool y_is_0 = y.mant[i] == 0;
+        bool x_is_0 = x.mant[i] == 0;
+        result.sign[i] = x.sign[i] ^ y.sign[i];
+        result.exps[i] = (x_is_0 || y_is_0) ? 128 : uint8_t(exp_saturate(x.exps[i] - y.exps[i]) + 128); // Same as exp_sub()
+        result.flags[i] = y_is_0 ? FLAG_DIV0 : 0;
+    }
+
+    // Pass 2: mantissa digit math and normalization
+    for (size_t i = 0; i < n; i++)
+    {
+        if ((x.mant[i] == 0) || (y.mant[i] == 0))
+        {
+            result.mant[i] = 0; // Return zero
+            continue;
+        }
+        TPASR scratch3 = packed_div_mant(x.mant[i], y.mant[i]);
+        if ((scratch3 >> 60) == 0)
+        {
+            scratch3 <<= 4;
+            result.exps[i]--;
+        }
+        result.mant[i] = scratch3 & PACKED_MANT_MASK;
+    }
+
+    // Pass 3: exponent range
+    batch_exp_range(result);
+}
+
+// Exponent range test: operands at the edges of E-99..E+99 go through every engine, with the results
+// of the char engines checked against the exact oracle, and the packed results and the batch lanes of
+// every supported SIMD kernel set against the char engine
+void range_test()
+{
+    std::cout << "EXPONENT RANGE TEST\n";
+
+    static const char *mant[4] = { "1          ", "1.000000001", "5.5        ", "9.999999999" };
+    static const char *pow[6] = { "+99", "+98", "+50", "-50", "-98", "-99" };
+    static const char op_char[4] = { '+', '-', '*', '/' };
+    std::vector<std::string> operands;
+    for (int sign = 0; sign < 2; sign++)
+        for (const char *m : mant)
+            for (const char *p : pow)
+                operands.push_back(std::string(sign ? "-" : " ") + m + "E" + p);
+
+    uint32_t total = 0, pass = 0, fail = 0, overflows = 0, underflows = 0;
+    for (int op = 0; op < 4; op++)
+    {
+        std::vector<const char *> a, b;
+        for (const std::string &s1 : operands)
+            for (const std::string &s2 : operands)
+                a.push_back(s1.c_str()), b.push_back(s2.c_str());
+        TBATCH x, y;
+        input(a.data(), a.size(), x);
+        input(b.data(), b.size(), y);
+
+        // The lane kernels only see the mantissas, so the saturation of every supported kernel set is checked
+        std::vector<TBATCH> batch(SIMD_MAX);
+        TBATCHWORK work;
+        for (int level = 0; level < SIMD_MAX; level++)
+        {
+            if (!simd_supported(level))
+                continue;
+            simd_select(level);
+            if (op < 2)
+                add_sub(x, y, op == 1, batch[level], work);
+            else if (op == 2)
+                mult(x, y, batch[level], work);
+            else
+                div(x, y, batch[level]);
+        }
+        simd_select(-1);
+
+        for (size_t i = 0; i < a.size(); i++)
+        {
+            TREG rx = input(a[i]), ry = input(b[i]), expected;
+            TREG result = engine_compute(op, rx, ry, ENGINE_CHAR);
+            int status = exact_check(rx, ry, op, result, expected);
+            bool mismatch = (engine_compute(op, rx, ry, ENGINE_FAST) != result) || (engine_compute(op, rx, ry, ENGINE_PACKED) != result);
+            for (int level = 0; level < SIMD_MAX; level++)
+            {
+                TREG lane;
+                if (simd_supported(level))
+                    unpack(batch[level].get(i), lane), mismatch |= lane != result;
+            }
+            if ((status == CHECK_FAIL) || mismatch)
+                printf("%s %c %s = %c%s (%3d) flags %d  expected %c%s (%3d) flags %d  %s\n", a[i], op_char[op], b[i], result.sign ? '-' : '+', result.mant,
+                       result.exps, result.flags, expected.sign ? '-' : '+', expected.mant, expected.exps, expected.flags, mismatch ? "MISMATCH" : "FAIL");
+            overflows += (result.flags & FLAG_OVERFLOW) != 0;
+            underflows += (result.flags & FLAG_UNDERFLOW) != 0;
+            pass += (status == CHECK_OK) && !mismatch;
+            fail += (status == CHECK_FAIL) || mismatch;
+            total++;
+        }
+    }
+
+    std::cout << "Batch engine kernel sets:";
+    for (int level = 0; level < SIMD_MAX; level++)
+        if (simd_supported(level))
+            std::cout << " " << simd_name(level);
+    std::cout << "\n";
+    std::cout << "Exponent range operations checked: " << total << "  overflows: " << overflows << "  underflows: " << underflows << "  fail: " << fail
+              << "  rounding errors: " << (total - (pass + fail)) << "\n";
+    tests_total += total;
+    tests_pass += pass;
+    tests_fail += fail;
+}
@@ -0,0 +1,311 @@
+/*  Copyright (C) 2021  Goran Devic
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+*/
+#include "Common.h"
+#include <chrono>
+#include <new>
+
+// Microbenchmark suite:
+// - Every benchmark runs over a fixed set of operands generated from the seeded random number
+//   generator, the same way as the randomized tests, so the runs are reproducible
+// - The operations are timed in batches of BATCH_OPS; the percentiles are computed over the batches
+// - The results are printed as JSON so that they can be compared between commits
+// - Every heap allocation is counted (the global operator new is replaced), so the benchmarks also
+//   show which code paths allocate in their steady state
+
+#define BENCH_OPERANDS 4096 // Number of operand pairs
+#define BATCH_OPS      64   // Number of operations timed together
+#define BENCH_ROUNDS   50   // Default number of passes over all operands
+
+typedef std::chrono::steady_clock TClock;
+
+static uint64_t allocations; // Number of operator new calls
+
+void *operator new(size_t n)
+{
+    allocations++;
+    void *p = malloc(n ? n : 1);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+// Fixed operand set of a benchmark run
+struct TBenchSet
+{
+    std::vector<std::string> src1, src2; // Input buffers
+    std::vector<TREG> x, y; // Registers loaded from the input buffers
+    std::vector<TPREG> px, py; // Packed x and y
+    std::vector<TBATCH> bx, by, br; // Packed x and y in batches of BATCH_OPS lanes, and the batch results
+    std::vector<TASR> scratch; // Scratch registers loaded from x
+    std::vector<char> d1, d2; // Single BCD digits
+    std::vector<bool> c; // Carry/borrow inputs
+};
+
+// Result of a single benchmark
+struct TBenchResult
+{
+    std::string name;
+    uint64_t ops;
+    double ns_per_op;
+    double p50, p90, p99; // Latency percentiles per operation (ns), over the batches
+    uint64_t allocs; // Heap allocations in the timed rounds
+    uint64_t keystrokes = 0; // Instructions of an RPN program run by a single operation, if any
+};
+
+static volatile uint32_t sink; // Keeps the benchmarked results alive
+
+static void make_set(TBenchSet &set)
+{
+    const std::deque<TCORPUSNUMBER> &c = corpus();
+    std::minstd_rand r(43); // Reproducible random number seed
+    for (int i = 0; i < BENCH_OPERANDS; i++)
+    {
+        set.src1.push_back(random_operand(r, c[r() % c.size()].src[0]));
+        set.src2.push_back(random_operand(r, c[r() % c.size()].src[0]));
+        set.x.push_back(input(set.src1.back().c_str()));
+        set.y.push_back(input(set.src2.back().c_str()));
+        set.px.push_back(pack(set.x.back()));
+        set.py.push_back(pack(set.y.back()));
+        set.scratch.push_back(TASR(set.x.back()));
+        set.d1.push_back(char(r() % 10));
+        set.d2.push_back(char(r() % 10));
+        set.c.push_back(r() & 1);
+    }
+    for (int i = 0; i < BENCH_OPERANDS; i++)
+    {
+        if (i % BATCH_OPS == 0)
+            set.bx.emplace_back(BATCH_OPS), set.by.emplace_back(BATCH_OPS), set.br.emplace_back(BATCH_OPS);
+        set.bx.back().set(i % BATCH_OPS, set.px[i]);
+        set.by.back().set(i % BATCH_OPS, set.py[i]);
+    }
+}
+
+// Times the operation op(i) over all operands for the given number of rounds
+template<typename T>
+static TBenchResult bench(const char *name, int rounds, T op)
+{
+    std::vector<double> batches;
+    batches.reserve(size_t(rounds) * BENCH_OPERANDS / BATCH_OPS);
+    uint32_t sum = op(0); // Warm up, the steady state allocations are counted from here on
+    uint64_t allocs = allocations;
+    TClock::duration total(0);
+
+    for (int round = 0; round < rounds; round++)
+    {
+        for (int i = 0; i < BENCH_OPERANDS; i += BATCH_OPS)
+        {
+            TClock::time_point start = TClock::now();
+            for (int j = i; j < i + BATCH_OPS; j++)
+                sum += op(j);
+            TClock::duration t = TClock::now() - start;
+            total += t;
+            batches.push_back(std::chrono::duration<double, std::nano>(t).count() / BATCH_OPS);
+        }
+    }
+    allocs = allocations - allocs;
+    sink = sink + sum;
+
+    std::sort(batches.begin(), batches.end());
+    TBenchResult result;
+    result.name = name;
+    result.ops = uint64_t(rounds) * BENCH_OPERANDS;
+    result.ns_per_op = std::chrono::duration<double, std::nano>(total).count() / result.ops;
+    result.p50 = batches[batches.size() * 50 / 100];
+    result.p90 = batches[batches.size() * 90 / 100];
+    result.p99 = batches[batches.size() * 99 / 100];
+    result.allocs = allocs;
+    return result;
+}
+
+// Times a batch operation per lane: op(b) computes all lanes of the batch b, the first lane of every batch runs it
+template<typename T>
+static TBenchResult bench_batch(const char *name, int rounds, TBenchSet &s, T op)
+{
+    return bench(name, rounds, [&](int i)
+    {
+        int b = i / BATCH_OPS;
+        if (i % BATCH_OPS == 0)
+            op(b);
+        return uint32_t(s.br[b].mant[i % BATCH_OPS]);
+    });
+}
+
+static void print_json(const std::vector<TBenchResult> &results, int rounds)
+{
+    std::cout << "{\n";
+    std::cout << "  \"operands\": " << BENCH_OPERANDS << ",\n";
+    std::cout << "  \"rounds\": " << rounds << ",\n";
+    std::cout << "  \"batch_ops\": " << BATCH_OPS << ",\n";
+    std::cout << "  \"benchmarks\": [\n";
+    std::cout << std::fixed << std::setprecision(2);
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const TBenchResult &r = results[i];
+        std::cout << "    { \"name\": \"" << r.name << "\", \"ops\": " << r.ops << ", \"ns_per_op\": " << r.ns_per_op
+                  << ", \"ops_per_sec\": " << std::setprecision(0) << 1e9 / r.ns_per_op << std::setprecision(2)
+                  << ", \"p50_ns\": " << r.p50 << ", \"p90_ns\": " << r.p90 << ", \"p99_ns\": " << r.p99 << ", \"allocs\": " << r.allocs;
+        if (r.keystrokes)
+            std::cout << ", \"keystrokes\": " << r.keystrokes << ", \"ns_per_keystroke\": " << r.ns_per_op / r.keystrokes;
+        std::cout << " }" << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    std::cout << "  ]\n";
+    std::cout << "}\n";
+}
+
+static void usage()
+{
+    std::cout << "Usage: calcbench [-n <rounds>] [<benchmark> ...]\n";
+    std::cout << "  With no benchmark names, runs all benchmarks and prints the results as JSON\n";
+    std::cout << "  -n <rounds>   Number of passes over the " << BENCH_OPERANDS << " operands (default: " << BENCH_ROUNDS << ")\n";
+}
+
+int main(int argc, char *argv[])
+{
+    int rounds = BENCH_ROUNDS;
+    std::vector<std::string> names;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-n") && (i + 1 < argc))
+            rounds = std::max(1, atoi(argv[++i]));
+        else if (argv[i][0] != '-')
+            names.push_back(argv[i]);
+        else
+            return usage(), 1;
+    }
+
+    TBenchSet s;
+    make_set(s);
+
+    auto enabled = [&](const char *name) { return names.empty() || std::find(names.begin(), names.end(), name) != names.end(); };
+    std::vector<TBenchResult> results;
+
+    // Operations
+    if (enabled("input"))
+        results.push_back(bench("input", rounds, [&](int i) { return uint32_t(input(s.src1[i].c_str()).mant[0]); }));
+    if (enabled("add_sub"))
+        results.push_back(bench("add_sub", rounds, [&](int i) { return uint32_t(add_sub(s.x[i], s.y[i], i & 1).mant[0]); }));
+    if (enabled("mult"))
+        results.push_back(bench("mult", rounds, [&](int i) { return uint32_t(mult(s.x[i], s.y[i]).mant[0]); }));
+    if (enabled("mult_column"))
+        results.push_back(bench("mult_column", rounds, [&](int i) { return uint32_t(mult_column(s.x[i], s.y[i]).mant[0]); }));
+    if (enabled("mult_hw"))
+        results.push_back(bench("mult_hw", rounds, [&](int i) { return uint32_t(mult_hw(s.x[i], s.y[i]).mant[0]); }));
+    if (enabled("div"))
+        results.push_back(bench("div", rounds, [&](int i) { return uint32_t(div(s.x[i], s.y[i]).mant[0]); }));
+    if (enabled("div_table"))
+        results.push_back(bench("div_table", rounds, [&](int i) { return uint32_t(div_table(s.x[i], s.y[i]).mant[0]); }));
+    if (enabled("sqrt"))
+        results.push_back(bench("sqrt", rounds, [&](int i) { TREG x = s.x[i]; x.sign = false; return uint32_t(sqrt(x).mant[0]); }));
+    if (enabled("fma"))
+        results.push_back(bench("fma", rounds, [&](int i) { return uint32_t(fma(s.x[i], s.y[i], s.x[i ^ 1]).mant[0]); }));
+    if (enabled("mult_add_sub"))
+        results.push_back(bench("mult_add_sub", rounds, [&](int i) { return uint32_t(add_sub(mult(s.x[i], s.y[i]), s.x[i ^ 1], false).mant[0]); }));
+
+    // Packed engine: the single register operations, and the batch operations timed per lane where the
+    // first lane of every batch computes all of them
+    if (enabled("input_packed"))
+        results.push_back(bench("input_packed", rounds, [&](int i) { TPREG r; return uint32_t(input_packed(s.src1[i].c_str(), r) + r.mant); }));
+    if (enabled("packed_add_sub"))
+        results.push_back(bench("packed_add_sub", rounds, [&](int i) { return uint32_t(add_sub(s.px[i], s.py[i], i & 1).mant); }));
+    if (enabled("packed_mult"))
+        results.push_back(bench("packed_mult", rounds, [&](int i) { return uint32_t(mult(s.px[i], s.py[i]).mant); }));
+    if (enabled("packed_div"))
+        results.push_back(bench("packed_div", rounds, [&](int i) { return uint32_t(div(s.px[i], s.py[i]).mant); }));
+    TBATCHWORK work;
+    for (int level = 0; level < SIMD_MAX; level++)
+    {
+        // The batch operations run on every supported kernel set, except the division which does not use them
+        std::string name = std::string("batch_add_sub_") + simd_name(level);
+        if (simd_supported(level) && enabled(name.c_str()))
+        {
+            simd_select(level);
+            results.push_back(bench_batch(name.c_str(), rounds, s, [&](int b) { add_sub(s.bx[b], s.by[b], b & 1, s.br[b], work); }));
+        }
+        name = std::string("batch_mult_") + simd_name(level);
+        if (simd_supported(level) && enabled(name.c_str()))
+        {
+            simd_select(level);
+            results.push_back(bench_batch(name.c_str(), rounds, s, [&](int b) { mult(s.bx[b], s.by[b], s.br[b], work); }));
+        }
+    }
+    simd_select(-1);
+    if (enabled("batch_div"))
+        results.push_back(bench_batch("batch_div", rounds, s, [&](int b) { div(s.bx[b], s.by[b], s.br[b]); }));
+    TCACHE *cache = new TCACHE; // Large enough for all operand pairs, the rounds after the first one mostly hit
+    if (enabled("cached_compute"))
+        results.push_back(bench("cached_compute", rounds, [&](int i) { return uint32_t(cached_compute(*cache, i & 3, s.px[i], s.py[i], ENGINE_PACKED).mant); }));
+    delete cache;
+
+    // Transcendental functions, on the magnitude of the first operand
+    if (enabled("ln"))
+        results.push_back(bench("ln", rounds, [&](int i) { TREG x = s.x[i]; x.sign = false; return uint32_t(cordic_ln(x).mant[0]); }));
+    if (enabled("exp"))
+        results.push_back(bench("exp", rounds, [&](int i) { return uint32_t(cordic_exp(s.x[i]).mant[0]); }));
+    if (enabled("sin"))
+        results.push_back(bench("sin", rounds, [&](int i) { return uint32_t(cordic_sin(s.x[i]).mant[0]); }));
+    if (enabled("tan"))
+        results.push_back(bench("tan", rounds, [&](int i) { return uint32_t(cordic_tan(s.x[i]).mant[0]); }));
+
+    // Primitives
+    if (enabled("bcd_adc"))
+        results.push_back(bench("bcd_adc", rounds, [&](int i) { bool c = s.c[i]; return uint32_t(bcd_adc(s.d1[i], s.d2[i], c)) + c; }));
+    if (enabled("bcd_sbc"))
+        results.push_back(bench("bcd_sbc", rounds, [&](int i) { bool c = s.c[i]; return uint32_t(bcd_sbc(s.d1[i], s.d2[i], c)) + c; }));
+    if (enabled("bcd_mult"))
+        results.push_back(bench("bcd_mult", rounds, [&](int i) { return uint32_t(bcd_mult(s.d1[i], s.d2[i])); }));
+    if (enabled("bcd_mult_hw"))
+        results.push_back(bench("bcd_mult_hw", rounds, [&](int i) { return uint32_t(bcd_mult_hw(s.d1[i], s.d2[i])); }));
+    if (enabled("scratch_shr"))
+        results.push_back(bench("scratch_shr", rounds, [&](int i) { TASR t = s.scratch[i]; scratch_shr(t, 1 + (i & 3)); return uint32_t(t.mant[i & 7]); }));
+    if (enabled("scratch_shl"))
+        results.push_back(bench("scratch_shl", rounds, [&](int i) { TASR t = s.scratch[i]; scratch_shl(t, 1 + (i & 3)); return uint32_t(t.mant[i & 7]); }));
+
+    // RPN programs: a single keystroke on a loaded stack, and whole programs with their own constants
+    auto rpn_bench = [&](const char *name, const char *text, bool load)
+    {
+        TRPNPROGRAM prog;
+        std::string error;
+        if (!rpn_compile(text, prog, error))
+            return std::cerr << name << ": " << error << "\n", false;
+        TRPNSTATE state;
+        uint64_t steps = rpn_run(prog, state);
+        if (state.flags & FLAGS_ERROR)
+            return std::cerr << name << ": the program stops on Error\n", false;
+        results.push_back(bench(name, rounds, [&](int i)
+        {
+            TRPNSTATE s1;
+            if (load)
+                s1.y = s.px[i], s1.x = s.py[i];
+            rpn_run(prog, s1);
+            return uint32_t(s1.x.mant);
+        }));
+        results.back().keystrokes = steps;
+        return true;
+    };
+    if (enabled("rpn_keystroke") && !rpn_bench("rpn_keystroke", "*", true))
+        return 1;
+    if (enabled("rpn_loan") && !rpn_bench("rpn_loan", "1 rep 36 1.005 * end sto0 10000 * 0.005 * rcl0 1 - /", false))
+        return 1;
+    if (enabled("rpn_series") && !rpn_bench("rpn_series", "0 rep 10 rcl1 1 + sto1 1 x<>y / + end", false))
+        return 1;
+
+    // Verification pipeline: the exact oracle batches draw their operands and records from an arena
+    TARENA arena;
+    std::minstd_rand r(43);
+    TSTATS stats;
+    std::string failures;
+    if (enabled("verify_exact"))
+        results.push_back(bench("verify_exact", rounds, [&](int i) { verify_exact_batch(r, i, 1, ENGINE_CHAR, arena, stats, failures); return uint32_t(stats.total(CHECK_OK)); }));
+
+    print_json(results, rounds);
+}
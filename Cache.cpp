@@ -0,0 +1,125 @@
+/*  Copyright (C) 2021  Goran Devic
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+*/
+#include "Common.h"
+
+// Memoization cache:
+// - Results are stored under a canonical key so that the sign variations of the same operands share
+//   one entry: for mult() and div() the signs only xor into the result, so both operand signs are
+//   dropped; add_sub() folds is_sub into the sign of y, and x is made positive by negating both terms
+//   (which negates the result, except for a zero which is always a true zero)
+// - On a miss the operation runs on the selected engine and the result is inserted into the set,
+//   pushing its older entry out
+
+// Returns the cache set of a canonical key
+static TCacheSet &cache_set(TCACHE &cache, int op, const TPREG &x, const TPREG &y)
+{
+    uint64_t h = x.mant * 0x9E3779B97F4A7C15ull;
+    h ^= (y.mant + (uint64_t(x.exps) << 8 | y.exps) + (uint64_t(op * 2 + y.sign) << 16)) * 0xC2B2AE3D27D4EB4Full;
+    h ^= h >> 29;
+    return cache.set[(h * 0x165667B19E3779F9ull) >> (64 - CACHE_SETS_LOG2)];
+}
+
+static bool entry_matches(const TCACHEENTRY &e, int op, const TPREG &x, const TPREG &y)
+{
+    return (e.op == op + 1) && (e.x_mant == x.mant) && (e.y_mant == y.mant) && (e.x_exps == x.exps) && (e.y_exps == y.exps) && (e.y_sign == y.sign);
+}
+
+TPREG cached_compute(TCACHE &cache, int op, TPREG x, TPREG y, int engine)
+{
+    // Canonicalize the key: op 0 (add) or 2 (mult) or 3 (div), x is positive and for mult and div y as well
+    bool flip; // The result sign needs to be flipped (add) or xor'ed with the operand signs (mult, div)
+    if (op < 2)
+    {
+        y.sign ^= op == 1;
+        op = 0;
+        flip = x.sign;
+        y.sign ^= flip;
+    }
+    else
+    {
+        flip = x.sign ^ y.sign;
+        y.sign = false;
+    }
+    x.sign = false;
+
+    TPREG result;
+    TCacheSet &set = cache_set(cache, op, x, y);
+    int way = entry_matches(set.way[0], op, x, y) ? 0 : (entry_matches(set.way[1], op, x, y) ? 1 : -1);
+    if (way >= 0)
+    {
+        cache.hits++;
+        result.mant = set.way[way].r_mant;
+        result.sign = set.way[way].r_sign;
+        result.exps = set.way[way].r_exps;
+        result.flags = set.way[way].r_flags;
+    }
+    else
+    {
+        cache.misses++;
+        if (engine == ENGINE_PACKED)
+            result = op == 0 ? add_sub(x, y, false) : (op == 2 ? mult(x, y) : div(x, y));
+        else
+        {
+            TREG a, b, r;
+            unpack(x, a);
+            unpack(y, b);
+            r = engine_compute(op, a, b, engine);
+            result = pack(r);
+        }
+        set.way[1] = set.way[0];
+        TCACHEENTRY &e = set.way[0];
+        e.x_mant = x.mant, e.y_mant = y.mant, e.r_mant = result.mant;
+        e.x_exps = x.exps, e.y_exps = y.exps, e.r_exps = result.exps, e.r_flags = result.flags;
+        e.op = uint8_t(op + 1);
+        e.y_sign = y.sign, e.r_sign = result.sign;
+    }
+
+    // A zero sum is a true zero; everything else takes the sign of the original operands
+    if (op == 0)
+        result.sign ^= flip && result.mant;
+    else
+        result.sign ^= flip;
+    return result;
+}
+
+void cache_test()
+{
+    std::cout << "MEMOIZATION CACHE TEST\n";
+
+    // The same grid as the deterministic test sets: every result returned by the cache, hit or miss,
+    // needs to be bit-exact with the uncached operation
+    static TCACHE cache; // Static storage keeps the cache sets aligned to the cache lines
+    static const char op_char[4] = { '+', '-', '*', '/' };
+    uint32_t checked = 0;
+    uint64_t fail = tests_fail;
+    for (int op = 0; op < 4; op++)
+    {
+        for (int signs = 0; signs < 4; signs++)
+        {
+            corpus_cross(corpus(), signs, [&](const TVERIF &a, const TVERIF &b)
+            {
+                TPREG x = pack(a.reg);
+                TPREG y = pack(b.reg);
+                TPREG expected = op < 2 ? add_sub(x, y, op == 1) : (op == 2 ? mult(x, y) : div(x, y));
+                TPREG result = cached_compute(cache, op, x, y, ENGINE_PACKED);
+                checked++;
+                tests_total++;
+                if ((result.mant == expected.mant) && (result.sign == expected.sign) && (result.exps == expected.exps) && (result.flags == expected.flags))
+                {
+                    tests_pass++;
+                    return;
+                }
+                tests_fail++;
+                TREG r;
+                unpack(result, r);
+                printf("%s %c %s  cached: %c%s (%3d)  FAIL\n", a.src, op_char[op], b.src, r.sign ? '-' : '+', r.mant, r.exps);
+            });
+        }
+    }
+    std::cout << "Cached operations checked: " << checked << "  hits: " << cache.hits << "  misses: " << cache.misses << "  mismatches: " << (tests_fail - fail) << "\n";
+}
@@ -7,15 +7,48 @@
 */
 #include "Common.h"
 
+// Test counters updated by TVerif::print() and the test suites
+uint64_t tests_total = 0;
+uint64_t tests_pass = 0;
+uint64_t tests_fail = 0;
+
 // Random number generator that produces equivalent sequence of values across various platforms
 std::minstd_rand rnd;
 char rdigit(int n) { return (rnd() % n) + '0'; }
+char rdigit(std::minstd_rand &r, int n) { return (r() % n) + '0'; }
+
+// Pseudo-random exponential operand: modify the first few digits of a non-exponential test number,
+// randomize its sign and exponent (within some limits). Writes 16 characters and a terminating zero
+void random_operand(std::minstd_rand &r, const char *base, char *out)
+{
+    std::memcpy(out, base, 12);
+    out[1] = rdigit(r, 10);
+    if (out[2] == ' ')
+        out[2] = '.';
+    out[3] = rdigit(r, 10);
+    out[0] = (r() & 1) ? ' ' : '-';
+    // Needs to be in a separate line for rnd() consistency across the platforms
+    char e1 = rdigit(r, 2), e2 = rdigit(r, 10);
+    out[12] = 'E';
+    out[13] = (r() & 1) ? '-' : '+';
+    out[14] = e1;
+    out[15] = e2;
+    out[16] = 0;
+}
+
+std::string random_operand(std::minstd_rand &r, const std::string &base)
+{
+    char out[17];
+    random_operand(r, base.c_str(), out);
+    return out;
+}
 
 // Candidates for CPU instructions:
 
 // Single digit BCD adder with carry
 char bcd_adc(char bcd1, char bcd2, bool &carry)
 {
+    PRIM_COUNT(PRIM_BCD_ADC);
     char sum = bcd1 + bcd2 + carry;
     carry = sum > 9;
     if (carry)
@@ -26,6 +59,7 @@ char bcd_adc(char bcd1, char bcd2, bool &carry)
 // Single digit BCD subtract with borrow
 char bcd_sbc(char bcd1, char bcd2, bool &borrow)
 {
+    PRIM_COUNT(PRIM_BCD_SBC);
     int sub = bcd1 - bcd2 - borrow;
     borrow = sub < 0;
     if (borrow)
@@ -33,8 +67,8 @@ char bcd_sbc(char bcd1, char bcd2, bool &borrow)
     return sub;
 }
 
-// Single digit BCD multiply (result uses two nibbles and is packed)
-char bcd_mult(char bcd1, char bcd2)
+// Single digit BCD multiply by shift-add and double-dabble, the way the hardware does it
+char bcd_mult_hw(char bcd1, char bcd2)
 {
     // Multiply 2 BCD digits (add carry) into an 8-bit wide binary result
 #if 0
@@ -63,64 +97,145 @@ char bcd_mult(char bcd1, char bcd2)
     return char(final >> 8);
 }
 
-// Add two exponents, setting the overflow flag if needed
-uint8_t exp_add(TREG &x, TREG &y)
+// Packed BCD products of all pairs of digits, indexed by [bcd1 * 10 + bcd2]
+static constexpr uint8_t bcd_mult_table[100] = {
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09,
+    0x00, 0x02, 0x04, 0x06, 0x08, 0x10, 0x12, 0x14, 0x16, 0x18,
+    0x00, 0x03, 0x06, 0x09, 0x12, 0x15, 0x18, 0x21, 0x24, 0x27,
+    0x00, 0x04, 0x08, 0x12, 0x16, 0x20, 0x24, 0x28, 0x32, 0x36,
+    0x00, 0x05, 0x10, 0x15, 0x20, 0x25, 0x30, 0x35, 0x40, 0x45,
+    0x00, 0x06, 0x12, 0x18, 0x24, 0x30, 0x36, 0x42, 0x48, 0x54,
+    0x00, 0x07, 0x14, 0x21, 0x28, 0x35, 0x42, 0x49, 0x56, 0x63,
+    0x00, 0x08, 0x16, 0x24, 0x32, 0x40, 0x48, 0x56, 0x64, 0x72,
+    0x00, 0x09, 0x18, 0x27, 0x36, 0x45, 0x54, 0x63, 0x72, 0x81,
+};
+
+// Single digit BCD multiply (result uses two nibbles and is packed)
+char bcd_mult(char bcd1, char bcd2)
 {
-    // XXX Handle overflow and underflow
-    int sum = (int(x.exps) - 128) + (int(y.exps) - 128) + 128;
-    return uint8_t(sum);
+    PRIM_COUNT(PRIM_BCD_MULT);
+#ifdef PROOF_BCD_MULT_HW
+    return bcd_mult_hw(bcd1, bcd2);
+#else
+    return char(bcd_mult_table[bcd1 * 10 + bcd2]);
+#endif
 }
 
-// Subtract two exponents, setting the overflow flag if needed
-uint8_t exp_sub(TREG &x, TREG &y)
+// Add two exponents, saturating the sum
+static uint8_t exp_add(uint8_t x_exps, uint8_t y_exps)
 {
-    // XXX Handle overflow and underflow
-    int sum = (int(x.exps) - 128) - (int(y.exps) - 128) + 128;
-    return uint8_t(sum);
+    PRIM_COUNT(PRIM_EXP_ADD);
+    int sum = (int(x_exps) - 128) + (int(y_exps) - 128);
+    return uint8_t(exp_saturate(sum) + 128);
 }
 
-// Return true if scratch buffer 1 >= buffer 2
-bool scratch_is_greater_or_equal(TASR scratch1, TASR scratch2)
+// Subtract two exponents, saturating the difference
+static uint8_t exp_sub(uint8_t x_exps, uint8_t y_exps)
 {
-    for (uint8_t i = 0; i < MAX_SCRATCH; i++)
+    PRIM_COUNT(PRIM_EXP_SUB);
+    int diff = (int(x_exps) - 128) - (int(y_exps) - 128);
+    return uint8_t(exp_saturate(diff) + 128);
+}
+
+// Returns the flag of an exponent outside of the range E-99..E+99, without branching
+static inline uint8_t exp_range_flag(uint8_t exps)
+{
+    int pow = int(exps) - 128;
+    return uint8_t((pow > EXP_MAX) * FLAG_OVERFLOW | (pow < -EXP_MAX) * FLAG_UNDERFLOW);
+}
+
+template<int M>
+void exp_range(TReg<M> &r)
+{
+    uint8_t flag = exp_range_flag(r.exps);
+    if (flag) // Taken only by the results outside of the range
     {
-        if (scratch1.mant[i] > scratch2.mant[i])
-            return true;
-        if (scratch1.mant[i] < scratch2.mant[i])
-            return false;
+        bool overflow = flag == FLAG_OVERFLOW;
+        std::memset(r.mant, overflow ? '9' : '0', M);
+        r.exps = overflow ? 128 + EXP_MAX : 128;
+        r.sign &= overflow;
+        r.flags |= flag;
     }
-    return true;
 }
 
-// Swap the contents of two scratch registers
-void scratch_swap(TASR &scratch1, TASR &scratch2)
+void exp_range(TPREG &r)
 {
-    for (uint8_t i = 0; i < MAX_SCRATCH; i++)
+    uint8_t flag = exp_range_flag(r.exps);
+    if (flag)
     {
-        scratch1.mant[i] ^= scratch2.mant[i];
-        scratch2.mant[i] ^= scratch1.mant[i];
-        scratch1.mant[i] ^= scratch2.mant[i];
+        bool overflow = flag == FLAG_OVERFLOW;
+        r.mant = overflow ? (0x9999999999999999ull & PACKED_MANT_MASK) : 0;
+        r.exps = overflow ? 128 + EXP_MAX : 128;
+        r.sign &= overflow;
+        r.flags |= flag;
     }
 }
 
-// Shift shratch buffer one digit to the right, filling in '0'
-void scratch_shr(TASR &scratch)
+template<int M>
+TReg<M> reg_error(uint8_t flag)
+{
+    TReg<M> r;
+    r.flags = flag;
+    return r;
+}
+
+template<int M> uint8_t exp_add(const TReg<M> &x, const TReg<M> &y) { return exp_add(x.exps, y.exps); }
+template<int M> uint8_t exp_sub(const TReg<M> &x, const TReg<M> &y) { return exp_sub(x.exps, y.exps); }
+uint8_t exp_add(const TPREG &x, const TPREG &y) { return exp_add(x.exps, y.exps); }
+uint8_t exp_sub(const TPREG &x, const TPREG &y) { return exp_sub(x.exps, y.exps); }
+
+// Return true if scratch buffer 1 >= buffer 2
+template<int M>
+bool scratch_is_greater_or_equal(const TAsr<M> &scratch1, const TAsr<M> &scratch2)
+{
+    PRIM_COUNT(PRIM_SCRATCH_GE);
+    // Digits are chars '0'..'9' stored MSB first, so this is the same as comparing them one by one
+    return std::memcmp(scratch1.mant, scratch2.mant, TAsr<M>::S) >= 0;
+}
+
+// Swap the contents of two scratch registers
+template<int M>
+void scratch_swap(TAsr<M> &scratch1, TAsr<M> &scratch2)
 {
-    std::memmove(&scratch.mant[1], &scratch.mant[0], MAX_SCRATCH - 1); // SHR
-    scratch.mant[0] = '0';
+    PRIM_COUNT(PRIM_SCRATCH_SWAP);
+    std::swap(scratch1, scratch2);
 }
 
-// Shift shratch buffer one digit to the left, filling in '0'
-void scratch_shl(TASR &scratch)
+// Shift shratch buffer n digits to the right, filling in '0'
+template<int M>
+void scratch_shr(TAsr<M> &scratch, int n)
 {
-    std::memmove(&scratch.mant[0], &scratch.mant[1], MAX_SCRATCH - 1); // SHL
-    scratch.mant[MAX_SCRATCH - 1] = '0';
+    PRIM_COUNT(PRIM_SCRATCH_SHR);
+    if (n >= TAsr<M>::S)
+    {
+        scratch_clear(scratch);
+        return;
+    }
+    std::memmove(&scratch.mant[n], &scratch.mant[0], TAsr<M>::S - n); // SHR
+    std::memset(&scratch.mant[0], '0', n);
+}
+
+// Shift shratch buffer n digits to the left, filling in '0'
+template<int M>
+void scratch_shl(TAsr<M> &scratch, int n)
+{
+    PRIM_COUNT(PRIM_SCRATCH_SHL);
+    if (n >= TAsr<M>::S)
+    {
+        scratch_clear(scratch);
+        return;
+    }
+    std::memmove(&scratch.mant[0], &scratch.mant[n], TAsr<M>::S - n); // SHL
+    std::memset(&scratch.mant[TAsr<M>::S - n], '0', n);
 }
 
 // Return true is the scratch register is zero
-bool scratch_is_0(TASR scratch)
+template<int M>
+bool scratch_is_0(const TAsr<M> &scratch)
 {
-    for (uint8_t i = 0; i < MAX_SCRATCH; i++)
+    PRIM_COUNT(PRIM_SCRATCH_IS_0);
+    for (int i = 0; i < TAsr<M>::S; i++)
     {
         if (scratch.mant[i] != '0')
             return false;
@@ -128,8 +243,90 @@ bool scratch_is_0(TASR scratch)
     return true;
 }
 
+// Return the number of digits of the scratch register up to and including its last non-zero digit
+template<int M>
+int scratch_length(const TAsr<M> &scratch)
+{
+    PRIM_COUNT(PRIM_SCRATCH_LENGTH);
+    int n = TAsr<M>::S;
+    while (n && (scratch.mant[n - 1] == '0'))
+        n--;
+    return n;
+}
+
 // Clear the scratch register
-void scratch_clear(TASR &scratch)
+template<int M>
+void scratch_clear(TAsr<M> &scratch)
+{
+    PRIM_COUNT(PRIM_SCRATCH_CLEAR);
+    std::memset(scratch.mant, '0', TAsr<M>::S);
+}
+
+// Add scratch buffer 2 to buffer 1 (all digits), return the carry out of the most significant digit
+template<int M>
+bool scratch_add(TAsr<M> &scratch1, const TAsr<M> &scratch2)
+{
+    PRIM_COUNT(PRIM_SCRATCH_ADD);
+    bool carry = 0;
+    for (int k = TAsr<M>::S - 1; k >= 0; k--)
+    {
+        char bcd1 = scratch1.mant[k] - '0';
+        char bcd2 = scratch2.mant[k] - '0';
+        scratch1.mant[k] = bcd_adc(bcd1, bcd2, carry) + '0';
+    }
+    return carry;
+}
+
+// Subtract scratch buffer 2 from buffer 1 (all digits), return the borrow out of the most significant digit
+template<int M>
+bool scratch_sub(TAsr<M> &scratch1, const TAsr<M> &scratch2)
 {
-    std::memset(scratch.mant, '0', MAX_SCRATCH);
+    PRIM_COUNT(PRIM_SCRATCH_SUB);
+    bool borrow = 0;
+    for (int k = TAsr<M>::S - 1; k >= 0; k--)
+    {
+        char bcd1 = scratch1.mant[k] - '0';
+        char bcd2 = scratch2.mant[k] - '0';
+        scratch1.mant[k] = bcd_sbc(bcd1, bcd2, borrow) + '0';
+    }
+    return borrow;
 }
+
+// Multiply scratch buffer by a single BCD digit into the result buffer, return the most significant
+// digit of the product which did not fit into the result
+template<int M>
+char scratch_mult_digit(TAsr<M> &result, const TAsr<M> &scratch, char bcd)
+{
+    PRIM_COUNT(PRIM_SCRATCH_MULT_DIGIT);
+    char high = 0; // Upper digit of the previous (less significant) digit product
+    bool carry = 0;
+    for (int k = TAsr<M>::S - 1; k >= 0; k--)
+    {
+        char product = bcd_mult(scratch.mant[k] - '0', bcd);
+        result.mant[k] = bcd_adc(product & 0xF, high, carry) + '0';
+        high = (product >> 4) & 0xF;
+    }
+    return high + carry; // Can not overflow a digit since high <= 8
+}
+
+#define INSTANTIATE_SCRATCH(W) \
+    template bool scratch_is_greater_or_equal(const TAsr<W> &, const TAsr<W> &); \
+    template void scratch_swap(TAsr<W> &, TAsr<W> &); \
+    template void scratch_shr(TAsr<W> &, int); \
+    template void scratch_shl(TAsr<W> &, int); \
+    template bool scratch_is_0(const TAsr<W> &); \
+    template int scratch_length(const TAsr<W> &); \
+    template void scratch_clear(TAsr<W> &); \
+    template bool scratch_add(TAsr<W> &, const TAsr<W> &); \
+    template bool scratch_sub(TAsr<W> &, const TAsr<W> &); \
+    template char scratch_mult_digit(TAsr<W> &, const TAsr<W> &, char);
+
+// The scratch primitives also work on the double-length scratch registers of fma()
+#define INSTANTIATE(M) \
+    template uint8_t exp_add(const TReg<M> &, const TReg<M> &); \
+    template uint8_t exp_sub(const TReg<M> &, const TReg<M> &); \
+    template void exp_range(TReg<M> &); \
+    template TReg<M> reg_error(uint8_t); \
+    INSTANTIATE_SCRATCH(M) \
+    INSTANTIATE_SCRATCH(2 * M - 1)
+PROOF_WIDTHS(INSTANTIATE)
@@ -1,13 +1,246 @@
 #include "TReg.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
 #include <random>
+#include <thread>
 #include <vector>
 
-TREG input(const char *in);
+// Char engine algorithms, instantiated for each of the PROOF_WIDTHS
+template<int M> TReg<M> add_sub(const TReg<M> &x, const TReg<M> &y, bool is_sub);
+template<int M> TReg<M> mult(const TReg<M> &x, const TReg<M> &y);
+template<int M> TReg<M> mult_column(const TReg<M> &x, const TReg<M> &y);
+template<int M> TReg<M> mult_hw(const TReg<M> &x, const TReg<M> &y);
+template<int M> TReg<M> div(const TReg<M> &x, const TReg<M> &y);
+template<int M> TReg<M> div_table(const TReg<M> &x, const TReg<M> &y);
+
+// Square root by shift and subtract (Sqrt.cpp)
+template<int M> TReg<M> sqrt(const TReg<M> &x);
+
+// Fused multiply-add x * y + z (Fma.cpp), the product is not truncated before the addition
+template<int M> TReg<M> fma(const TReg<M> &x, const TReg<M> &y, const TReg<M> &z);
+
+// Transcendental functions on the decimal CORDIC engine (Cordic.cpp)
+template<int M> TReg<M> cordic_ln(const TReg<M> &x);
+template<int M> TReg<M> cordic_exp(const TReg<M> &x);
+template<int M> TReg<M> cordic_sin(const TReg<M> &x);
+template<int M> TReg<M> cordic_cos(const TReg<M> &x);
+template<int M> TReg<M> cordic_tan(const TReg<M> &x);
+
+// Column-wise product of the mantissas into scratch3, keeping its top TAsr<W>::S digits; [0] is the
+// carry digit. Used by mult_column() (W == M); a TAsrWide<M> holds the complete product
+template<int M, int W> void mult_column_scratch(const TAsr<M> &scratch1, const TAsr<M> &scratch2, TAsr<W> &scratch3);
+// The complete product built from the partial product rows of mult(), used by fma(); returns its length
+template<int M> int mult_wide_scratch(TAsr<M> scratch1, TAsr<M> scratch2, TAsrWide<M> &scratch3);
+
+// Engines that the verification driver can run: the reference char engine, the char engine
+// with its fast multiply and divide variants, and the packed BCD engine
+enum { ENGINE_CHAR, ENGINE_FAST, ENGINE_PACKED };
+TREG engine_compute(int op, const TREG &x, const TREG &y, int engine);
+
+// Golden result files (Golden.cpp): one fixed-size record per case of a randomized run, at the index
+// of its test ID - 1, holding the packed operands, the packed result and its check status
+typedef struct TGolden
+{
+    uint64_t x, y, result; // Packed mantissas
+    uint8_t x_exps, y_exps, result_exps;
+    uint8_t signs; // Bits 0, 1, 2 are the signs of x, y and the result
+    uint8_t op; // 0 +, 1 -, 2 *, 3 /
+    uint8_t status; // CHECK_* status of the result
+    uint8_t flags; // FLAG_* of the result
+    uint8_t reserved;
+} TGOLDEN;
+
+static_assert(sizeof(TGOLDEN) == 32, "Golden records are 32 bytes");
+
+TGOLDEN golden_record(int op, const TREG &x, const TREG &y, const TREG &result, int status);
+
+// Golden file writer, the records can be written from several threads in any order
+typedef struct TGoldenFile
+{
+    FILE *f = nullptr;
+    std::mutex lock;
+    uint64_t errors = 0;
+
+    bool open(const char *path, uint64_t records, int engine, bool exact, uint64_t key = 0);
+    void write(uint64_t id, const TGOLDEN *rec, size_t n); // Records n starting at the test ID id
+    bool close();
+} TGOLDENFILE;
+
+// Maps two golden files and prints the records that differ; returns the number of differences
+uint64_t golden_compare(const char *path1, const char *path2);
+
+// Adds up the CHECK_* statuses of a golden file into counts[]; returns false unless the file is valid,
+// holds the given number of records and was written with the given key
+bool golden_summary(const char *path, uint64_t key, uint64_t records, uint64_t counts[3]);
+
+// Prints the FAIL records of a golden file, with their test IDs
+void golden_print_failures(const char *path);
+
+// Ordered output of the shards of a parallel run (Output.cpp), written by its own thread
+typedef struct TOutput
+{
+    int fd = -1;
+    bool own = false; // Set if the file was opened here and needs to be closed
+    std::vector<std::string> slots; // Text of every shard, waiting to be written
+    std::vector<char> ready; // Set for the shards that were submitted
+    std::vector<std::string> spare; // Written buffers, handed back on submit
+    int next = 0; // Next shard to be written
+    uint64_t errors = 0;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::thread writer;
+
+    bool open(const char *path, int shards); // Writes to stdout if path is nullptr
+    void submit(int shard, std::string &text); // Takes over the text of the shard, text gets an empty buffer back
+    bool close(); // Waits for all shards to be written; returns false on a write error
+    void run();
+    void flush(const char *data, size_t n);
+} TOUTPUT;
+
+#define VERIFY_OPS_ALL 0xF // Bit n selects the operation n (0 +, 1 -, 2 *, 3 /) of the randomized cases
+
+// Runs the randomized cases of the selected operations; if golden is not nullptr, also writes the record
+// of every case into that file, with the key in its header. The failed cases, or with verbose all of them,
+// are printed into the output file, or to stdout if it is nullptr
+uint64_t verify_parallel(uint64_t cases, int threads, int engine, bool exact, const char *golden = nullptr, int ops = VERIFY_OPS_ALL, uint64_t key = 0,
+                         bool verbose = false, const char *output = nullptr);
+
+// Incremental verification (Incremental.cpp): keeps the golden file of each suite of operations in the
+// cache directory and re-runs only the suites whose sources, corpus or run parameters changed
+uint64_t verify_incremental(uint64_t cases, int threads, int engine, bool exact, const char *cache, bool force);
+
+// Input parser fuzzing (Fuzz.cpp): the complete enumeration of the shapes and the given number of random
+// buffers, checked against the reference parser at every width on all threads; returns the failures
+uint64_t fuzz_parallel(uint64_t cases, int threads);
+
+// Statistics of the verified cases, kept by each thread of a parallel run in its own block:
+// - 64-bit counters of the cases by operation and CHECK_* status, and of the NEAR and FAIL cases by the
+//   decade of their relative error
+// - Only the owning thread writes a block, using relaxed atomic stores, so that the progress reporter
+//   can read it at any time without a lock; the blocks are merged by adding them up at the end
+// - The counters are followed by a cache line of padding, so the blocks of two threads never share one
+#define STAT_OPS     4  // 0 +, 1 -, 2 *, 3 /
+#define STAT_DECADES 17 // Relative error of [1, inf), [1e-1, 1), ..., [1e-15, 1e-14), [0, 1e-15)
+typedef struct TStats
+{
+    std::atomic<uint64_t> counts[STAT_OPS][3]; // Cases by operation and CHECK_* status
+    std::atomic<uint64_t> errors[2][STAT_DECADES]; // NEAR [0] and FAIL [1] cases by the decade of the relative error
+    char pad[64];
+
+    TStats();
+    void add(int op, int status, double error); // Only called by the owning thread
+    void merge(const TStats &s); // Adds the counters of a block that is no longer written
+    uint64_t total(int status) const; // Cases of all operations with the given status
+} TSTATS;
+
+// Runs a batch of randomized cases against the exact oracle, drawing all operand buffers and result
+// records from the arena, which is reset at the end. Adds every case to the stats and
+// appends the printout of the failed cases, or with verbose of all cases; does not allocate otherwise once
+// the arena and the text have grown. If golden is not nullptr, it receives the golden record of every case
+void verify_exact_batch(std::minstd_rand &r, uint64_t id, uint64_t cases, int engine, TARENA &arena, TSTATS &stats, std::string &text,
+                        TGOLDEN *golden = nullptr, int ops = VERIFY_OPS_ALL, bool verbose = false);
+
+// Streaming evaluator: reads lines of "<16 char buffer> <op> <16 char buffer>" and writes one result per line
+uint64_t stream_eval(FILE *in, FILE *out, int engine, bool memo);
+
+// RPN keystroke program (Rpn.cpp) compiled into bytecode; the numbers are parsed into the constant pool
+typedef struct TRpnProgram
+{
+    std::vector<uint8_t> code; // Bytecode, instructions with their inline operands
+    std::vector<TPREG> constants; // Packed registers of the number keystrokes
+    uint32_t keystrokes; // Number of keystrokes of the source
+} TRPNPROGRAM;
+
+#define RPN_MEMORIES 10 // Memory registers, sto0..sto9 and rcl0..rcl9
+
+// Stack, memory registers and lift state of the RPN interpreter
+typedef struct TRpnState
+{
+    TPREG x, y, z, t;
+    TPREG mem[RPN_MEMORIES];
+    uint8_t flags; // FLAG_* of all results of the program, accumulated
+    bool lift; // The next number lifts the stack
+
+    TRpnState() : flags(0), lift(true) {}
+} TRPNSTATE;
+
+// Compiles the keystrokes into the program; on failure returns false with the reason in error
+bool rpn_compile(const char *text, TRPNPROGRAM &prog, std::string &error);
+
+// Runs the program on the state in place; returns the number of executed instructions. A program that stops
+// on Error leaves FLAGS_ERROR in the state flags
+uint64_t rpn_run(const TRPNPROGRAM &prog, TRPNSTATE &s);
+
+// Compiles and runs the keystrokes, prints X with its flags and the time per keystroke; returns the exit
+// status, 1 if the program does not compile or stops on Error
+int rpn_eval(const char *text);
+
+// Exact verification oracle: classifies the result of an operation (op: 0 +, 1 -, 2 *, 3 /) against
+// the exactly computed and truncated value, which is returned in expected
+template<int M> int exact_check(const TReg<M> &x, const TReg<M> &y, int op, const TReg<M> &result, TReg<M> &expected);
+template<int M> int exact_sqrt_check(const TReg<M> &x, const TReg<M> &result, TReg<M> &expected);
+template<int M> int exact_fma_check(const TReg<M> &x, const TReg<M> &y, const TReg<M> &z, const TReg<M> &result, TReg<M> &expected);
+
+// Operations on user input buffers, returning the result together with its verification value
+TVERIF add_sub(const char *a, const char *b, bool is_sub);
+TVERIF mult(const char *a, const char *b);
+TVERIF div(const char *a, const char *b);
+TVERIF add_sub(const TVERIF &x, const TVERIF &y, bool is_sub);
+TVERIF mult(const TVERIF &x, const TVERIF &y);
+TVERIF div(const TVERIF &x, const TVERIF &y);
+
+// Unified test corpus (Corpus.cpp): the non-exponential test numbers, each parsed once with both
+// mantissa signs ([0] positive, [1] negative). With divisors set, zero is left out
+typedef struct TCorpusNumber
+{
+    char src[2][17]; // Input buffers
+    TVERIF val[2]; // Parsed registers with their control values
+
+    TCorpusNumber(const char *in);
+    TCorpusNumber(const TCorpusNumber &) = delete;
+    TCorpusNumber(TCorpusNumber &&) = delete;
+} TCORPUSNUMBER;
+
+const std::deque<TCORPUSNUMBER> &corpus(bool divisors = false);
+
+// Calls f(x, y) for every pair of corpus numbers, with the mantissa signs selected by the bits 0 (x)
+// and 1 (y) of signs
+template<typename F>
+void corpus_cross(const std::deque<TCORPUSNUMBER> &c, int signs, F f)
+{
+    for (const TCORPUSNUMBER &s : c)
+        for (const TCORPUSNUMBER &t : c)
+            f(s.val[signs & 1], t.val[(signs >> 1) & 1]);
+}
 
 extern std::minstd_rand rnd;
 char rdigit(int n);
+char rdigit(std::minstd_rand &r, int n);
+std::string random_operand(std::minstd_rand &r, const std::string &base);
+void random_operand(std::minstd_rand &r, const char *base, char *out);
 
 // Candidates for CPU instructions:
+// Opt-in instrumentation (build with -DPROOF_COUNTERS) counts every invocation of these primitives;
+// when it is not compiled in, PRIM_COUNT() expands to nothing
+enum
+{
+    PRIM_BCD_ADC, PRIM_BCD_SBC, PRIM_BCD_MULT, PRIM_EXP_ADD, PRIM_EXP_SUB,
+    PRIM_SCRATCH_GE, PRIM_SCRATCH_SWAP, PRIM_SCRATCH_SHR, PRIM_SCRATCH_SHL, PRIM_SCRATCH_IS_0,
+    PRIM_SCRATCH_CLEAR, PRIM_SCRATCH_ADD, PRIM_SCRATCH_SUB, PRIM_SCRATCH_MULT_DIGIT, PRIM_SCRATCH_LENGTH,
+    PRIM_MAX
+};
+#ifdef PROOF_COUNTERS
+extern thread_local uint32_t prim_count[PRIM_MAX];
+#define PRIM_COUNT(prim) (prim_count[prim]++)
+#else
+#define PRIM_COUNT(prim) ((void)0)
+#endif
+void counters_test(uint64_t cases);
+// Searches for the operand pairs of each binary operation with the largest total primitive count,
+// evaluating about the given number of pairs per operation on a pool of threads
+void counters_worst(uint64_t evals, int threads);
 
 // Single digit BCD adder with carry
 char bcd_adc(char bcd1, char bcd2, bool &carry);
@@ -15,25 +248,123 @@ char bcd_adc(char bcd1, char bcd2, bool &carry);
 // Single digit BCD subtract with borrow
 char bcd_sbc(char bcd1, char bcd2, bool &borrow);
 
-// Single digit BCD multiply (result uses two nibbles and is packed)
+// Single digit BCD multiply (result uses two nibbles and is packed); looks the product up in a table,
+// or runs bcd_mult_hw() when built with -DPROOF_BCD_MULT_HW, so the cycle model follows the hardware.
+// The same switch makes mult() run the digit product loop of mult_hw()
 char bcd_mult(char bcd1, char bcd2);
 
-// Add/subtract two exponents, setting the overflow flag if needed (TODO)
-uint8_t exp_add(TREG &x, TREG &y);
-uint8_t exp_sub(TREG &x, TREG &y);
+// Single digit BCD multiply by shift-add and double-dabble, the way the hardware does it
+char bcd_mult_hw(char bcd1, char bcd2);
+
+// Add/subtract two exponents. The result saturates at E-EXP_SATURATE..E+EXP_SATURATE, which is far
+// enough outside of the E-99..E+99 range to tell an overflow from an underflow, and close enough that the
+// normalization of the mantissa can not wrap the 8-bit exponent around
+#define EXP_SATURATE 110
+inline int exp_saturate(int pow) { return std::min(EXP_SATURATE, std::max(-EXP_SATURATE, pow)); }
+template<int M> uint8_t exp_add(const TReg<M> &x, const TReg<M> &y);
+template<int M> uint8_t exp_sub(const TReg<M> &x, const TReg<M> &y);
+uint8_t exp_add(const TPREG &x, const TPREG &y);
+uint8_t exp_sub(const TPREG &x, const TPREG &y);
+
+// Checks the exponent of a finished result against the range E-99..E+99, once all of its normalization
+// is done: an overflow saturates to the largest magnitude, an underflow flushes to zero, and either
+// sets its flag. This is the only check of the exponent range an operation makes
+template<int M> void exp_range(TReg<M> &r);
+void exp_range(TPREG &r);
+
+// Returns a zero register carrying the error flag
+template<int M> TReg<M> reg_error(uint8_t flag);
 
 // Return true if scratch buffer 1 >= buffer 2
-bool scratch_is_greater_or_equal(TASR scratch1, TASR scratch2);
+template<int M> bool scratch_is_greater_or_equal(const TAsr<M> &scratch1, const TAsr<M> &scratch2);
 
 // Swap the contents of two scratch registers
-void scratch_swap(TASR &scratch1, TASR &scratch2);
+template<int M> void scratch_swap(TAsr<M> &scratch1, TAsr<M> &scratch2);
 
-// Shift scratch buffer one digit to the right/left, filling in '0'
-void scratch_shr(TASR &scratch);
-void scratch_shl(TASR &scratch);
+// Shift scratch buffer n digits to the right/left, filling in '0'
+template<int M> void scratch_shr(TAsr<M> &scratch, int n = 1);
+template<int M> void scratch_shl(TAsr<M> &scratch, int n = 1);
 
 // Return true is the scratch register is zero
-bool scratch_is_0(TASR scratch);
+template<int M> bool scratch_is_0(const TAsr<M> &scratch);
+
+// Return the significant length of the scratch register: the number of digits up to its last non-zero digit
+template<int M> int scratch_length(const TAsr<M> &scratch);
 
 // Clear the scratch register
-void scratch_clear(TASR &scratch);
+template<int M> void scratch_clear(TAsr<M> &scratch);
+
+// Add/subtract scratch buffer 2 to/from buffer 1 in place, return the carry/borrow
+template<int M> bool scratch_add(TAsr<M> &scratch1, const TAsr<M> &scratch2);
+template<int M> bool scratch_sub(TAsr<M> &scratch1, const TAsr<M> &scratch2);
+
+// Multiply scratch buffer by a single BCD digit, return the digit that overflowed the result
+template<int M> char scratch_mult_digit(TAsr<M> &result, const TAsr<M> &scratch, char bcd);
+
+// Packed BCD engine (Packed.cpp): processes all digits of a scratch register at once.
+// These are not hardware candidates; they exist to speed up bulk verification runs, and they
+// are checked against the char engine (the reference) by packed_test()
+
+// Convert between a char register and a packed register
+TPREG pack(const TREG &r);
+void unpack(const TPREG &p, TREG &r);
+
+// Add/subtract all 16 digits of two packed scratch registers, with carry/borrow in and out
+TPASR packed_adc(TPASR a, TPASR b, bool &carry);
+TPASR packed_sbc(TPASR a, TPASR b, bool &borrow);
+
+// Return true if packed scratch 1 >= packed scratch 2 (the digits are ordered MSB first)
+inline bool packed_is_greater_or_equal(TPASR scratch1, TPASR scratch2) { return scratch1 >= scratch2; }
+
+// Parse a 16 byte input buffer straight into a packed register, bit-exact with pack(input(in));
+// the buffer does not need to be terminated. Returns false if the buffer does not follow the input rules
+bool input_packed(const char *in, TPREG &result);
+
+// Arithmetic operations on packed registers, bit-exact with their char counterparts
+TPREG add_sub(TPREG x, TPREG y, bool is_sub);
+TPREG mult(TPREG x, TPREG y);
+TPREG div(TPREG x, TPREG y);
+
+// Mantissa cores of the packed mult() and div(): operands are non-zero, the result is not normalized
+TPASR packed_mult_mant(TPASR x, TPASR y);
+TPASR packed_div_mant(TPASR x, TPASR y);
+
+// Batch operations (Batch.cpp): compute all results of two equally sized batches in one call, with
+// the scratch space in work. The results are bit-exact with the single register operations of the packed engine
+void input(const char *const *in, size_t n, TBATCH &result);
+void add_sub(const TBATCH &x, const TBATCH &y, bool is_sub, TBATCH &result, TBATCHWORK &work);
+void mult(const TBATCH &x, const TBATCH &y, TBATCH &result, TBATCHWORK &work);
+void div(const TBATCH &x, const TBATCH &y, TBATCH &result);
+
+// Memoization cache (Cache.cpp): returns the result of an operation (op: 0 +, 1 -, 2 *, 3 /) from the cache,
+// or computes it with the given engine and inserts it. The results are bit-exact with the uncached operations
+TPREG cached_compute(TCACHE &cache, int op, TPREG x, TPREG y, int engine);
+
+// Lane kernels used by the batch operations: r[i] = a[i] +/- b[i] over all 16 digits, no carry/borrow in.
+// batch_adc() and batch_sbc() dispatch to the best SIMD kernel set supported by the CPU (Simd.cpp)
+void batch_adc(const TPASR *a, const TPASR *b, TPASR *r, uint8_t *carry, size_t n);
+void batch_sbc(const TPASR *a, const TPASR *b, TPASR *r, uint8_t *borrow, size_t n);
+void batch_adc_scalar(const TPASR *a, const TPASR *b, TPASR *r, uint8_t *carry, size_t n);
+void batch_sbc_scalar(const TPASR *a, const TPASR *b, TPASR *r, uint8_t *borrow, size_t n);
+
+// Alignment pass of the batch addition and subtraction, dispatched the same way. For every lane, it sets
+// op[i] to the effective operation (0: returns one of the terms, 1: addition, 2: subtraction) and
+// a[i], b[i] to the aligned mantissas, the larger one first for a subtraction. The result lanes get the
+// term returned, or the exponent and the sign of the sum or the difference
+void batch_align(const TBATCH &x, const TBATCH &y, bool is_sub, TBATCH &result, TPASR *a, TPASR *b, uint8_t *op);
+void batch_align_scalar(const TBATCH &x, const TBATCH &y, bool is_sub, TBATCH &result, TPASR *a, TPASR *b, uint8_t *op, size_t first);
+
+// Normalization kernel: shifts out the leading zero digits of r[i], zeros[i] is their count (16 for a zero)
+void batch_normalize(TPASR *r, uint8_t *zeros, size_t n);
+void batch_normalize_scalar(TPASR *r, uint8_t *zeros, size_t n);
+
+// SIMD lane kernel sets, selected at runtime
+enum { SIMD_SCALAR, SIMD_SSE2, SIMD_AVX2, SIMD_NEON, SIMD_MAX };
+int simd_level(); // The kernel set used by the batch_*() lane kernels
+void simd_select(int level); // Makes the batch_*() lane kernels use the supported level, -1 for the best one
+bool simd_supported(int level);
+const char *simd_name(int level);
+void batch_adc(int level, const TPASR *a, const TPASR *b, TPASR *r, uint8_t *carry, size_t n);
+void batch_sbc(int level, const TPASR *a, const TPASR *b, TPASR *r, uint8_t *borrow, size_t n);
+void batch_align(int level, const TBATCH &x, const TBATCH &y, bool is_sub, TBATCH &result, TPASR *a, TPASR *b, uint8_t *op);
+void batch_normalize(int level, TPASR *r, uint8_t *zeros, size_t n);
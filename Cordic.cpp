@@ -0,0 +1,432 @@
+/*  Copyright (C) 2021  Goran Devic
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+*/
+#include "Common.h"
+
+// Decimal CORDIC engine for the transcendental functions, ln, exp, sin, cos and tan:
+// - The arguments are moved into the scratch registers as fixed point numbers with one (or up to
+//   three) integer digits, and all the work is done with the shift, add and subtract primitives
+// - ln uses the pseudo-division: the mantissa is reached by a product of the factors (1 + 10^-j),
+//   each one applied with a shift and an add, while the table values ln(1 + 10^-j) of the
+//   applied factors are summed up
+// - exp uses the pseudo-multiplication, the same steps in reverse: the argument is reduced by the
+//   table values, and the factors of the subtracted ones are multiplied into the result
+// - The arguments of exp, sin, cos and tan are reduced by the multiples of ln(10) or pi/2 in the
+//   double-length scratch registers, so that the remainder keeps all of the digits
+// - sin, cos and tan reduce the argument to a quadrant, then rotate the vector (1, 0) by the angles
+//   atan(10^-j) of the table (again with a shift and an add per step) until the half angle is
+//   reached. Its tangent Y/X gives the results with one division:
+//   sin = 2t / (1 + t^2), cos = (1 - t^2) / (1 + t^2), tan = 2t / (1 - t^2)
+//
+// Arguments outside of the domain (ln of a number <= 0, trigonometric arguments of 1000 and more) return
+// the zero error register of reg_error() with FLAG_DOMAIN. Results out of the exponent range go through
+// exp_range(): they saturate with FLAG_OVERFLOW or flush to zero with FLAG_UNDERFLOW.
+// The primitives are counted with PROOF_COUNTERS, the counters report includes these functions.
+
+#define CORDIC_STEPS  22 // Number of table entries, the scratch register of the widest design point
+#define CONST_DIGITS  24 // Digits of every table constant, the first digit is the integer part
+#define WIDE_DIGITS   48 // Digits of the range reduction constants, for the double-length scratch registers
+
+// Table constants, truncated: ln(1 + 10^-j)
+static const char ln_table[CORDIC_STEPS][CONST_DIGITS + 1] = {
+    "069314718055994530941723", "009531017980432486004395", "000995033085316808284821", "000099950033308353316680",
+    "000009999500033330833533", "000000999995000033333083", "000000099999950000033333", "000000009999999500000033",
+    "000000000999999995000000", "000000000099999999950000", "000000000009999999999500", "000000000000999999999995",
+    "000000000000099999999999", "000000000000009999999999", "000000000000000999999999", "000000000000000099999999",
+    "000000000000000009999999", "000000000000000000999999", "000000000000000000099999", "000000000000000000009999",
+    "000000000000000000000999", "000000000000000000000099",
+};
+
+// atan(10^-j)
+static const char atan_table[CORDIC_STEPS][CONST_DIGITS + 1] = {
+    "078539816339744830961566", "009966865249116202737844", "000999966668666523820634", "000099999966666686666652",
+    "000009999999966666666866", "000000999999999966666666", "000000099999999999966666", "000000009999999999999966",
+    "000000000999999999999999", "000000000099999999999999", "000000000009999999999999", "000000000000999999999999",
+    "000000000000099999999999", "000000000000009999999999", "000000000000000999999999", "000000000000000099999999",
+    "000000000000000009999999", "000000000000000000999999", "000000000000000000099999", "000000000000000000009999",
+    "000000000000000000000999", "000000000000000000000099",
+};
+
+static const char ln10[WIDE_DIGITS + 1] = "230258509299404568401799145468436420760110148862";
+static const char half_pi[WIDE_DIGITS + 1] = "157079632679489661923132169163975144209858469968";
+
+// Loads a constant into a fixed point scratch register with I integer digits, scaled by 10^k
+template<int W>
+static void fixed_const(TAsr<W> &s, const char *digits, int I, int k)
+{
+    int pos = I - 1 - k;
+    for (int i = 0; i < TAsr<W>::S; i++)
+        s.mant[i] = (i >= pos) ? digits[i - pos] : '0';
+}
+
+// Loads the magnitude of a register into a fixed point scratch register with I integer digits,
+// returns false if it does not fit
+template<int W, int M>
+static bool fixed_from_reg(const TReg<M> &r, int I, TAsr<W> &s)
+{
+    std::memcpy(s.mant, r.mant, M);
+    std::memset(s.mant + M, '0', TAsr<W>::S - M);
+    if (scratch_is_0(s))
+        return true;
+    int pos = I - 1 - (int(r.exps) - 128); // Position of the leading digit
+    if (pos < 0)
+        return false;
+    scratch_shr(s, pos);
+    return true;
+}
+
+// Reduces the magnitude of a register by the multiples of a constant, in a double-length scratch
+// register so that the constant does not lose its digits: |x| = n * constant + r. Returns n and r
+// in a fixed point scratch register with one integer digit, or -1 if |x| >= 1000
+template<int M>
+static int fixed_reduce(const TReg<M> &x, const char *constant, TAsr<M> &r)
+{
+    static_assert(TAsrWide<M>::S <= WIDE_DIGITS, "Reduction constants need a digit for every digit of the double-length scratch register");
+    TAsrWide<M> a, c;
+    if (!fixed_from_reg(x, 3, a))
+        return -1;
+
+    // Subtract the constant * 100, * 10 and * 1 as many times as it fits
+    int n = 0;
+    for (int d = 2; d >= 0; d--)
+    {
+        fixed_const(c, constant, 3, d);
+        while (scratch_is_greater_or_equal(a, c))
+        {
+            scratch_sub(a, c);
+            n += d == 2 ? 100 : (d == 1 ? 10 : 1);
+        }
+    }
+    scratch_shl(a, 2); // The remainder fits into one integer digit
+    std::memcpy(r.mant, a.mant, TAsr<M>::S);
+    return n;
+}
+
+// Normalizes a fixed point scratch register with I integer digits into a register
+template<int M>
+static TReg<M> fixed_to_reg(TAsr<M> s, int I, bool sign)
+{
+    TReg<M> result;
+    if (scratch_is_0(s))
+        return result; // True zero
+    int exp = I - 1;
+    while (s.mant[0] == '0')
+    {
+        scratch_shl(s);
+        exp--;
+    }
+    memcpy(result.mant, s.mant, M);
+    result.sign = sign;
+    result.exps = uint8_t(128 + exp);
+    return result;
+}
+
+// Returns the error signal of an argument outside of the domain
+template<int M>
+static TReg<M> cordic_error()
+{
+    return reg_error<M>(FLAG_DOMAIN);
+}
+
+// Returns 10^pow for an exponent outside of the range, which saturates or flushes to zero with its flag
+template<int M>
+static TReg<M> cordic_out_of_range(int pow)
+{
+    TReg<M> result;
+    result.mant[0] = '1';
+    result.exps = uint8_t(128 + exp_saturate(pow));
+    exp_range(result);
+    return result;
+}
+
+// s += s * 10^-j; returns the carry out of the integer digits
+template<int M>
+static bool pseudo_mult_step(TAsr<M> &s, int j)
+{
+    TAsr<M> t = s;
+    scratch_shr(t, j);
+    return scratch_add(s, t);
+}
+
+template<int M>
+TReg<M> cordic_ln(const TReg<M> &x)
+{
+    static_assert(TAsr<M>::S <= CORDIC_STEPS, "Tables need an entry for every digit of the scratch register");
+    TAsr<M> m(x); // Mantissa in [1, 10), one integer digit
+    if (x.sign || scratch_is_0(m))
+        return cordic_error<M>();
+    int pow = int(x.exps) - 128;
+
+    // ----------- PSEUDO-DIVISION -----------
+    // Build up p = product of (1 + 10^-j) while it stays <= m; ln(m) is the sum of ln(1 + 10^-j) of the applied factors
+    TAsr<M> p, acc, c;
+    scratch_clear(p);
+    p.mant[0] = '1';
+    scratch_clear(acc);
+    for (int j = 0; j < TAsr<M>::S; j++)
+    {
+        fixed_const(c, ln_table[j], 1, 0);
+        for (;;)
+        {
+            TAsr<M> t = p;
+            if (pseudo_mult_step(t, j) || !scratch_is_greater_or_equal(m, t))
+                break;
+            p = t;
+            scratch_add(acc, c);
+        }
+    }
+
+    // ln(x) = pow * ln(10) + ln(m); use as many integer digits as the result needs
+    int npow = std::abs(pow);
+    int I = npow <= 3 ? 1 : (npow <= 42 ? 2 : 3);
+    TAsr<M> k, t;
+    scratch_clear(k);
+    for (int d = 0, n = npow; n; d++, n /= 10)
+    {
+        fixed_const(c, ln10, I, d); // ln(10) * 10^d times the decimal digit d of pow
+        scratch_mult_digit(t, c, char(n % 10));
+        scratch_add(k, t);
+    }
+    scratch_shr(acc, I - 1);
+    if (pow >= 0)
+        scratch_add(k, acc);
+    else
+        scratch_sub(k, acc); // k >= ln(10) > acc
+    return fixed_to_reg(k, I, pow < 0);
+}
+
+template<int M>
+TReg<M> cordic_exp(const TReg<M> &x)
+{
+    static_assert(TAsr<M>::S <= CORDIC_STEPS, "Tables need an entry for every digit of the scratch register");
+    TAsr<M> r, c;
+
+    // Split |x| = k * ln(10) + r
+    int k = fixed_reduce(x, ln10, r);
+    if (k < 0) // |x| is too large to be reduced, e^x is far outside of the exponent range
+        return cordic_out_of_range<M>(x.sign ? -EXP_SATURATE : EXP_SATURATE);
+    if (x.sign) // e^-|x| = 10^-(k + 1) * e^(ln(10) - r)
+    {
+        k = -k;
+        if (!scratch_is_0(r))
+        {
+            fixed_const(c, ln10, 1, 0);
+            scratch_sub(c, r);
+            r = c;
+            k--;
+        }
+    }
+    if ((k > EXP_MAX) || (k < -EXP_MAX)) // The exponent of the result is k
+        return cordic_out_of_range<M>(k);
+
+    // ----------- PSEUDO-MULTIPLICATION -----------
+    // Subtract ln(1 + 10^-j) from r while it fits, multiplying p by (1 + 10^-j) each time
+    TAsr<M> p;
+    scratch_clear(p);
+    p.mant[0] = '1';
+    for (int j = 0; j < TAsr<M>::S; j++)
+    {
+        fixed_const(c, ln_table[j], 1, 0);
+        if (scratch_is_0(c)) // The rest of the table is below the last digit
+            break;
+        while (scratch_is_greater_or_equal(r, c))
+        {
+            scratch_sub(r, c);
+            pseudo_mult_step(p, j);
+        }
+    }
+
+    TReg<M> result = fixed_to_reg(p, 1, false);
+    result.exps = uint8_t(result.exps + k);
+    return result;
+}
+
+// Reduces |x| = n * pi/2 + r and returns t = tan(r / 2), with the quadrant n mod 4; returns false if |x| >= 1000
+template<int M>
+static bool cordic_half_tan(const TReg<M> &x, TReg<M> &t, int &quadrant)
+{
+    static_assert(TAsr<M>::S <= CORDIC_STEPS, "Tables need an entry for every digit of the scratch register");
+    TAsr<M> a, c;
+    quadrant = fixed_reduce(x, half_pi, a) % 4;
+    if (quadrant < 0)
+        return false;
+    TAsr<M> h;
+    scratch_mult_digit(h, a, 5); // Half of the angle, r * 5 / 10
+    scratch_shr(h, 1);
+
+    // ----------- ROTATION -----------
+    // Rotate (X, Y) = (1, 0) by atan(10^-j) while the angle is at least that: X -= Y * 10^-j, Y += X * 10^-j
+    TAsr<M> vx, vy;
+    scratch_clear(vx);
+    vx.mant[0] = '1';
+    scratch_clear(vy);
+    for (int j = 0; j < TAsr<M>::S; j++)
+    {
+        fixed_const(c, atan_table[j], 1, 0);
+        if (scratch_is_0(c)) // The rest of the table is below the last digit
+            break;
+        while (scratch_is_greater_or_equal(h, c))
+        {
+            scratch_sub(h, c);
+            TAsr<M> dx = vy, dy = vx;
+            scratch_shr(dx, j);
+            scratch_shr(dy, j);
+            scratch_sub(vx, dx);
+            scratch_add(vy, dy);
+        }
+    }
+    t = div(fixed_to_reg(vy, 1, false), fixed_to_reg(vx, 1, false));
+    return true;
+}
+
+// Returns the register with the sign flipped, a zero stays a true zero
+template<int M>
+static TReg<M> negate(TReg<M> r)
+{
+    if (!scratch_is_0(TAsr<M>(r)))
+        r.sign = !r.sign;
+    return r;
+}
+
+// Computes sin(r) and cos(r) from t = tan(r / 2)
+template<int M>
+static void half_tan_sin_cos(const TReg<M> &t, TReg<M> &s, TReg<M> &c)
+{
+    TReg<M> one;
+    one.mant[0] = '1';
+    TReg<M> t2 = mult(t, t);
+    TReg<M> den = add_sub(one, t2, false);
+    s = div(add_sub(t, t, false), den);
+    c = div(add_sub(one, t2, true), den);
+}
+
+template<int M>
+TReg<M> cordic_sin(const TReg<M> &x)
+{
+    TReg<M> t, s, c;
+    int quadrant;
+    if (!cordic_half_tan(x, t, quadrant))
+        return cordic_error<M>();
+    half_tan_sin_cos(t, s, c);
+    TReg<M> result = (quadrant & 1) ? c : s;
+    if ((quadrant >= 2) ^ x.sign) // sin(-x) = -sin(x)
+        result = negate(result);
+    return result;
+}
+
+template<int M>
+TReg<M> cordic_cos(const TReg<M> &x)
+{
+    TReg<M> t, s, c;
+    int quadrant;
+    if (!cordic_half_tan(x, t, quadrant))
+        return cordic_error<M>();
+    half_tan_sin_cos(t, s, c);
+    TReg<M> result = (quadrant & 1) ? s : c;
+    if ((quadrant == 1) || (quadrant == 2))
+        result = negate(result);
+    return result;
+}
+
+template<int M>
+TReg<M> cordic_tan(const TReg<M> &x)
+{
+    TReg<M> t;
+    int quadrant;
+    if (!cordic_half_tan(x, t, quadrant))
+        return cordic_error<M>();
+    TReg<M> one;
+    one.mant[0] = '1';
+    TReg<M> num = add_sub(t, t, false); // 2t
+    TReg<M> den = add_sub(one, mult(t, t), true); // 1 - t^2
+    TReg<M> result = (quadrant & 1) ? negate(div(den, num)) : div(num, den); // tan(r + pi/2) = -1 / tan(r)
+    if (x.sign) // tan(-x) = -tan(x)
+        result = negate(result);
+    return result;
+}
+
+#define INSTANTIATE(M) \
+    template TReg<M> cordic_ln(const TReg<M> &); \
+    template TReg<M> cordic_exp(const TReg<M> &); \
+    template TReg<M> cordic_sin(const TReg<M> &); \
+    template TReg<M> cordic_cos(const TReg<M> &); \
+    template TReg<M> cordic_tan(const TReg<M> &);
+PROOF_WIDTHS(INSTANTIATE)
+
+// Converts a register into a double, for the comparison with the reference
+static double reg_to_double(const TREG &r)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%c%c.%se%d", r.sign ? '-' : '+', r.mant[0], &r.mant[1], int(r.exps) - 128);
+    return strtod(buf, nullptr);
+}
+
+// Checks a function result against the double precision reference, which is close enough to verify
+// the error bound of 10^-(MAX_MANT - 3), relative to the result or absolute below 1 (near the zeros
+// of the functions). A reference outside of the domain or the exponent range expects the error signal or
+// the overflow; an underflow is checked as the zero it flushes to.
+static int cordic_check(const char *name, const std::string &a, const TREG &result, double expected, double &max_error)
+{
+    bool valid = std::isfinite(expected) && (std::fabs(expected) < 1e99);
+    bool is_error = result.flags & (FLAGS_ERROR | FLAG_OVERFLOW);
+    double error = 0;
+    bool fail = valid == is_error;
+    if (valid && !is_error)
+    {
+        error = std::fabs(reg_to_double(result) - expected) / std::max(1.0, std::fabs(expected));
+        fail = error > std::pow(10, -(MAX_MANT - 3));
+        max_error = std::max(max_error, error);
+    }
+    if (fail)
+        std::cout << name << "(" << a << ") = " << (result.sign ? '-' : '+') << result.mant << " (" << int(result.exps) << ")  expected "
+                  << std::setprecision(15) << std::scientific << expected << std::defaultfloat << "  FAIL\n";
+    return fail ? CHECK_FAIL : (error == 0 ? CHECK_OK : CHECK_NEAR);
+}
+
+void cordic_test()
+{
+    std::cout << "TRANSCENDENTAL FUNCTION TEST\n";
+
+    static const char *name[5] = { "ln", "exp", "sin", "cos", "tan" };
+    static TREG (*const f[5])(const TREG &) = { cordic_ln, cordic_exp, cordic_sin, cordic_cos, cordic_tan };
+    static double (*const ref[5])(double) = { std::log, std::exp, std::sin, std::cos, std::tan };
+
+    // The test numbers of both signs, then randomized arguments with the exponent limited to E-2..E+2
+    // so that most of them are within the domain of every function
+    std::vector<std::string> args;
+    for (const TCORPUSNUMBER &n : corpus())
+        args.push_back(n.src[0]), args.push_back(n.src[1]);
+    rnd.seed(43); // Reproducible random number seed
+    const std::deque<TCORPUSNUMBER> &c = corpus();
+    for (int i = 0; i < 500; i++)
+    {
+        std::string s = random_operand(rnd, c[rnd() % c.size()].src[0]);
+        s[14] = '0';
+        s[15] = rdigit(3);
+        args.push_back(s);
+    }
+
+    for (int i = 0; i < 5; i++)
+    {
+        uint32_t total = 0, pass = 0, fail = 0;
+        double max_error = 0;
+        for (const std::string &a : args)
+        {
+            TREG x = input(a.c_str());
+            double xd = reg_to_double(x);
+            double expected = (i >= 2) && (std::fabs(xd) >= 1000) ? NAN : ref[i](xd); // Trigonometric arguments are limited
+            int status = cordic_check(name[i], a, f[i](x), expected, max_error);
+            pass += status == CHECK_OK;
+            fail += status == CHECK_FAIL;
+            total++;
+        }
+        printf("Function %-3s arguments checked: %u  fail: %u  max error: %.1e\n", name[i], total, fail, max_error);
+        tests_total += total;
+        tests_pass += pass;
+        tests_fail += fail;
+    }
+}
@@ -0,0 +1,65 @@
+/*  Copyright (C) 2021  Goran Devic
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+*/
+#include "Common.h"
+
+// Unified test corpus: the non-exponential test numbers shared by all test suites. Every number is
+// parsed once, for both mantissa signs, so that the suites iterate over the pre-parsed registers
+
+// Input buffer: 16 characters
+//   0123456789012345
+static const char *const numbers[] = { // Non-exponential numbers
+    " 1              ",
+    " 1.000000000001 ",
+    " 1.0000000000001",
+    " 1.2345678901234",
+    " 1234567890123.4",
+    " 123456789012345",
+    " 9              ",
+    " 99             ",
+    " 99999999999999 ",
+    " 999999999999999",
+    " 0              ",
+    " 0.1            ",
+    " 0.01           ",
+    " 0.0000000000001",
+    " 0.0000000000009",
+    " 0.1234567890123",
+    " 3.1415926535897",
+    " 2.7182818284590",
+};
+
+// Copies the input buffer with the given mantissa sign, returns the copy
+static const char *copy_src(char *dst, const char *in, char sign)
+{
+    std::strcpy(dst, in);
+    dst[0] = sign;
+    return dst;
+}
+
+TCorpusNumber::TCorpusNumber(const char *in) : val{ TVERIF(copy_src(src[0], in, ' ')), TVERIF(copy_src(src[1], in, '-')) }
+{
+}
+
+// Builds a corpus; the entries are never moved since the parsed values point to their input buffers
+static std::deque<TCORPUSNUMBER> build(bool divisors)
+{
+    std::deque<TCORPUSNUMBER> c;
+    for (const char *in : numbers)
+    {
+        if (!divisors || !scratch_is_0(TASR(input(in))))
+            c.emplace_back(in);
+    }
+    return c;
+}
+
+const std::deque<TCORPUSNUMBER> &corpus(bool divisors)
+{
+    static const std::deque<TCORPUSNUMBER> all = build(false);
+    static const std::deque<TCORPUSNUMBER> nonzero = build(true);
+    return divisors ? nonzero : all;
+}
@@ -0,0 +1,354 @@
+/*  Copyright (C) 2021  Goran Devic
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+*/
+#include "Common.h"
+#include <atomic>
+#include <thread>
+
+// Primitive counters report:
+// - Counts the invocations of each CPU instruction candidate per top-level operation
+// - Collects the distribution of these counts (min, mean, max and a histogram) over a randomized
+//   test set, which is used to size the microcode and to predict the worst-case latency of a key press
+// - Searches for the operand pairs with the largest total primitive count of each binary operation:
+//   every shard samples random pairs, then hill-climbs from the costliest ones by mutating a single
+//   mantissa digit or exponent at a time, keeping the mutation when the count does not go down
+
+#ifdef PROOF_COUNTERS
+
+thread_local uint32_t prim_count[PRIM_MAX];
+
+#define HIST_BUCKETS 8
+
+// Total of the primitive counts: the composite primitives (scratch_add, scratch_sub, scratch_mult_digit) are
+// made of the bcd_adc, bcd_sbc and bcd_mult calls that are already counted, so they are left out
+static uint32_t prim_total(const uint32_t *counts)
+{
+    uint32_t total = 0;
+    for (int p = 0; p < PRIM_MAX; p++)
+        if ((p != PRIM_SCRATCH_ADD) && (p != PRIM_SCRATCH_SUB) && (p != PRIM_SCRATCH_MULT_DIGIT))
+            total += counts[p];
+    return total;
+}
+
+static const char *prim_name[PRIM_MAX] = {
+    "bcd_adc", "bcd_sbc", "bcd_mult", "exp_add", "exp_sub",
+    "scratch_ge", "scratch_swap", "scratch_shr", "scratch_shl", "scratch_is_0",
+    "scratch_clear", "scratch_add", "scratch_sub", "scratch_mult_digit", "scratch_length",
+};
+
+#define OPS 12
+#define BINARY_OPS 6 // The rest are the functions of a single argument (y)
+static const char *op_name[OPS] = { "add", "sub", "mult", "mult_column", "div", "div_table", "sqrt", "ln", "exp", "sin", "cos", "tan" };
+static const char *op_str[OPS] = { " + ", " - ", " * ", " * ", " / ", " / ", " sqrt ", " ln ", " exp ", " sin ", " cos ", " tan " };
+
+// Runs one top-level operation with the counters cleared, the counters hold its primitive counts on return
+static void count_op(int op, const TREG &x, const TREG &y)
+{
+    std::memset(prim_count, 0, sizeof(prim_count));
+    static TREG (*const ops[OPS])(const TREG &, const TREG &) = {
+        [](const TREG &x, const TREG &y) { return add_sub(x, y, false); },
+        [](const TREG &x, const TREG &y) { return add_sub(x, y, true); },
+        mult, mult_column, div, div_table,
+        [](const TREG &, const TREG &y) { return sqrt(y); },
+        [](const TREG &, const TREG &y) { return cordic_ln(y); },
+        [](const TREG &, const TREG &y) { return cordic_exp(y); },
+        [](const TREG &, const TREG &y) { return cordic_sin(y); },
+        [](const TREG &, const TREG &y) { return cordic_cos(y); },
+        [](const TREG &, const TREG &y) { return cordic_tan(y); },
+    };
+    ops[op](x, y);
+}
+
+// Prints the non-zero primitive counts
+static void print_prims(const uint32_t *counts)
+{
+    for (int p = 0; p < PRIM_MAX; p++)
+    {
+        if (counts[p])
+            std::cout << " " << prim_name[p] << "=" << counts[p];
+    }
+    std::cout << "\n";
+}
+
+static void print_counts(const char *a, const char *b, int op)
+{
+    count_op(op, input(a), input(b));
+    std::cout << (op < BINARY_OPS ? a : "") << op_str[op] << b << " (" << op_name[op] << "):";
+    print_prims(prim_count);
+}
+
+// Prints the distribution of the samples as one line of the report
+static void print_distribution(const char *name, const std::vector<uint32_t> &samples)
+{
+    uint32_t min = *std::min_element(samples.begin(), samples.end());
+    uint32_t max = *std::max_element(samples.begin(), samples.end());
+    uint64_t sum = 0;
+    uint64_t hist[HIST_BUCKETS] = {};
+    for (uint32_t v : samples)
+    {
+        sum += v;
+        hist[uint64_t(v) * HIST_BUCKETS / (uint64_t(max) + 1)]++;
+    }
+    std::cout << "  " << std::left << std::setw(20) << name << std::right << std::setw(6) << min
+              << std::setw(10) << std::fixed << std::setprecision(1) << double(sum) / samples.size() << std::setw(7) << max << " ";
+    for (uint64_t h : hist)
+        std::cout << " " << std::setw(6) << h;
+    std::cout << "\n";
+}
+
+// Returns an operand as typed on the keyboard: 1 to 3 significant digits, the decimal point anywhere
+// among them or in front of them
+static std::string short_operand(std::minstd_rand &r)
+{
+    int len = 1 + r() % 3, dot = r() % (len + 1);
+    std::string s = dot ? " " : " 0.";
+    for (int k = 0; k < len; k++)
+        s += (k && (k == dot)) ? "." : "", s += char('1' + r() % 9);
+    s.resize(16, ' ');
+    return s;
+}
+
+void counters_test(uint64_t cases)
+{
+    std::cout << "PRIMITIVE COUNTERS (" << cases << " randomized cases per operation)\n";
+
+    for (int op = 0; op < OPS; op++)
+        print_counts(" 1              ", " 3              ", op);
+    for (int op = 0; op < BINARY_OPS; op++) // Short keyboard inputs, with the significant lengths of 2 and 1
+        print_counts(" 99             ", " 0.4            ", op);
+
+    for (int op = 0; op < OPS; op++)
+    {
+        std::vector<std::vector<uint32_t>> samples(PRIM_MAX + 1, std::vector<uint32_t>(cases));
+        const std::deque<TCORPUSNUMBER> &c = corpus();
+        std::minstd_rand r(43); // Reproducible random number seed, the same operands for every operation
+        for (uint64_t i = 0; i < cases; i++)
+        {
+            std::string s1 = random_operand(r, c[r() % c.size()].src[0]);
+            std::string s2 = random_operand(r, c[r() % c.size()].src[0]);
+            TREG x = input(s1.c_str()), y = input(s2.c_str());
+            if (op >= BINARY_OPS) // Keep the argument of a function positive and within E-2..E+2, the domain of all of them
+            {
+                y.sign = false;
+                y.exps = uint8_t(128 + (int(y.exps) - 128) % 3);
+            }
+            count_op(op, x, y);
+            for (int p = 0; p < PRIM_MAX; p++)
+                samples[p][i] = prim_count[p];
+            samples[PRIM_MAX][i] = prim_total(prim_count);
+        }
+
+        std::cout << "Operation " << op_name[op] << ":\n";
+        std::cout << "  Primitive              min      mean    max  histogram (" << HIST_BUCKETS << " buckets from 0 to max)\n";
+        for (int p = 0; p < PRIM_MAX; p++)
+        {
+            if (*std::max_element(samples[p].begin(), samples[p].end()))
+                print_distribution(prim_name[p], samples[p]);
+        }
+        print_distribution("total", samples[PRIM_MAX]);
+    }
+
+    // The operations stop early on short operands (skipped multiplier digits, zero remainders)
+    std::cout << "Short keyboard inputs (1 to 3 significant digits), total primitive counts:\n";
+    std::cout << "  Operation              min      mean    max  histogram (" << HIST_BUCKETS << " buckets from 0 to max)\n";
+    for (int op = 0; op < BINARY_OPS; op++)
+    {
+        std::vector<uint32_t> totals(cases);
+        std::minstd_rand r(43);
+        for (uint64_t i = 0; i < cases; i++)
+        {
+            std::string s1 = short_operand(r), s2 = short_operand(r);
+            count_op(op, input(s1.c_str()), input(s2.c_str()));
+            totals[i] = prim_total(prim_count);
+        }
+        print_distribution(op_name[op], totals);
+    }
+    // Divisions with a short quotient (12 / 4, 1.5 / 3), the remainder runs out after a few digits
+    for (int op : { 4, 5 })
+    {
+        std::vector<uint32_t> totals(cases);
+        std::minstd_rand r(43);
+        for (uint64_t i = 0; i < cases; i++)
+        {
+            std::string s1 = short_operand(r), s2 = short_operand(r);
+            TREG y = input(s2.c_str());
+            count_op(op, mult(input(s1.c_str()), y), y);
+            totals[i] = prim_total(prim_count);
+        }
+        print_distribution((std::string(op_name[op]) + " (exact)").c_str(), totals);
+    }
+}
+
+#define WORST_SHARD   20000 // Evaluations of a search shard
+#define WORST_SAMPLES 2000  // Random pairs sampled by a shard before it starts climbing
+#define WORST_STUCK   300   // Mutations without an improvement that end a climb
+#define WORST_TOP     10    // Worst cases kept by each shard and reported per operation
+
+// Operand pair together with its primitive counts
+struct TWorst
+{
+    TREG x, y;
+    uint32_t total;
+    uint32_t counts[PRIM_MAX];
+};
+
+// Runs the operation on the pair and stores its primitive counts
+static void worst_eval(int op, TWorst &w)
+{
+    count_op(op, w.x, w.y);
+    std::memcpy(w.counts, prim_count, sizeof(prim_count));
+    w.total = prim_total(prim_count);
+}
+
+// Returns a random normalized non-zero operand, drawn the same way as the randomized tests
+static TREG worst_operand(std::minstd_rand &r, const std::deque<TCORPUSNUMBER> &c)
+{
+    TREG x;
+    do
+        x = input(random_operand(r, c[r() % c.size()].src[0]).c_str());
+    while (x.mant[0] == '0');
+    return x;
+}
+
+// Changes a single mantissa digit or the exponent of one of the operands, keeping it normalized
+static void worst_mutate(std::minstd_rand &r, TWorst &w)
+{
+    TREG &t = (r() & 1) ? w.x : w.y;
+    int k = r() % (MAX_MANT + 1);
+    if (k == MAX_MANT)
+        t.exps = uint8_t(std::min(128 + 99, std::max(128 - 99, int(t.exps) + int(r() % 7) - 3)));
+    else
+        t.mant[k] = k ? char('0' + r() % 10) : char('1' + r() % 9);
+}
+
+// Keeps the list sorted by the total count, with at most WORST_TOP pairs of distinct mantissas (the
+// climbs of mult() and div() would otherwise fill it with the exponent variations of a single pair)
+static void worst_insert(std::vector<TWorst> &top, const TWorst &w)
+{
+    for (const TWorst &t : top)
+    {
+        if (!memcmp(t.x.mant, w.x.mant, MAX_MANT) && !memcmp(t.y.mant, w.y.mant, MAX_MANT))
+            return;
+    }
+    top.push_back(w);
+    std::stable_sort(top.begin(), top.end(), [](const TWorst &a, const TWorst &b) { return a.total > b.total; });
+    if (top.size() > WORST_TOP)
+        top.pop_back();
+}
+
+// Results of a single search shard
+struct TWorstShard
+{
+    std::vector<uint32_t> samples; // Totals of the random pairs
+    std::vector<TWorst> top; // Worst cases found
+};
+
+static void worst_shard(int op, int shard, TWorstShard &result)
+{
+    const std::deque<TCORPUSNUMBER> &c = corpus();
+    std::minstd_rand r(43 + shard); // Reproducible random number seed of the shard
+
+    // Guided random: sample the pairs and keep the costliest ones as the starting points of the climbs
+    std::vector<TWorst> starts;
+    for (int i = 0; i < WORST_SAMPLES; i++)
+    {
+        TWorst w;
+        w.x = worst_operand(r, c);
+        w.y = worst_operand(r, c);
+        worst_eval(op, w);
+        result.samples.push_back(w.total);
+        worst_insert(starts, w);
+    }
+
+    // Hill-climb from each starting point in turn until the evaluations of the shard are used up
+    int evals = WORST_SAMPLES;
+    for (size_t s = 0; evals < WORST_SHARD; s = (s + 1) % starts.size())
+    {
+        TWorst best = starts[s];
+        for (int stuck = 0; (stuck < WORST_STUCK) && (evals < WORST_SHARD); evals++)
+        {
+            TWorst w = best;
+            worst_mutate(r, w);
+            worst_eval(op, w);
+            stuck = w.total > best.total ? 0 : stuck + 1;
+            if (w.total >= best.total) // Also walk along the plateaus
+                best = w;
+        }
+        starts[s] = best;
+        worst_insert(result.top, best);
+    }
+}
+
+static void print_reg(const TREG &r)
+{
+    std::cout << (r.sign ? '-' : '+') << r.mant << " E" << std::showpos << std::setw(3) << std::internal << std::setfill('0') << int(r.exps) - 128
+              << std::noshowpos << std::setfill(' ') << std::right;
+}
+
+void counters_worst(uint64_t evals, int threads)
+{
+    if (threads <= 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    int shards = int((evals + WORST_SHARD - 1) / WORST_SHARD);
+    std::cout << "WORST-CASE LATENCY SEARCH (" << uint64_t(shards) * WORST_SHARD << " evaluations per operation, " << shards << " shards, "
+              << threads << " threads)\n";
+
+    for (int op = 0; op < BINARY_OPS; op++)
+    {
+        std::vector<TWorstShard> results(shards);
+        std::atomic<int> next_shard(0);
+        auto worker = [&]()
+        {
+            int shard;
+            while ((shard = next_shard++) < shards)
+                worst_shard(op, shard, results[shard]);
+        };
+        std::vector<std::thread> pool;
+        for (int i = 0; i < threads; i++)
+            pool.emplace_back(worker);
+        for (std::thread &t : pool)
+            t.join();
+
+        // Merge the shard results in the shard order
+        std::vector<uint32_t> samples;
+        std::vector<TWorst> top;
+        for (TWorstShard &shard : results)
+        {
+            samples.insert(samples.end(), shard.samples.begin(), shard.samples.end());
+            for (const TWorst &w : shard.top)
+                worst_insert(top, w);
+        }
+
+        std::cout << "Operation " << op_name[op] << ":\n";
+        std::cout << "  Random pairs           min      mean    max  histogram (" << HIST_BUCKETS << " buckets from 0 to max)\n";
+        print_distribution("total", samples);
+        std::cout << "  Worst cases found (total primitive count):\n";
+        for (const TWorst &w : top)
+        {
+            std::cout << "  " << std::setw(7) << w.total << "  ";
+            print_reg(w.x);
+            std::cout << op_str[op];
+            print_reg(w.y);
+            std::cout << " :";
+            print_prims(w.counts);
+        }
+    }
+}
+
+#else // PROOF_COUNTERS
+
+void counters_test(uint64_t)
+{
+    std::cout << "Primitive counters are not compiled in, build with -DPROOF_COUNTERS (make calccount)\n";
+}
+
+void counters_worst(uint64_t, int)
+{
+    counters_test(0);
+}
+
+#endif // PROOF_COUNTERS
@@ -18,16 +18,18 @@
 // - The sign of the result is the xor of the signs of individual terms
 // - The exponent of the result is the difference of the exponents of individual terms
 // - While dividend >= divisor, subtract divisor and increment quotient digit
-// - Otherwise, shift dividend left by one digit and repeat until all digits are processed
+// - Otherwise, shift dividend left by one digit and repeat until all digits are processed,
+//   or until the dividend becomes zero
 // - Normalize the result
 
-TREG div(TREG x, TREG y)
+template<int M>
+TReg<M> div(const TReg<M> &x, const TReg<M> &y)
 {
-    TREG result(x.fp / y.fp);
+    TReg<M> result;
 
-    TASR scratch1(x); // scratch1 == Dividend == x
-    TASR scratch2(y); // scratch2 == Divisor == y
-    TASR scratch3; // result
+    TAsr<M> scratch1(x); // scratch1 == Dividend == x
+    TAsr<M> scratch2(y); // scratch2 == Divisor == y
+    TAsr<M> scratch3; // result
     scratch_clear(scratch3);
 
     // The sign of the result is the xor of the signs of the individual terms
@@ -38,17 +40,14 @@ TREG div(TREG x, TREG y)
 
     if (y_is_0)
     {
-        // XXX "Division by zero error"
-        std::cout << " *** DIV0 *** ";
-        result.exps = 0; // XXX Signal to DIV0 error
+        result.flags = FLAG_DIV0; // Division by zero error, reported by print()
         return result; // Return zero
     }
     if (x_is_0)
         return result; // Return zero
 
     // The exponent of the result is the difference of the exponents of individual terms
-    result.exps = exp_sub(x, y);
-    // XXX Process overflows and underflows
+    result.exps = exp_sub(x, y); // The range is checked once the result is normalized
 
     // Before we start, shift both dividend and divisor one digit to the right, freeing the most significant digit
     // This is done to compensate for the first dividend shift left in the cases when it was less than the divisor
@@ -56,23 +55,17 @@ TREG div(TREG x, TREG y)
     scratch_shr(scratch2);
 
     // ----------- DIVISION OPERATION -----------
-    for (int8_t i = 0; i < MAX_SCRATCH; i++) // MSB to LSB processing
+    for (int8_t i = 0; i < TAsr<M>::S; i++) // MSB to LSB processing
     {
+        bool subtracted = false;
         while (scratch_is_greater_or_equal(scratch1, scratch2)) // Divisor will go into a dividend
         {
+            subtracted = true;
             // Subtract divisor from a dividend and assign the result to be the new dividend
 
             // Subtract individual mantissa BCD digits, with borrow
             // The borrow will never undeflow the final value since we are always subtracting a smaller mantissa from the larger one
-            bool borrow = 0;
-            for (int k = MAX_SCRATCH - 1; k >= 0; k--)
-            {
-                char bcd1 = scratch1.mant[k] - '0';
-                char bcd2 = scratch2.mant[k] - '0';
-                char sub = bcd_sbc(bcd1, bcd2, borrow);
-                scratch1.mant[k] = sub + '0';
-            }
-            if (borrow)
+            if (scratch_sub(scratch1, scratch2))
                 std::cerr << "Unexpected borrow in " << __FUNCTION__ << ":" << __LINE__ << "\n";
 
             if (scratch3.mant[i] > '9')
@@ -81,6 +74,10 @@ TREG div(TREG x, TREG y)
             scratch3.mant[i]++; // Increment the quotient digit by one
         }
 
+        // Once the dividend is used up, all the remaining quotient digits are zero
+        if (subtracted && scratch_is_0(scratch1))
+            break;
+
         // Shift left dividend by one digit and repeat until all digits are processed
         scratch_shl(scratch1);
     }
@@ -92,14 +89,119 @@ TREG div(TREG x, TREG y)
         result.exps--;
     }
 
-    memcpy(result.mant, scratch3.mant, MAX_MANT);
+    memcpy(result.mant, scratch3.mant, M);
+    exp_range(result);
 
     return result;
 }
 
-TREG div(const char *a, const char *b)
+// Table-driven division, a faster variant of div() which gives the same truncated result:
+// - Precompute the multiples 1x..9x of the divisor once
+// - For each quotient digit, find the largest multiple that still goes into the dividend
+//   by a binary search (at most 4 compares) and subtract it only once
+template<int M>
+TReg<M> div_table(const TReg<M> &x, const TReg<M> &y)
 {
-    return div(input(a), input(b));
+    TReg<M> result;
+
+    TAsr<M> scratch1(x); // scratch1 == Dividend == x
+    TAsr<M> scratch2(y); // scratch2 == Divisor == y
+    TAsr<M> scratch3; // result
+    scratch_clear(scratch3);
+
+    // The sign of the result is the xor of the signs of the individual terms
+    result.sign = x.sign ^ y.sign;
+
+    bool x_is_0 = scratch_is_0(scratch1);
+    bool y_is_0 = scratch_is_0(scratch2);
+
+    if (y_is_0)
+    {
+        result.flags = FLAG_DIV0; // Division by zero error, reported by print()
+        return result; // Return zero
+    }
+    if (x_is_0)
+        return result; // Return zero
+
+    // The exponent of the result is the difference of the exponents of individual terms
+    result.exps = exp_sub(x, y); // The range is checked once the result is normalized
+
+    // Before we start, shift both dividend and divisor one digit to the right, freeing the most significant digit
+    scratch_shr(scratch1);
+    scratch_shr(scratch2);
+
+    // Multiples of the divisor; the shifted divisor is less than 10^(TAsr<M>::S-1) so 9x still fits
+    TAsr<M> multiple[10];
+    for (int d = 0; d < 10; d++)
+        scratch_mult_digit(multiple[d], scratch2, d);
+
+    // ----------- DIVISION OPERATION -----------
+    for (int8_t i = 0; i < TAsr<M>::S; i++) // MSB to LSB processing
+    {
+        // Find the largest digit d where multiple[d] <= dividend; multiple[0] always qualifies
+        int lo = 0, hi = 9;
+        while (lo < hi)
+        {
+            int mid = (lo + hi + 1) / 2;
+            if (scratch_is_greater_or_equal(scratch1, multiple[mid]))
+                lo = mid;
+            else
+                hi = mid - 1;
+        }
+
+        scratch3.mant[i] = lo + '0'; // The quotient digit
+        if (lo)
+        {
+            // Subtract the multiple of the divisor from a dividend and assign the result to be the new dividend
+            if (scratch_sub(scratch1, multiple[lo]))
+                std::cerr << "Unexpected borrow in " << __FUNCTION__ << ":" << __LINE__ << "\n";
+
+            // Once the dividend is used up, all the remaining quotient digits are zero
+            if (scratch_is_0(scratch1))
+                break;
+        }
+
+        // Shift left dividend by one digit and repeat until all digits are processed
+        scratch_shl(scratch1);
+    }
+
+    // Normalize the result in the scratch register
+    if (scratch3.mant[0] == '0')
+    {
+        scratch_shl(scratch3);
+        result.exps--;
+    }
+
+    memcpy(result.mant, scratch3.mant, M);
+    exp_range(result);
+
+    return result;
+}
+
+#define INSTANTIATE(M) \
+    template TReg<M> div(const TReg<M> &, const TReg<M> &); \
+    template TReg<M> div_table(const TReg<M> &, const TReg<M> &);
+PROOF_WIDTHS(INSTANTIATE)
+
+TVERIF div(const TVERIF &x, const TVERIF &y)
+{
+    return TVERIF(div(x.reg, y.reg), x.fp / y.fp);
+}
+
+TVERIF div(const char *a, const char *b)
+{
+    return div(TVERIF(a), TVERIF(b));
+}
+
+// Checks the table-driven division against the reference algorithm
+static void div_table_check(const TVERIF &x, const TVERIF &y, const TREG &expected)
+{
+    TREG result = div_table(x.reg, y.reg);
+    if (result != expected)
+    {
+        std::cout << x.src << " / " << y.src << " *** div_table() mismatch: " << (result.sign ? '-' : '+') << result.mant << " (" << int(result.exps) << ") ***\n";
+        tests_fail++;
+    }
 }
 
 void div_test()
@@ -107,28 +209,7 @@ void div_test()
     std::cout << "DIVISION TEST\n";
     const std::string h1 = " Operand 1       OP Operand 2         Internal normalized    Exp    ID  Internal printed          Verification value\n";
 
-    // Input buffer: 16 characters
-    //   0123456789012345
-    static std::vector<std::string> tests = { // Non-exponential numbers
-        " 1              ",
-        " 1.000000000001 ",
-        " 1.0000000000001",
-        " 1.2345678901234",
-        " 1234567890123.4",
-        " 123456789012345",
-        " 9              ",
-        " 99             ",
-        " 99999999999999 ",
-        " 999999999999999",
-        " 0.1            ",
-        " 0.01           ",
-        " 0.0000000000001",
-        " 0.0000000000009",
-        " 0.1234567890123",
-        " 3.1415926535897",
-        " 2.7182818284590",
-    };
-
+    const std::deque<TCORPUSNUMBER> &c = corpus(true);
     static const std::string header[4] = {
         " of non-exponential numbers:",
         " of non-exponential negative with positive number -x,y:",
@@ -144,20 +225,13 @@ void div_test()
         std::cout << "Division" << header[signs] << "\n";
         std::cout << h1;
         // Combine each number from the test set with each other
-        for (std::string &s : tests)
+        corpus_cross(c, signs, [&](const TVERIF &x, const TVERIF &y)
         {
-            for (std::string &t : tests)
-            {
-                std::string s2 = s;
-                if (signs & 1)
-                    s2[0] = '-';
-                std::string t2 = t;
-                if (signs & 2)
-                    t2[0] = '-';
-                std::cout << s2 << " / " << t2;
-                div(s2.c_str(), t2.c_str()).print(test_number++);
-            }
-        }
+            std::cout << x.src << " / " << y.src;
+            TVERIF r = div(x, y);
+            r.print(test_number++);
+            div_table_check(x, y, r.reg);
+        });
     }
 #endif
 #if 1
@@ -168,30 +242,17 @@ void div_test()
     rnd.seed(43); // Reproducible random number seed
     for (int test_number = 1; test_number <= 500; test_number++)
     {
-        int index1 = rnd() % tests.size();
-        int index2 = rnd() % tests.size();
-
-        std::string s1 = tests[index1].substr(0, 12);
-        s1[1] = rdigit(10);
-        if (s1[2] == ' ')
-            s1[2] = '.';
-        s1[3] = rdigit(10);
-        s1[0] = (rnd() & 1) ? ' ' : '-';
-        // Needs to be in a separate line for rnd() consistency across the platforms
-        char e1 = rdigit(2), e2 = rdigit(10);
-        s1 = s1 + "E" + ((rnd() & 1) ? '-' : '+') + e1 + e2;
-
-        std::string s2 = tests[index2].substr(0, 12);
-        s2[1] = rdigit(10);
-        if (s2[2] == ' ')
-            s2[2] = '.';
-        s2[3] = rdigit(10);
-        s2[0] = (rnd() & 1) ? ' ' : '-';
-        e1 = rdigit(2), e2 = rdigit(10);
-        s2 = s2 + "E" + ((rnd() & 1) ? '-' : '+') + e1 + e2;
+        int index1 = rnd() % c.size();
+        int index2 = rnd() % c.size();
+
+        std::string s1 = random_operand(rnd, c[index1].src[0]);
+        std::string s2 = random_operand(rnd, c[index2].src[0]);
 
         std::cout << s1 << " / " << s2;
-        div(s1.c_str(), s2.c_str()).print(test_number);
+        TVERIF x(s1.c_str()), y(s2.c_str());
+        TVERIF r = div(x, y);
+        r.print(test_number);
+        div_table_check(x, y, r.reg);
     }
 #endif
 }
@@ -0,0 +1,247 @@
+/*  Copyright (C) 2021  Goran Devic
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+*/
+#include "Common.h"
+
+// Fused multiply-add heuristic, x * y + z:
+// - If any one of the two factors is zero, return z, done.
+// - Multiply the mantissas by the partial product rows of mult(), skipping the zero digits of the
+//   multiplier, into a double-length scratch register which holds the complete product, so that no
+//   digit is lost when the terms cancel out
+// - Normalize the product in the scratch register; its exponent is the sum of the exponents
+// - Align the product and z, then add or subtract them as add_sub() does, with the product
+//   taking the place of the first term. When both of them fit into a scratch register once aligned,
+//   the addition runs on the scratch registers instead of the double-length ones
+// - Normalize and truncate the result once
+//
+// Compared to mult() followed by add_sub(), the product is not truncated to M digits before the
+// addition, and there is only one set of scratch registers and one final normalization.
+
+// Aligns the normalized product scratch3 and the addend scratch4, adds or subtracts them and truncates
+// the sum once; W is the width of the scratch registers that hold them
+template<int M, int W>
+static TReg<M> fma_add_sub(TAsr<W> &scratch3, TAsr<W> &scratch4, bool p_sign, uint8_t exp_p, const TReg<M> &z)
+{
+    TReg<M> result;
+
+    // ----------- ALIGNMENT -----------
+    // If the required alignment shift is larger than the scratch width, return the larger value truncated
+    uint8_t exp_z = z.exps;
+    if (exp_p < exp_z) // Shift right the product
+    {
+        uint8_t shift = exp_z - exp_p;
+        if (shift >= TAsr<W>::S)
+        {
+            // Return the z value
+            memcpy(result.mant, scratch4.mant, M);
+            result.sign = z.sign;
+            result.exps = z.exps;
+
+            return result;
+        }
+        scratch_shr(scratch3, shift);
+
+        result.exps = exp_z; // Result exponent is that of the 'z' term
+    }
+    else // Shift right z
+    {
+        uint8_t shift = exp_p - exp_z;
+        if (shift >= TAsr<W>::S)
+        {
+            // Return the product
+            memcpy(result.mant, scratch3.mant, M);
+            result.sign = p_sign;
+            result.exps = exp_p;
+            exp_range(result);
+
+            return result;
+        }
+        scratch_shr(scratch4, shift);
+
+        result.exps = exp_p; // Result exponent is that of the product
+    }
+
+    if (p_sign == z.sign)
+    {
+        // ----------- ADDITION OPERATION -----------
+        // If we have a carry set after the MSB digit, we need to insert "1" as the topmost digit
+        if (scratch_add(scratch3, scratch4))
+        {
+            scratch_shr(scratch3);
+            scratch3.mant[0] = '1';
+            result.exps++; // Also adjust the exponent
+        }
+
+        // The sign of the result is the sign of any one of the terms (since they are both the same)
+        result.sign = p_sign;
+    }
+    else
+    {
+        // ----------- SUBTRACTION OPERATION -----------
+        bool p_ge_z = scratch_is_greater_or_equal(scratch3, scratch4);
+        if (!p_ge_z) // Subtract smaller from the larger value
+            scratch_swap(scratch3, scratch4);
+
+        // The borrow will never undeflow the final value since we are always subtracting a smaller mantissa from the larger one
+        if (scratch_sub(scratch3, scratch4))
+            std::cerr << "Unexpected borrow in " << __FUNCTION__ << ":" << __LINE__ << "\n";
+
+        // The sign of the result is the sign of the product XOR whether we swapped the terms
+        result.sign = p_sign ^ !p_ge_z;
+
+        if (scratch_is_0(scratch3))
+        {
+            result.exps = 128; // Make the result true 0
+            result.sign = false;
+        }
+        else // Normalize the result
+        {
+            while (scratch3.mant[0] == '0')
+            {
+                scratch_shl(scratch3);
+                result.exps--; // Also adjust the exponent
+            }
+        }
+    }
+
+    memcpy(result.mant, scratch3.mant, M);
+    exp_range(result);
+
+    return result;
+}
+
+template<int M>
+TReg<M> fma(const TReg<M> &x, const TReg<M> &y, const TReg<M> &z)
+{
+    TReg<M> result;
+
+    TAsr<M> scratch1(x); // scratch1 == Multiplicand == x
+    TAsr<M> scratch2(y); // scratch2 == Multiplier == y
+    TAsrWide<M> scratch3; // Product
+    TAsr<M> scratch4(z); // Addend == z
+
+    int z_length = scratch_length(scratch4);
+    bool z_is_0 = z_length == 0;
+    if (scratch_is_0(scratch1) || scratch_is_0(scratch2))
+    {
+        // Return the z value
+        memcpy(result.mant, scratch4.mant, M);
+        result.sign = z.sign;
+        result.exps = z.exps;
+
+        if (z_is_0) // Make it a true 0 (not potentially a negative zero)
+        {
+            result.exps = 128;
+            result.sign = false;
+        }
+        return result;
+    }
+
+    // ----------- MULTIPLICATION OPERATION -----------
+    bool p_sign = x.sign ^ y.sign;
+    uint8_t exp_p = exp_add(x, y); // The range is checked once the result is normalized
+    int p_length = mult_wide_scratch(scratch1, scratch2, scratch3);
+
+    // Normalize the product in the scratch register: the digit [0] becomes the leading digit
+    if (scratch3.mant[0] == '0')
+    {
+        scratch_shl(scratch3);
+        p_length--;
+    }
+    else
+        exp_p++;
+
+    if (z_is_0)
+    {
+        memcpy(result.mant, scratch3.mant, M);
+        result.sign = p_sign;
+        result.exps = exp_p;
+        exp_range(result);
+        return result;
+    }
+
+    // When the product and z still fit into a scratch register once they are aligned, no digit of them
+    // is lost there, and the addition runs on about half of the digits of the double-length registers.
+    // An addition also fits when only one of the terms reaches past the scratch register, since the
+    // digits that only one term reaches can not carry into the truncated sum
+    bool p_fits = p_length + std::max(0, z.exps - exp_p) <= TAsr<M>::S;
+    bool z_fits = z_length + std::max(0, exp_p - z.exps) <= TAsr<M>::S;
+    if ((p_fits && z_fits) || ((p_sign == z.sign) && (p_fits || z_fits)))
+    {
+        TAsr<M> product;
+        memcpy(product.mant, scratch3.mant, TAsr<M>::S);
+        return fma_add_sub(product, scratch4, p_sign, exp_p, z);
+    }
+    TAsrWide<M> addend;
+    memcpy(addend.mant, scratch4.mant, TAsr<M>::S);
+    memset(addend.mant + TAsr<M>::S, '0', TAsrWide<M>::S - TAsr<M>::S);
+    return fma_add_sub(scratch3, addend, p_sign, exp_p, z);
+}
+
+#define INSTANTIATE(M) \
+    template TReg<M> fma(const TReg<M> &, const TReg<M> &, const TReg<M> &);
+PROOF_WIDTHS(INSTANTIATE)
+
+// Checks one fused multiply-add against the exact oracle, and tallies how the same operation fares
+// when it is computed as mult() followed by add_sub(); returns the check status of the fma
+static int fma_check(const char *a, const TREG &x, const char *b, const TREG &y, const char *c, const TREG &z, int id, uint32_t &separate_exact)
+{
+    TREG result = fma(x, y, z);
+    TREG expected;
+    int status = exact_fma_check(x, y, z, result, expected);
+    if (status == CHECK_FAIL)
+        std::cout << a << " * " << b << " + " << c << " = " << (result.sign ? '-' : '+') << result.mant << " (" << int(result.exps) << ") " << id
+                  << "  expected " << (expected.sign ? '-' : '+') << expected.mant << " (" << int(expected.exps) << ")  FAIL\n";
+
+    TREG separate = add_sub(mult(x, y), z, false);
+    separate_exact += exact_fma_check(x, y, z, separate, expected) == CHECK_OK;
+    return status;
+}
+
+void fma_test()
+{
+    std::cout << "FUSED MULTIPLY-ADD TEST\n";
+
+    const std::deque<TCORPUSNUMBER> &c = corpus();
+    uint32_t total = 0, pass = 0, fail = 0, separate_exact = 0;
+    int test_number = 1;
+
+    // Every triple of the test numbers, with all sign variations of the product and the addend
+    for (int signs = 0; signs < 8; signs++)
+    {
+        corpus_cross(c, signs, [&](const TVERIF &x, const TVERIF &y)
+        {
+            for (const TCORPUSNUMBER &t : c)
+            {
+                const TVERIF &z = t.val[(signs >> 2) & 1];
+                int status = fma_check(x.src, x.reg, y.src, y.reg, z.src, z.reg, test_number++, separate_exact);
+                pass += status == CHECK_OK;
+                fail += status == CHECK_FAIL;
+                total++;
+            }
+        });
+    }
+
+    // Pseudo-random exponential tests, generated the same way as in the other test suites
+    rnd.seed(43); // Reproducible random number seed
+    for (int i = 1; i <= 2000; i++)
+    {
+        std::string s1 = random_operand(rnd, c[rnd() % c.size()].src[0]);
+        std::string s2 = random_operand(rnd, c[rnd() % c.size()].src[0]);
+        std::string s3 = random_operand(rnd, c[rnd() % c.size()].src[0]);
+        int status = fma_check(s1.c_str(), input(s1.c_str()), s2.c_str(), input(s2.c_str()), s3.c_str(), input(s3.c_str()), test_number++, separate_exact);
+        pass += status == CHECK_OK;
+        fail += status == CHECK_FAIL;
+        total++;
+    }
+
+    std::cout << "Fused multiply-add operations checked: " << total << "  fail: " << fail << "  rounding errors: " << (total - (pass + fail))
+              << "  exact: " << pass << " (mult + add_sub exact: " << separate_exact << ")\n";
+    tests_total += total;
+    tests_pass += pass;
+    tests_fail += fail;
+}
@@ -0,0 +1,279 @@
+/*  Copyright (C) 2021  Goran Devic
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+*/
+#include "Common.h"
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+// Input parser fuzzing:
+// - Generates valid 16 char input buffers (see the rules in Input.cpp) and checks input() against a
+//   lean reference parser at every width
+// - The enumeration covers every mantissa shape made of '0', '9' and at most one '.', of every length,
+//   with both signs, with or without the exponent, and with the exponents E-99..E+99
+// - The random sampler draws the mantissa length, the decimal point position, a run of leading zeros
+//   and the remaining digits, so that all layouts are reached
+// - Every buffer is followed by guard digits: the parser must never read past the 16 chars
+// - The case space is split into shards the same way as in Verify.cpp: the enumeration shards are the
+//   (sign, exponent) pairs, the random shards each have their own seed; results are merged in order
+
+#define FUZZ_EXP_CODES 201 // No exponent, then E+00..E+99 and E-00..E-99
+#define FUZZ_SHARDS    (2 * FUZZ_EXP_CODES) // Enumeration shards, both signs of each exponent code
+#define FUZZ_RANDOM    100000 // Random cases of a random shard
+#define FUZZ_BATCH     1000 // Buffers parsed together, so that input() can be timed on its own
+#define FUZZ_SLOT      32 // Buffer and its guard digits
+#define FUZZ_PRINT     10 // Failures printed per shard
+
+typedef std::chrono::steady_clock TClock;
+
+// Results of a single shard
+struct TFuzzShard
+{
+    uint64_t total = 0, fail = 0;
+    uint64_t out_of_range = 0; // Buffers whose normalized exponent is outside of E-99..E+99
+    double input_ns = 0; // Time spent in input()
+    std::string failures;
+};
+
+// Lean reference parser: a single pass over the mantissa, following the rules in Input.cpp directly.
+// The value is 0.d1d2d3... scaled by the number of significant digits in front of the decimal point,
+// or by the number of zeros behind it when there are none
+template<int M>
+static void input_reference(const char *in, TReg<M> &result)
+{
+    int maxi = 16, e = 0;
+    if (in[12] == 'E')
+    {
+        e = (in[14] - '0') * 10 + (in[15] - '0');
+        if (in[13] == '-')
+            e = -e;
+        maxi = 12;
+    }
+
+    int digits = 0; // Significant digits
+    int int_digits = 0; // Significant digits in front of the decimal point
+    int frac_zeros = 0; // Zeros behind the decimal point, ahead of the first significant digit
+    bool dot = false;
+    std::memset(result.mant, '0', M);
+    for (int i = 1; (i < maxi) && (in[i] != ' '); i++)
+    {
+        char c = in[i];
+        if (c == '.')
+            dot = true;
+        else if (!digits && (c == '0'))
+            frac_zeros += dot;
+        else
+        {
+            if (digits < M)
+                result.mant[digits] = c;
+            digits++;
+            int_digits += !dot;
+        }
+    }
+
+    result.sign = in[0] == '-'; // Zero keeps its sign, the same as in input()
+    int pow = digits ? e + (int_digits ? int_digits - 1 : -frac_zeros - 1) : 0;
+    result.exps = uint8_t(128 + pow);
+    result.flags = 0;
+    if (pow > EXP_MAX) // Saturates to the largest magnitude
+    {
+        std::memset(result.mant, '9', M);
+        result.exps = 128 + EXP_MAX;
+        result.flags = FLAG_OVERFLOW;
+    }
+    if (pow < -EXP_MAX) // Flushes to zero
+    {
+        std::memset(result.mant, '0', M);
+        result.sign = false;
+        result.exps = 128;
+        result.flags = FLAG_UNDERFLOW;
+    }
+}
+
+// Fills in the sign and the exponent of the buffer and clears its mantissa; returns the mantissa end
+static int fuzz_frame(char *in, bool neg, int code)
+{
+    std::memset(in, ' ', 16);
+    std::memset(in + 16, '9', FUZZ_SLOT - 16); // Guard digits
+    in[0] = neg ? '-' : ' ';
+    if (!code)
+        return 16;
+    in[12] = 'E';
+    in[13] = code <= 100 ? '+' : '-';
+    in[14] = '0' + (code - 1) % 100 / 10;
+    in[15] = '0' + (code - 1) % 10;
+    return 12;
+}
+
+// Calls f(in) for every mantissa shape of the enumeration shard
+template<typename F>
+static void fuzz_enumerate(int shard, F f)
+{
+    alignas(8) char in[FUZZ_SLOT];
+    bool neg = shard & 1;
+    int code = shard / 2;
+    int maxi = fuzz_frame(in, neg, code);
+    for (int len = 1; len < maxi; len++)
+    {
+        for (int dot = -1; dot < len; dot++) // Position of the decimal point, -1 for none
+        {
+            int digits = len - (dot >= 0);
+            for (uint32_t pattern = 0; pattern < (1u << digits); pattern++)
+            {
+                for (int k = 0, bit = 0; k < len; k++)
+                    in[1 + k] = k == dot ? '.' : ((pattern >> bit++) & 1) ? '9' : '0';
+                f(in);
+            }
+        }
+    }
+}
+
+// Generates a random valid buffer
+static void fuzz_random(std::minstd_rand &r, char *in)
+{
+    int code = (r() & 1) ? 1 + r() % 200 : 0;
+    int maxi = fuzz_frame(in, r() & 1, code);
+    int len = 1 + r() % (maxi - 1);
+    int dot = int(r() % (len + 1)) - 1;
+    int lead = r() % (len + 1); // Run of leading zeros
+    for (int k = 0; k < len; k++)
+        in[1 + k] = k == dot ? '.' : ((k < lead) || !(r() % 3)) ? '0' : char('1' + r() % 9);
+}
+
+// Parses a batch of buffers with input(), timing it, then checks the results against the reference
+template<int M>
+static void fuzz_batch(const std::vector<char> &slots, size_t n, TFuzzShard &result)
+{
+    static thread_local std::vector<TReg<M>> parsed(FUZZ_BATCH);
+    TClock::time_point start = TClock::now();
+    for (size_t i = 0; i < n; i++)
+        parsed[i] = input<M>(&slots[i * FUZZ_SLOT]);
+    result.input_ns += std::chrono::duration<double, std::nano>(TClock::now() - start).count();
+
+    for (size_t i = 0; i < n; i++)
+    {
+        const char *in = &slots[i * FUZZ_SLOT];
+        TReg<M> expected;
+        input_reference(in, expected);
+        result.out_of_range += expected.flags != 0;
+        result.total++;
+        if (parsed[i] == expected)
+            continue;
+        if (++result.fail <= FUZZ_PRINT)
+        {
+            std::ostringstream s;
+            const TReg<M> &r = parsed[i];
+            s << "\"" << std::string(in, 16) << "\"  input(): " << (r.sign ? '-' : '+') << r.mant << " (" << int(r.exps) << ")  expected "
+              << (expected.sign ? '-' : '+') << expected.mant << " (" << int(expected.exps) << ")  FAIL\n";
+            result.failures += s.str();
+        }
+    }
+}
+
+// Runs one shard: the enumeration shards come first, followed by the random shards
+template<int M>
+static void fuzz_shard(int shard, TFuzzShard &result)
+{
+    std::vector<char> slots(FUZZ_BATCH * FUZZ_SLOT);
+    size_t n = 0;
+    auto add = [&](const char *in)
+    {
+        std::memcpy(&slots[n * FUZZ_SLOT], in, FUZZ_SLOT);
+        if (++n == FUZZ_BATCH)
+            fuzz_batch<M>(slots, n, result), n = 0;
+    };
+
+    if (shard < FUZZ_SHARDS)
+        fuzz_enumerate(shard, add);
+    else
+    {
+        std::minstd_rand r(43 + shard - FUZZ_SHARDS);
+        alignas(8) char in[FUZZ_SLOT];
+        for (int i = 0; i < FUZZ_RANDOM; i++)
+        {
+            fuzz_random(r, in);
+            add(in);
+        }
+    }
+    if (n)
+        fuzz_batch<M>(slots, n, result);
+}
+
+// Runs the given shards on a pool of threads and prints the merged results of the width M
+template<int M>
+static void fuzz_run(const std::vector<int> &shards, int threads, bool timing)
+{
+    std::vector<TFuzzShard> results(shards.size());
+    std::atomic<size_t> next_shard(0);
+    auto worker = [&]()
+    {
+        size_t i;
+        while ((i = next_shard++) < shards.size())
+            fuzz_shard<M>(shards[i], results[i]);
+    };
+    TClock::time_point start = TClock::now();
+    std::vector<std::thread> pool;
+    for (int i = 0; i < threads; i++)
+        pool.emplace_back(worker);
+    for (std::thread &t : pool)
+        t.join();
+    double wall = std::chrono::duration<double>(TClock::now() - start).count();
+
+    TFuzzShard total;
+    for (TFuzzShard &shard : results)
+    {
+        std::cout << shard.failures;
+        total.total += shard.total;
+        total.fail += shard.fail;
+        total.out_of_range += shard.out_of_range;
+        total.input_ns += shard.input_ns;
+    }
+
+    std::cout << "Input buffers at " << std::setw(2) << M << " digits: checked: " << total.total << "  fail: " << total.fail
+              << "  exponent out of range: " << total.out_of_range;
+    if (timing)
+        std::cout << std::fixed << std::setprecision(1) << "  input(): " << total.input_ns / total.total << " ns/parse  checked: "
+                  << total.total / wall / 1e6 << " M buffers/s on " << threads << " threads" << std::defaultfloat;
+    std::cout << "\n";
+    tests_total += total.total;
+    tests_pass += total.total - total.fail;
+    tests_fail += total.fail;
+}
+
+// Part of the default test suite: the enumeration with the exponents none, E+00, E-00, E+99 and E-99,
+// and one random shard, at every width on a single thread
+void fuzz_test()
+{
+    std::cout << "INPUT PARSER FUZZING TEST\n";
+    std::vector<int> shards;
+    for (int code : { 0, 1, 100, 101, 200 })
+        shards.push_back(2 * code), shards.push_back(2 * code + 1);
+    shards.push_back(FUZZ_SHARDS);
+
+#define RUN_FUZZ(M) fuzz_run<M>(shards, 1, false);
+    PROOF_WIDTHS(RUN_FUZZ)
+}
+
+// Throughput mode: the complete enumeration followed by the given number of random cases, at every
+// width on all threads; returns the number of failed cases
+uint64_t fuzz_parallel(uint64_t cases, int threads)
+{
+    if (threads <= 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+
+    std::vector<int> shards;
+    int random_shards = int((cases + FUZZ_RANDOM - 1) / FUZZ_RANDOM);
+    for (int i = 0; i < FUZZ_SHARDS + random_shards; i++)
+        shards.push_back(i);
+    std::cout << "INPUT PARSER FUZZING (" << FUZZ_SHARDS << " enumeration shards, " << random_shards << " random shards of "
+              << FUZZ_RANDOM << " cases, " << threads << " threads)\n";
+
+    uint64_t fail = tests_fail;
+#define RUN_FUZZ_PARALLEL(M) fuzz_run<M>(shards, threads, true);
+    PROOF_WIDTHS(RUN_FUZZ_PARALLEL)
+    return tests_fail - fail;
+}
@@ -0,0 +1,261 @@
+/*  Copyright (C) 2021  Goran Devic
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+*/
+#include "Common.h"
+#include <chrono>
+#ifdef _WIN32
+#include <windows.h>
+static int file_seek(FILE *f, uint64_t offset) { return _fseeki64(f, __int64(offset), SEEK_SET); }
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+static int file_seek(FILE *f, uint64_t offset) { return fseeko(f, off_t(offset), SEEK_SET); }
+#endif
+
+// Golden result files:
+// - A header followed by one fixed-size record per case, the record of the test ID n is at the index n - 1,
+//   so the shards of a parallel run can write their records in any order
+// - The records hold the packed operands and the packed result, so a file can be compared against
+//   another run without parsing any text
+// - The comparison maps both files into memory and compares them in blocks, looking at the individual
+//   records only inside the blocks that differ
+
+#define GOLDEN_MAGIC "CALCGLD2" // 2: the byte after the status holds the FLAG_* of the result
+#define GOLDEN_BLOCK 4096 // Records compared together
+#define GOLDEN_PRINT 20   // Differing records printed
+
+typedef struct TGoldenHeader
+{
+    char magic[8];
+    uint64_t records;
+    uint32_t engine; // ENGINE_* used for the run
+    uint32_t exact; // Set to 1 if the statuses come from the exact oracle
+    uint64_t key; // Identifies the sources and the parameters of the run, 0 if not used
+} TGOLDENHEADER;
+
+static_assert(sizeof(TGOLDENHEADER) == sizeof(TGOLDEN), "The golden records need to stay aligned after the header");
+
+TGOLDEN golden_record(int op, const TREG &x, const TREG &y, const TREG &result, int status)
+{
+    TGOLDEN g;
+    std::memset(&g, 0, sizeof(g));
+    TPREG px = pack(x), py = pack(y), pr = pack(result);
+    g.x = px.mant, g.y = py.mant, g.result = pr.mant;
+    g.x_exps = px.exps, g.y_exps = py.exps, g.result_exps = pr.exps;
+    g.signs = uint8_t(px.sign | (py.sign << 1) | (pr.sign << 2));
+    g.op = uint8_t(op);
+    g.status = uint8_t(status);
+    g.flags = pr.flags;
+    return g;
+}
+
+bool TGoldenFile::open(const char *path, uint64_t records, int engine, bool exact, uint64_t key)
+{
+    f = fopen(path, "wb");
+    if (!f)
+        return false;
+    TGOLDENHEADER h;
+    std::memset(&h, 0, sizeof(h));
+    std::memcpy(h.magic, GOLDEN_MAGIC, 8);
+    h.records = records;
+    h.engine = uint32_t(engine);
+    h.exact = exact;
+    h.key = key;
+    return fwrite(&h, sizeof(h), 1, f) == 1;
+}
+
+void TGoldenFile::write(uint64_t id, const TGOLDEN *rec, size_t n)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    // The offsets pass 2 GB at about 67M records, beyond a 32-bit long
+    if (file_seek(f, sizeof(TGOLDENHEADER) + (id - 1) * sizeof(TGOLDEN)) || (fwrite(rec, sizeof(TGOLDEN), n, f) != n))
+        errors++;
+}
+
+bool TGoldenFile::close()
+{
+    bool ok = !errors && f && !fclose(f);
+    f = nullptr;
+    return ok;
+}
+
+// Read-only memory mapping of a whole file
+typedef struct TMapped
+{
+    const uint8_t *data = nullptr;
+    size_t size = 0;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE, mapping = nullptr;
+
+    bool map(const char *path)
+    {
+        file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        LARGE_INTEGER n;
+        if ((file == INVALID_HANDLE_VALUE) || !GetFileSizeEx(file, &n) || !n.QuadPart)
+            return false;
+        size = size_t(n.QuadPart);
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        data = mapping ? (const uint8_t *) MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+        return data != nullptr;
+    }
+    ~TMapped()
+    {
+        if (data)
+            UnmapViewOfFile(data);
+        if (mapping)
+            CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE)
+            CloseHandle(file);
+    }
+#else
+    bool map(const char *path)
+    {
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if (fstat(fd, &st) || !st.st_size)
+        {
+            ::close(fd);
+            return false;
+        }
+        size = size_t(st.st_size);
+        void *p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED)
+            return false;
+        madvise(p, size, MADV_SEQUENTIAL);
+        data = (const uint8_t *) p;
+        return true;
+    }
+    ~TMapped()
+    {
+        if (data)
+            munmap((void *) data, size);
+    }
+#endif
+} TMAPPED;
+
+// Maps a golden file and validates its header; returns the records, or nullptr on error
+static const TGOLDEN *golden_map(const char *path, TMAPPED &m, TGOLDENHEADER &h)
+{
+    if (!m.map(path) || (m.size < sizeof(h)))
+        return std::cerr << "Unable to map " << path << "\n", nullptr;
+    std::memcpy(&h, m.data, sizeof(h));
+    if (memcmp(h.magic, GOLDEN_MAGIC, 8) || (m.size != sizeof(h) + h.records * sizeof(TGOLDEN)))
+        return std::cerr << path << " is not a golden file\n", nullptr;
+    return (const TGOLDEN *) (m.data + sizeof(h));
+}
+
+static void print_golden_reg(uint64_t mant, uint8_t exps, bool sign)
+{
+    TPREG p;
+    p.mant = mant, p.exps = exps, p.sign = sign;
+    TREG r;
+    unpack(p, r);
+    printf("%c%s (%3d)", r.sign ? '-' : '+', r.mant, r.exps);
+}
+
+static const char op_char[4] = { '+', '-', '*', '/' };
+static const char *status_name[3] = { "OK", "NEAR", "FAIL" };
+
+// Prints the test ID, the operation and the result of a record
+static void print_golden_case(uint64_t id, const TGOLDEN &a)
+{
+    printf("%llu: ", (unsigned long long) id);
+    print_golden_reg(a.x, a.x_exps, a.signs & 1);
+    printf(" %c ", op_char[a.op & 3]);
+    print_golden_reg(a.y, a.y_exps, a.signs & 2);
+    printf(" = ");
+    print_golden_reg(a.result, a.result_exps, a.signs & 4);
+    printf(" %s", status_name[a.status % 3]);
+}
+
+uint64_t golden_compare(const char *path1, const char *path2)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    TMAPPED m1, m2;
+    TGOLDENHEADER h1, h2;
+    const TGOLDEN *g1 = golden_map(path1, m1, h1);
+    const TGOLDEN *g2 = golden_map(path2, m2, h2);
+    if (!g1 || !g2)
+        return 1;
+    if ((h1.engine != h2.engine) || (h1.exact != h2.exact))
+        std::cout << "Note: the golden files were written with different engines or checks\n";
+
+    uint64_t n = std::min(h1.records, h2.records);
+    uint64_t differ = 0, operands = 0, results = 0, statuses = 0;
+    for (uint64_t block = 0; block < n; block += GOLDEN_BLOCK)
+    {
+        uint64_t count = std::min<uint64_t>(GOLDEN_BLOCK, n - block);
+        if (!memcmp(g1 + block, g2 + block, count * sizeof(TGOLDEN)))
+            continue;
+        for (uint64_t i = block; i < block + count; i++)
+        {
+            const TGOLDEN &a = g1[i], &b = g2[i];
+            if (!memcmp(&a, &b, sizeof(TGOLDEN)))
+                continue;
+            bool same_operands = (a.x == b.x) && (a.y == b.y) && (a.x_exps == b.x_exps) && (a.y_exps == b.y_exps) && ((a.signs & 3) == (b.signs & 3)) && (a.op == b.op);
+            bool same_result = (a.result == b.result) && (a.result_exps == b.result_exps) && ((a.signs & 4) == (b.signs & 4)) && (a.flags == b.flags);
+            operands += !same_operands;
+            results += same_operands && !same_result;
+            statuses += same_operands && same_result;
+            if (++differ > GOLDEN_PRINT)
+                continue;
+            print_golden_case(i + 1, a);
+            printf("  vs  ");
+            if (!same_operands)
+            {
+                print_golden_reg(b.x, b.x_exps, b.signs & 1);
+                printf(" %c ", op_char[b.op & 3]);
+                print_golden_reg(b.y, b.y_exps, b.signs & 2);
+                printf(" = ");
+            }
+            print_golden_reg(b.result, b.result_exps, b.signs & 4);
+            printf(" %s\n", status_name[b.status % 3]);
+        }
+    }
+    double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::cout << "Golden records compared: " << n << "  differing: " << differ << " (operands: " << operands << ", results: " << results
+              << ", status only: " << statuses << ")";
+    if (h1.records != h2.records)
+        std::cout << "  record counts: " << h1.records << " vs " << h2.records;
+    std::cout << "  in " << std::fixed << std::setprecision(1) << t * 1e3 << " ms (" << 2e-9 * n * sizeof(TGOLDEN) / std::max(t, 1e-9) << " GB/s)\n";
+    return differ + (h1.records != h2.records);
+}
+
+bool golden_summary(const char *path, uint64_t key, uint64_t records, uint64_t counts[3])
+{
+    TMAPPED m;
+    TGOLDENHEADER h;
+    if (!m.map(path) || (m.size < sizeof(h)))
+        return false;
+    std::memcpy(&h, m.data, sizeof(h));
+    if (memcmp(h.magic, GOLDEN_MAGIC, 8) || (h.key != key) || (h.records != records) || (m.size != sizeof(h) + records * sizeof(TGOLDEN)))
+        return false;
+    const TGOLDEN *g = (const TGOLDEN *) (m.data + sizeof(h));
+    for (uint64_t i = 0; i < records; i++)
+        counts[g[i].status % 3]++;
+    return true;
+}
+
+void golden_print_failures(const char *path)
+{
+    TMAPPED m;
+    TGOLDENHEADER h;
+    const TGOLDEN *g = golden_map(path, m, h);
+    for (uint64_t i = 0; g && (i < h.records); i++)
+    {
+        if (g[i].status != CHECK_FAIL)
+            continue;
+        print_golden_case(i + 1, g[i]);
+        printf("\n");
+    }
+}
@@ -0,0 +1,133 @@
+/*  Copyright (C) 2021  Goran Devic
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+*/
+#include "Common.h"
+#include <fstream>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+// Incremental randomized verification:
+// - The randomized cases are split into suites by the algorithm under test: add_sub(), mult() and div()
+// - The key of a suite hashes the sources of its algorithm, the sources every suite depends on, the
+//   test corpus and the parameters of the run (number of cases, engine and the oracle)
+// - The sources are hashed by the Makefile when it builds the binary, together with the compiler and the
+//   flags, so the key always describes the code inside the running binary. A binary built without these
+//   hashes keys every suite with the hash of its own executable instead, or always runs the suites if it
+//   can not read it
+// - The results of a suite are kept in the cache directory as a golden file carrying that key; a suite
+//   whose key did not change is reported from its golden file, including its FAIL records, instead of
+//   being run again
+
+typedef struct TSuite
+{
+    const char *name;
+    int ops; // VERIFY_OPS_ALL bits of the operations of the suite
+    uint64_t hash; // Build time hash of the sources of the algorithm
+} TSUITE;
+
+// Build time hashes (Makefile): PROOF_HASH_COMMON covers the sources every suite depends on, the registers,
+// the primitives, the input parser and the corpus, the driver, the oracle, the packed engine and the golden
+// file format; the other ones cover the sources of each algorithm
+#ifndef PROOF_HASH_COMMON
+#define PROOF_HASH_COMMON  0 // Not built by the Makefile, the executable is hashed instead
+#define PROOF_HASH_ADD_SUB 0
+#define PROOF_HASH_MULT    0
+#define PROOF_HASH_DIV     0
+#endif
+
+static const TSUITE suites[] = {
+    { "add_sub", (1 << 0) | (1 << 1), PROOF_HASH_ADD_SUB },
+    { "mult", 1 << 2, PROOF_HASH_MULT },
+    { "div", 1 << 3, PROOF_HASH_DIV },
+};
+
+// 64-bit FNV-1a hash
+static uint64_t fnv1a(uint64_t h, const void *data, size_t n)
+{
+    const uint8_t *p = (const uint8_t *) data;
+    for (size_t i = 0; i < n; i++)
+        h = (h ^ p[i]) * 0x100000001b3ull;
+    return h;
+}
+
+// Returns the hash of the running executable, or 0 if it can not be read
+static uint64_t executable_hash()
+{
+#ifdef _WIN32
+    char path[MAX_PATH];
+    DWORD n = GetModuleFileNameA(nullptr, path, MAX_PATH);
+    std::ifstream f((n && (n < MAX_PATH)) ? path : "", std::ios::binary);
+#else
+    std::ifstream f("/proc/self/exe", std::ios::binary);
+#endif
+    if (!f)
+        return 0;
+    std::string image((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+    return image.empty() ? 0 : fnv1a(0xcbf29ce484222325ull, image.data(), image.size()) | 1;
+}
+
+// Returns the key of the suite, or 0 if the code of the binary can not be identified
+static uint64_t suite_key(const TSUITE &suite, uint64_t cases, int engine, bool exact)
+{
+    static const uint64_t code = PROOF_HASH_COMMON ? uint64_t(PROOF_HASH_COMMON) : executable_hash();
+    if (!code)
+        return 0;
+    uint64_t h = 0xcbf29ce484222325ull;
+    uint64_t hashes[2] = { code, suite.hash };
+    h = fnv1a(h, hashes, sizeof(hashes));
+    for (const TCORPUSNUMBER &n : corpus())
+        h = fnv1a(h, n.src[0], sizeof(n.src[0]));
+    uint64_t params[4] = { cases, uint64_t(engine), uint64_t(exact), uint64_t(suite.ops) };
+    h = fnv1a(h, params, sizeof(params));
+    return h | 1; // A valid key is never 0
+}
+
+uint64_t verify_incremental(uint64_t cases, int threads, int engine, bool exact, const char *cache, bool force)
+{
+    std::cout << "INCREMENTAL RANDOMIZED TESTS (" << cases << " cases per suite, cache " << cache << (force ? ", forced" : "") << ")\n";
+
+    uint64_t total[3] = {};
+    int reran = 0;
+    for (const TSUITE &suite : suites)
+    {
+        uint64_t key = suite_key(suite, cases, engine, exact);
+        std::string path = std::string(cache) + "/" + suite.name + ".golden";
+        uint64_t counts[3] = {};
+        if (!key)
+            std::cout << "Suite " << suite.name << ": the code of the binary can not be identified, running it\n";
+        else if (!force && golden_summary(path.c_str(), key, cases, counts))
+        {
+            std::cout << "Suite " << suite.name << ": unchanged, results from " << path << "\n";
+            if (counts[CHECK_FAIL])
+                golden_print_failures(path.c_str());
+            std::cout << "Total tests: " << cases << "  fail: " << counts[CHECK_FAIL] << "  rounding errors: " << counts[CHECK_NEAR] << "\n";
+            for (int i = 0; i < 3; i++)
+                total[i] += counts[i];
+            continue;
+        }
+        else
+            std::cout << "Suite " << suite.name << ": " << (force ? "forced" : "changed") << ", running it\n";
+
+        // Write the golden file under a temporary name, so that an interrupted run never leaves a valid cache entry
+        std::string temp = path + ".tmp";
+        verify_parallel(cases, threads, engine, exact, temp.c_str(), suite.ops, key);
+        std::remove(path.c_str());
+        if (!golden_summary(temp.c_str(), key, cases, counts) || std::rename(temp.c_str(), path.c_str()))
+        {
+            std::cerr << "Unable to write " << path << "\n";
+            return 1;
+        }
+        for (int i = 0; i < 3; i++)
+            total[i] += counts[i];
+        reran++;
+    }
+
+    std::cout << "Suites run: " << reran << " of " << sizeof(suites) / sizeof(suites[0]) << "\n";
+    std::cout << "Total tests: " << (total[0] + total[1] + total[2]) << "  fail: " << total[CHECK_FAIL] << "  rounding errors: " << total[CHECK_NEAR] << "\n";
+    return total[CHECK_FAIL];
+}
@@ -6,6 +6,10 @@
     (at your option) any later version.
 */
 #include "Common.h"
+#if defined(__SSE2__) || defined(_M_X64)
+#define INPUT_SSE2
+#include <emmintrin.h>
+#endif
 
 // Assumptions on the input source buffer (as typed in by the user):
 // * The input buffer has to be exactly 16 chars wide
@@ -19,11 +23,12 @@
 // * 'E'+2 represents the exponent '00' to '99', exactly 2 characters wide
 // * This input buffer will be processed and checked for these rules by some intermediate process
 
-TREG input(const char *in)
+template<int M>
+TReg<M> input(const char *in)
 {
-    TREG result(in);
+    TReg<M> result;
 
-    TASR scratch3; // result
+    TAsr<M> scratch3; // result
     scratch_clear(scratch3);
 
     // 2 Basic formats: with exponent and without it
@@ -55,7 +60,7 @@ TREG input(const char *in)
     int8_t adjust = -1; // Initial exponent adjustment value (always ignore the first digit)
 
     // Ignore leading zeroes in the source mantissa
-    while ((in[i] == '0') && (i <= MAX_MANT)) i++; // XXX how to handle it when i reaches the end of the source buffer?
+    while ((in[i] == '0') && (i <= 14)) i++; // XXX how to handle it when i reaches the end of the source buffer?
 
     if (in[i] == '.') // Number < 1
     {
@@ -81,7 +86,7 @@ TREG input(const char *in)
     }
 
     // Copy remaining digits of the mantissa, ignore the decimal point
-    while ((isdigit(in[i]) || (in[i] == '.')) && (i != maxi) && (j < MAX_MANT))
+    while ((isdigit(in[i]) || (in[i] == '.')) && (i != maxi) && (j < M))
     {
         if (in[i] != '.')
         {
@@ -97,11 +102,188 @@ TREG input(const char *in)
     else
         result.exps = 128; // If the mantissa was zero, set the exponent to zero as well
 
-    memcpy(result.mant, scratch3.mant, MAX_MANT);
+    memcpy(result.mant, scratch3.mant, M);
+    exp_range(result); // A normalized exponent can be outside of E-99..E+99
 
     return result;
 }
 
+#define INSTANTIATE(M) \
+    template TReg<M> input(const char *);
+PROOF_WIDTHS(INSTANTIATE)
+
+// Lean parser of the fixed 16 byte layout into a packed register:
+// - The characters of the buffer are classified all at once, with SSE2 where the target always has
+//   it (x86-64), or eight bytes at a time (SWAR); the buffer does not need to be terminated
+// - The buffer is validated on the bit masks of the classes
+// - The character classes of the validation also locate the first significant digit, the decimal
+//   point and the end of the mantissa, so the exponent adjustment is computed without a scan
+// - All bytes are packed into the nibbles of a register eight bytes at a time, then the digits
+//   behind the decimal point are moved in its place with shifts and masks
+// - The result is bit-exact with pack(input(in)) for every buffer that passes the validation
+
+#define BYTES_01  0x0101010101010101ull
+#define BYTES_80  0x8080808080808080ull
+
+// Returns the bit 7 of every byte of w set if that byte is zero
+static inline uint64_t zero_bytes(uint64_t w)
+{
+    return ~(((w & ~BYTES_80) + ~BYTES_80) | w) & BYTES_80;
+}
+
+// Returns the bit 7 of every byte of w set if that byte is equal to c
+static inline uint64_t equal_bytes(uint64_t w, char c)
+{
+    return zero_bytes(w ^ (BYTES_01 * uint8_t(c)));
+}
+
+// Returns the bit 7 of every byte of w set if that byte is a digit '0'..'9'
+static inline uint64_t digit_bytes(uint64_t w)
+{
+    uint64_t high = equal_bytes(w & (BYTES_01 * 0xF0), '0'); // High nibble is 3
+    uint64_t low = zero_bytes(((w & (BYTES_01 * 0x0F)) + BYTES_01 * 6) & (BYTES_01 * 0xF0)); // Low nibble is < 10
+    return high & low;
+}
+
+// Gathers the bit 7 of every byte of both words into one bit per byte: bit k for in[k]
+static inline uint32_t byte_bits(uint64_t m0, uint64_t m1)
+{
+    return uint32_t((((m0 >> 7) * 0x0102040810204080ull) >> 56) | ((((m1 >> 7) * 0x0102040810204080ull) >> 56) << 8));
+}
+
+// Returns the number of bits set in a 16-bit mask
+static inline int count_bits(uint32_t m)
+{
+    m = m - ((m >> 1) & 0x5555);
+    m = (m & 0x3333) + ((m >> 2) & 0x3333);
+    m = (m + (m >> 4)) & 0x0F0F;
+    return int((m + (m >> 8)) & 0x1F);
+}
+
+// Packs the low nibbles of 8 bytes into 32 bits, the first byte into the topmost nibble
+static inline uint32_t pack_nibbles(const char *b)
+{
+    uint64_t w;
+    std::memcpy(&w, b, 8); // Little endian: b[k] is the byte k of w
+    w &= BYTES_01 * 0x0F;
+    w = ((w << 4) | (w >> 8)) & 0x00FF00FF00FF00FFull; // Byte pairs: b[2k] << 4 | b[2k + 1]
+    w = ((w << 8) | (w >> 16)) & 0x0000FFFF0000FFFFull; // Then pairs of those
+    return uint32_t((w << 16) | (w >> 32));
+}
+
+// Character classes of the 16 byte input buffer, bit k for in[k]
+typedef struct TInputClasses
+{
+    uint32_t digits; // '0'..'9'
+    uint32_t zeros; // '0'
+    uint32_t dots; // '.'
+    uint32_t spaces; // ' '
+} TINPUTCLASSES;
+
+static inline TINPUTCLASSES input_classes(const char *in)
+{
+    TINPUTCLASSES c;
+#ifdef INPUT_SSE2
+    __m128i v = _mm_loadu_si128((const __m128i *) in);
+    __m128i d = _mm_sub_epi8(v, _mm_set1_epi8('0'));
+    c.digits = uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(9)), d))); // Unsigned d <= 9
+    c.zeros = uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('0'))));
+    c.dots = uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('.'))));
+    c.spaces = uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(' '))));
+#else
+    uint64_t w[2];
+    std::memcpy(w, in, 16); // Little endian: in[k] is the byte k % 8 of w[k / 8]
+    c.digits = byte_bits(digit_bytes(w[0]), digit_bytes(w[1]));
+    c.zeros = byte_bits(equal_bytes(w[0], '0'), equal_bytes(w[1], '0'));
+    c.dots = byte_bits(equal_bytes(w[0], '.'), equal_bytes(w[1], '.'));
+    c.spaces = byte_bits(equal_bytes(w[0], ' '), equal_bytes(w[1], ' '));
+#endif
+    return c;
+}
+
+// Returns true if the buffer follows the input rules: a sign, a mantissa of digits with at most one
+// decimal point, optionally followed by spaces, and an optional exponent "E+nn" or "E-nn" at [12].
+// Also returns the bits of the mantissa bytes before the first space, and leaves only the digits and
+// the decimal point of these in the classes
+static bool input_is_valid(const char *in, TINPUTCLASSES &c, uint32_t &mant)
+{
+    if ((in[0] != ' ') && (in[0] != '-'))
+        return false;
+    mant = 0xFFFE; // Mantissa bytes [1..15]
+    if (in[12] == 'E')
+    {
+        if (((in[13] != '+') && (in[13] != '-')) || ((c.digits & 0xC000) != 0xC000))
+            return false;
+        mant = 0x0FFE; // Mantissa bytes [1..11]
+    }
+    if (((c.digits | c.dots | c.spaces) & mant) != mant) // Only digits, dots and spaces in the mantissa
+        return false;
+    uint32_t dots = c.dots & mant;
+    if (dots & (dots - 1)) // At most one decimal point
+        return false;
+    uint32_t first_space = c.spaces & mant;
+    first_space &= ~first_space + 1;
+    if (first_space == 2) // The mantissa can not be empty
+        return false;
+    if (first_space)
+    {
+        if (((c.digits | dots) & mant) & ~(first_space - 1)) // Only spaces after the first space
+            return false;
+        mant &= first_space - 1;
+    }
+    c.digits &= mant;
+    c.zeros &= mant;
+    c.dots = dots;
+    return true;
+}
+
+// Parses the 16 byte input buffer into a packed register, returns false if the buffer is not valid
+bool input_packed(const char *in, TPREG &result)
+{
+    TINPUTCLASSES c = input_classes(in);
+    uint32_t mant;
+    if (!input_is_valid(in, c, mant))
+        return false;
+
+    uint8_t exps = 128;
+    if (in[12] == 'E')
+    {
+        int e = (in[14] - '0') * 10 + (in[15] - '0');
+        exps = (in[13] == '-') ? uint8_t(128 - e) : uint8_t(e | 0x80);
+    }
+    result.sign = in[0] == '-';
+    result.flags = 0;
+
+    uint32_t significant = c.digits & ~c.zeros;
+    if (!significant)
+    {
+        result.mant = 0;
+        result.exps = 128;
+        return true;
+    }
+
+    // Indices of the first significant digit, of the decimal point and of the end of the mantissa; a
+    // missing decimal point is at the end. The exponent adjustment is the same as in input(): one less
+    // than the number of integer digits, or minus the number of zeros between the point and the digits
+    int first = count_bits((significant & (~significant + 1)) - 1);
+    int end = count_bits(mant) + 1;
+    int dot = c.dots ? count_bits(c.dots - 1) : end;
+    int adjust = dot - first - (first < dot);
+
+    // Pack all bytes, then move the digits behind the decimal point in its place and the first digit to
+    // the top nibble
+    bool inner_dot = (first < dot) && (dot < end); // The decimal point is between the digits
+    TPASR packed = (TPASR(pack_nibbles(in)) << 32) | pack_nibbles(in + 8); // The nibble k holds in[k]
+    TPASR before = inner_dot ? ~(~TPASR(0) >> (4 * dot)) : ~TPASR(0); // Nibbles in front of the decimal point
+    packed = ((packed & before) | ((packed << 4) & ~before)) << (4 * first);
+    int length = end - first - inner_dot; // Digits from the first one on
+
+    result.mant = packed & PACKED_MANT_MASK & ~(~TPASR(0) >> (4 * length));
+    result.exps = uint8_t(exps + adjust);
+    exp_range(result);
+    return true;
+}
+
 void input_test()
 {
     std::cout << "INPUT PARSER TEST\n";
@@ -142,7 +324,7 @@ void input_test()
     std::cout << "Non-exponential numbers:\n";
     std::cout << h1;
     for (std::string &s : tests1)
-        input(s.c_str()).print(test_number++);
+        TVERIF(s.c_str()).print(test_number++);
 
     std::cout << "Non-exponential negative numbers:\n";
     std::cout << h1;
@@ -150,7 +332,7 @@ void input_test()
     {
         std::string a = s;
         a[0] = '-';
-        input(a.c_str()).print(test_number++);
+        TVERIF(a.c_str()).print(test_number++);
     }
 
     // Input buffer: 16 characters
@@ -179,7 +361,7 @@ void input_test()
         " 0.999999999E+02",
         " 12.34567890E+34",
         " 12345678901E+85",
-        " 99999999999E+99", // XXX Normalizing this value should result in overflow/underflow which we will ignore for now
+        " 99999999999E+99", // Normalizing this value overflows
     };
 
     static const std::string header[4] = {
@@ -201,7 +383,7 @@ void input_test()
                 a[0] = '-';
             if (signs & 2)
                 a[13] = '-';
-            input(a.c_str()).print(test_number++);
+            TVERIF(a.c_str()).print(test_number++);
         }
     }
 }
@@ -12,18 +12,23 @@
 // - The sign of the result is the xor of the signs of individual terms
 // - If any one of the terms is zero, return zero, done.
 // - The exponent of the result is the sum of the exponents of individual terms
-// - Multiply each digit of multiplicand with each digit of multiplier and keep summing each product
+// - Multiply the multiplicand by each digit of multiplier and keep summing each partial product row,
+//   skipping the zero digits of the multiplier
 // - Normalize the result
 
-TREG mult(TREG x, TREG y)
+template<int M>
+TReg<M> mult(const TReg<M> &x, const TReg<M> &y)
 {
-    TREG result(x.fp * y.fp);
+#ifdef PROOF_BCD_MULT_HW
+    return mult_hw(x, y);
+#endif
+    TReg<M> result;
 
-    TASR scratch1(x); // scratch1 == Multiplicand == x
-    TASR scratch2(y); // scratch2 == Multiplier == y
-    TASR scratch3; // result
+    TAsr<M> scratch1(x); // scratch1 == Multiplicand == x
+    TAsr<M> scratch2(y); // scratch2 == Multiplier == y
+    TAsr<M> scratch3; // result
     scratch_clear(scratch3);
-    TASR scratch4; // Temp scratch
+    TAsr<M> scratch4; // Temp scratch
 
     // The sign of the result is the xor of the signs of individual terms
     result.sign = x.sign ^ y.sign;
@@ -35,16 +40,82 @@ TREG mult(TREG x, TREG y)
         return result; // Return zero
 
     // The exponent of the result is the sum of the exponents of individual terms
-    result.exps = exp_add(x, y);
-    // XXX Process overflows
+    result.exps = exp_add(x, y); // The range is checked once the result is normalized
+
+    // ----------- MULTIPLICATION OPERATION -----------
+    // The truncated product does not depend on the order of the terms, so the term with the fewer
+    // significant digits becomes the multiplier; its trailing zero digits are not visited at all
+    int x_length = scratch_length(scratch1);
+    int y_length = scratch_length(scratch2);
+    if (x_length < y_length)
+    {
+        scratch_swap(scratch1, scratch2);
+        y_length = x_length;
+    }
+
+    // Multiply the multiplicand by each multiplier digit into a partial product row, then add and
+    // shift the running total result. The multiplicand is shifted right once so that the upper digit
+    // of its leading digit product lands at the digit [0] of the row
+    scratch_shr(scratch1);
+    for (int8_t j = y_length - 1; j >= 0; j--) // Index of y.mant
+    {
+        scratch_shr(scratch3);
+        if (scratch2.mant[j] == '0')
+            continue; // A zero partial product row
+
+        scratch_mult_digit(scratch4, scratch1, scratch2.mant[j] - '0');
+
+        // Add temp arith register to the final result register
+        // Add individual mantissa BCD digits, with carry to overflow
+        if (scratch_add(scratch3, scratch4))
+            std::cerr << "Unexpected carry in " << __FUNCTION__ << ":" << __LINE__ << "\n";
+    }
+
+    // Normalize the result in the scratch register
+    if (scratch3.mant[0] == '0')
+        scratch_shl(scratch3);
+    else
+        result.exps++;
+
+    memcpy(result.mant, scratch3.mant, M);
+    exp_range(result);
+
+    return result;
+}
+
+// Digit product multiplication, the way the hardware does it: every digit of the multiplicand is
+// multiplied by every digit of the multiplier, and each digit product is added to the running total
+// on its own. It gives the same truncated result as mult(), which adds whole partial product rows
+template<int M>
+TReg<M> mult_hw(const TReg<M> &x, const TReg<M> &y)
+{
+    TReg<M> result;
+
+    TAsr<M> scratch1(x); // scratch1 == Multiplicand == x
+    TAsr<M> scratch2(y); // scratch2 == Multiplier == y
+    TAsr<M> scratch3; // result
+    scratch_clear(scratch3);
+    TAsr<M> scratch4; // Temp scratch
+
+    // The sign of the result is the xor of the signs of individual terms
+    result.sign = x.sign ^ y.sign;
+
+    bool x_is_0 = scratch_is_0(scratch1);
+    bool y_is_0 = scratch_is_0(scratch2);
+
+    if (x_is_0 || y_is_0)
+        return result; // Return zero
+
+    // The exponent of the result is the sum of the exponents of individual terms
+    result.exps = exp_add(x, y); // The range is checked once the result is normalized
 
     // ----------- MULTIPLICATION OPERATION -----------
     // Multiply individual mantissa BCD digits, then add and shift the running total result
-    for (int8_t j = MAX_MANT - 1; j >= 0; j--) // Index of y.mant
+    for (int8_t j = M - 1; j >= 0; j--) // Index of y.mant
     {
         scratch_shr(scratch3);
 
-        for (int8_t i = MAX_MANT - 1; i >= 0; i--) // Index of x.mant
+        for (int8_t i = M - 1; i >= 0; i--) // Index of x.mant
         {
             char bcd1 = scratch1.mant[i] - '0';
             char bcd2 = scratch2.mant[j] - '0';
@@ -59,15 +130,7 @@ TREG mult(TREG x, TREG y)
 
             // Add temp arith register to the final result register
             // Add individual mantissa BCD digits, with carry to overflow
-            bool carry = 0;
-            for (int k = MAX_SCRATCH - 1; k >= 0; k--)
-            {
-                char bcd1 = scratch3.mant[k] - '0';
-                char bcd2 = scratch4.mant[k] - '0';
-                char sum = bcd_adc(bcd1, bcd2, carry);
-                scratch3.mant[k] = sum + '0';
-            }
-            if (carry)
+            if (scratch_add(scratch3, scratch4))
                 std::cerr << "Unexpected carry in " << __FUNCTION__ << ":" << __LINE__ << "\n";
         }
     }
@@ -78,14 +141,152 @@ TREG mult(TREG x, TREG y)
     else
         result.exps++;
 
-    memcpy(result.mant, scratch3.mant, MAX_MANT);
+    memcpy(result.mant, scratch3.mant, M);
+    exp_range(result);
 
     return result;
 }
 
-TREG mult(const char *a, const char *b)
+// Row-wise multiplication of the complete product into a double-length scratch register, the same
+// partial product rows as mult(). The digit that mult() drops from the running total on every shift
+// right is final, since the later rows only reach the digits above it; here it is kept instead.
+// The layout of scratch3 is that of mult_column_scratch(); returns the number of its digits which can
+// hold a non-zero digit of the product
+template<int M>
+int mult_wide_scratch(TAsr<M> scratch1, TAsr<M> scratch2, TAsrWide<M> &scratch3)
 {
-    return mult(input(a), input(b));
+    TAsr<M> scratch4; // Running total
+    scratch_clear(scratch4);
+    TAsr<M> multiple[10]; // Partial product rows, the multiples of the multiplicand made on their first use
+    bool made[10] = {};
+
+    // The complete product does not depend on the order of the terms either
+    int x_length = scratch_length(scratch1);
+    int y_length = scratch_length(scratch2);
+    int length = x_length + y_length; // The product digits land at [0] to [length - 1]
+    if (x_length < y_length)
+    {
+        scratch_swap(scratch1, scratch2);
+        y_length = x_length;
+    }
+
+    // The digit dropped before the row of the multiplier digit [j] is shifted right j more times
+    scratch_shr(scratch1);
+    for (int8_t j = y_length - 1; j >= 0; j--) // Index of y.mant
+    {
+        if (TAsr<M>::S + j < TAsrWide<M>::S)
+            scratch3.mant[TAsr<M>::S + j] = scratch4.mant[TAsr<M>::S - 1];
+        scratch_shr(scratch4);
+        int d = scratch2.mant[j] - '0';
+        if (d == 0)
+            continue; // A zero partial product row
+
+        if (!made[d])
+            scratch_mult_digit(multiple[d], scratch1, d);
+        made[d] = true;
+        if (scratch_add(scratch4, multiple[d]))
+            std::cerr << "Unexpected carry in " << __FUNCTION__ << ":" << __LINE__ << "\n";
+    }
+    memcpy(scratch3.mant, scratch4.mant, TAsr<M>::S);
+    for (int k = TAsr<M>::S + y_length; k < TAsrWide<M>::S; k++)
+        scratch3.mant[k] = '0'; // Clear the digits below the product
+    return length;
+}
+
+// Column-wise multiplication, a faster variant of mult() which gives the same truncated result:
+// - Sum all digit products that fall into the same column, then propagate the carry once per column
+// - mult() drops the lowest digit of the running total every time it shifts it right; since each
+//   partial product row is an integer, that is the same as dropping the low digits of the complete product
+template<int M, int W>
+void mult_column_scratch(const TAsr<M> &scratch1, const TAsr<M> &scratch2, TAsr<W> &scratch3)
+{
+    // Column k sums the products of x[i] * y[j] where i + j == k, and it lands at the digit
+    // [k + 1] of the complete (2 * M digits wide) product; the top TAsr<W>::S digits are kept
+    int carry = 0;
+    for (int k = 2 * M - 2; k >= 0; k--)
+    {
+        int sum = carry;
+        for (int i = std::max(0, k - (M - 1)); i <= std::min(k, M - 1); i++)
+            sum += (scratch1.mant[i] - '0') * (scratch2.mant[k - i] - '0');
+        if (k + 1 < TAsr<W>::S)
+            scratch3.mant[k + 1] = (sum % 10) + '0';
+        carry = sum / 10;
+    }
+    scratch3.mant[0] = carry + '0'; // The product of two M digit numbers fits into 2 * M digits
+    for (int k = 2 * M; k < TAsr<W>::S; k++)
+        scratch3.mant[k] = '0'; // Clear the digits below the product of a double-length scratch
+}
+
+template<int M>
+TReg<M> mult_column(const TReg<M> &x, const TReg<M> &y)
+{
+    TReg<M> result;
+
+    TAsr<M> scratch1(x); // scratch1 == Multiplicand == x
+    TAsr<M> scratch2(y); // scratch2 == Multiplier == y
+    TAsr<M> scratch3; // result
+
+    // The sign of the result is the xor of the signs of individual terms
+    result.sign = x.sign ^ y.sign;
+
+    bool x_is_0 = scratch_is_0(scratch1);
+    bool y_is_0 = scratch_is_0(scratch2);
+
+    if (x_is_0 || y_is_0)
+        return result; // Return zero
+
+    // The exponent of the result is the sum of the exponents of individual terms
+    result.exps = exp_add(x, y); // The range is checked once the result is normalized
+
+    // ----------- MULTIPLICATION OPERATION -----------
+    mult_column_scratch(scratch1, scratch2, scratch3);
+
+    // Normalize the result in the scratch register
+    if (scratch3.mant[0] == '0')
+        scratch_shl(scratch3);
+    else
+        result.exps++;
+
+    memcpy(result.mant, scratch3.mant, M);
+    exp_range(result);
+
+    return result;
+}
+
+#define INSTANTIATE(M) \
+    template TReg<M> mult(const TReg<M> &, const TReg<M> &); \
+    template TReg<M> mult_column(const TReg<M> &, const TReg<M> &); \
+    template TReg<M> mult_hw(const TReg<M> &, const TReg<M> &); \
+    template void mult_column_scratch(const TAsr<M> &, const TAsr<M> &, TAsr<M> &); \
+    template void mult_column_scratch(const TAsr<M> &, const TAsr<M> &, TAsrWide<M> &); \
+    template int mult_wide_scratch(TAsr<M>, TAsr<M>, TAsrWide<M> &);
+PROOF_WIDTHS(INSTANTIATE)
+
+TVERIF mult(const TVERIF &x, const TVERIF &y)
+{
+    return TVERIF(mult(x.reg, y.reg), x.fp * y.fp);
+}
+
+TVERIF mult(const char *a, const char *b)
+{
+    return mult(TVERIF(a), TVERIF(b));
+}
+
+// Checks mult() and the column-wise multiplication against the digit product loop of the hardware
+static void mult_hw_check(const TVERIF &x, const TVERIF &y, const TREG &result)
+{
+    TREG expected = mult_hw(x.reg, y.reg);
+    TREG column = mult_column(x.reg, y.reg);
+    if (result != expected)
+    {
+        std::cout << x.src << " * " << y.src << " *** mult_hw() mismatch: " << (expected.sign ? '-' : '+') << expected.mant << " (" << int(expected.exps) << ") ***\n";
+        tests_fail++;
+    }
+    if (column != expected)
+    {
+        std::cout << x.src << " * " << y.src << " *** mult_column() mismatch: " << (column.sign ? '-' : '+') << column.mant << " (" << int(column.exps) << ") ***\n";
+        tests_fail++;
+    }
 }
 
 void mult_test()
@@ -93,29 +294,7 @@ void mult_test()
     std::cout << "MULTIPLICATION TEST\n";
     const std::string h1 = " Operand 1       OP Operand 2         Internal normalized    Exp    ID  Internal printed          Verification value\n";
 
-    // Input buffer: 16 characters
-    //   0123456789012345
-    static std::vector<std::string> tests = { // Non-exponential numbers
-        " 1              ",
-        " 1.000000000001 ",
-        " 1.0000000000001",
-        " 1.2345678901234",
-        " 1234567890123.4",
-        " 123456789012345",
-        " 9              ",
-        " 99             ",
-        " 99999999999999 ",
-        " 999999999999999",
-        " 0              ",
-        " 0.1            ",
-        " 0.01           ",
-        " 0.0000000000001",
-        " 0.0000000000009",
-        " 0.1234567890123",
-        " 3.1415926535897",
-        " 2.7182818284590",
-    };
-
+    const std::deque<TCORPUSNUMBER> &c = corpus();
     static const std::string header[4] = {
         " of non-exponential numbers:",
         " of non-exponential negative with positive number -x,y:",
@@ -123,26 +302,25 @@ void mult_test()
         " of non-exponential negative with negative number -x,-y:"
     };
 
-#if 0
-    // Test bcd_mult()
-    static char result[3];
-    // Loop for all single-digit BCD numbers in x and y space, and with and without carry variations
-    for (int carry = 0; carry < 2; carry++)
+    // Test bcd_mult() against the hardware variant and the binary product, for all single-digit BCD numbers in x and y space
+    uint32_t digit_fail = 0;
+    for (int x = 0; x < 10; x++)
     {
-        for (int x = 0; x < 10; x++)
+        for (int y = 0; y < 10; y++)
         {
-            for (int y = 0; y < 10; y++)
+            unsigned char product = bcd_mult(x, y);
+            unsigned char product_hw = bcd_mult_hw(x, y);
+            if ((product != product_hw) || ((product >> 4) * 10 + (product & 0xF) != x * y))
             {
-                sprintf(result, "%02d", x * y + carry);
-                unsigned char product = bcd_mult(x, y, carry);
-                if ((((product >> 4) + '0') != result[0]) || (((product & 0xF) + '0') != result[1]))
-                    std::cout << "Error with " << x << " * " << y << " +" << carry << " = " << result << "\n";
+                std::cout << "Error with " << x << " * " << y << " = " << std::hex << int(product) << " (hw " << int(product_hw) << ")" << std::dec << "\n";
+                digit_fail++;
             }
         }
     }
-    // Test the results with carry-in
-    std::cout << "Finished testing bcd_mult()\n";
-#endif
+    std::cout << "Digit products checked: 100  fail: " << digit_fail << "\n";
+    tests_total += 100;
+    tests_pass += 100 - digit_fail;
+    tests_fail += digit_fail;
 
 #if 1
     // Run the operation using our set of test numbers
@@ -152,20 +330,13 @@ void mult_test()
         std::cout << "Multiplication" << header[signs] << "\n";
         std::cout << h1;
         // Combine each number from the test set with each other
-        for (std::string &s : tests)
+        corpus_cross(c, signs, [&](const TVERIF &x, const TVERIF &y)
         {
-            for (std::string &t : tests)
-            {
-                std::string s2 = s;
-                if (signs & 1)
-                    s2[0] = '-';
-                std::string t2 = t;
-                if (signs & 2)
-                    t2[0] = '-';
-                std::cout << s2 << " * " << t2;
-                mult(s2.c_str(), t2.c_str()).print(test_number++);
-            }
-        }
+            std::cout << x.src << " * " << y.src;
+            TVERIF r = mult(x, y);
+            r.print(test_number++);
+            mult_hw_check(x, y, r.reg);
+        });
     }
 #endif
 #if 1
@@ -176,30 +347,17 @@ void mult_test()
     rnd.seed(43); // Reproducible random number seed
     for (int test_number = 1; test_number <= 500; test_number++)
     {
-        int index1 = rnd() % tests.size();
-        int index2 = rnd() % tests.size();
-
-        std::string s1 = tests[index1].substr(0, 12);
-        s1[1] = rdigit(10);
-        if (s1[2] == ' ')
-            s1[2] = '.';
-        s1[3] = rdigit(10);
-        s1[0] = (rnd() & 1) ? ' ' : '-';
-        // Needs to be in a separate line for rnd() consistency across the platforms
-        char e1 = rdigit(2), e2 = rdigit(10);
-        s1 = s1 + "E" + ((rnd() & 1) ? '-' : '+') + e1 + e2;
-
-        std::string s2 = tests[index2].substr(0, 12);
-        s2[1] = rdigit(10);
-        if (s2[2] == ' ')
-            s2[2] = '.';
-        s2[3] = rdigit(10);
-        s2[0] = (rnd() & 1) ? ' ' : '-';
-        e1 = rdigit(2), e2 = rdigit(10);
-        s2 = s2 + "E" + ((rnd() & 1) ? '-' : '+') + e1 + e2;
+        int index1 = rnd() % c.size();
+        int index2 = rnd() % c.size();
+
+        std::string s1 = random_operand(rnd, c[index1].src[0]);
+        std::string s2 = random_operand(rnd, c[index2].src[0]);
 
         std::cout << s1 << " * " << s2;
-        mult(s1.c_str(), s2.c_str()).print(test_number);
+        TVERIF x(s1.c_str()), y(s2.c_str());
+        TVERIF r = mult(x, y);
+        r.print(test_number);
+        mult_hw_check(x, y, r.reg);
     }
 #endif
 }
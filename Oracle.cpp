@@ -0,0 +1,366 @@
+/*  Copyright (C) 2021  Goran Devic
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+*/
+#include "Common.h"
+
+// Exact verification oracle:
+// - Operands are converted into exact decimal integers (a digit array and a power of 10)
+// - The operation is computed exactly using plain integer digit arithmetic, no BCD primitives are used
+// - The exact value is truncated to M digits, which is what an ideal truncating calculator would return
+// - The register under test is compared against it in memory, without any text formatting or floating point
+//
+// This is independent of the double precision, so it works for registers wider than 15 digits as well.
+
+// Exact decimal value: sign * digits * 10^exp, digits are stored LSB first
+template<int M>
+struct TExact
+{
+    static const int D = 4 * M + 4; // Enough digits for a full product aligned to an addend, and a quotient
+
+    bool sign;
+    int exp;
+    uint8_t d[D];
+
+    TExact() : sign(false), exp(0) { std::memset(d, 0, D); }
+
+    // Index of the most significant non-zero digit, or -1 if the value is zero
+    int top() const
+    {
+        int t = D - 1;
+        while ((t >= 0) && !d[t]) t--;
+        return t;
+    }
+};
+
+// Loads a register into an exact value
+template<int M>
+static TExact<M> exact_from_reg(const TReg<M> &r)
+{
+    TExact<M> e;
+    for (int i = 0; i < M; i++)
+        e.d[i] = r.mant[M - 1 - i] - '0';
+    e.sign = r.sign;
+    e.exp = int(r.exps) - 128 - (M - 1);
+    return e;
+}
+
+// Multiplies the digits by 10^n in place (n is small enough to fit)
+template<int M>
+static void exact_shl(TExact<M> &e, int n)
+{
+    std::memmove(&e.d[n], &e.d[0], TExact<M>::D - n);
+    std::memset(&e.d[0], 0, n);
+    e.exp -= n;
+}
+
+// Compares the digits of two values (ignoring the sign and exponent), returns <0, 0 or >0
+template<int M>
+static int exact_cmp(const TExact<M> &a, const TExact<M> &b)
+{
+    for (int i = TExact<M>::D - 1; i >= 0; i--)
+    {
+        if (a.d[i] != b.d[i])
+            return a.d[i] - b.d[i];
+    }
+    return 0;
+}
+
+// a.d += b.d
+template<int M>
+static void exact_add_digits(TExact<M> &a, const TExact<M> &b)
+{
+    int carry = 0;
+    for (int i = 0; i < TExact<M>::D; i++)
+    {
+        int s = a.d[i] + b.d[i] + carry;
+        carry = s >= 10;
+        a.d[i] = uint8_t(carry ? s - 10 : s);
+    }
+}
+
+// a.d -= b.d, requires a.d >= b.d
+template<int M>
+static void exact_sub_digits(TExact<M> &a, const TExact<M> &b)
+{
+    int borrow = 0;
+    for (int i = 0; i < TExact<M>::D; i++)
+    {
+        int s = a.d[i] - b.d[i] - borrow;
+        borrow = s < 0;
+        a.d[i] = uint8_t(borrow ? s + 10 : s);
+    }
+}
+
+// Exact sum of two values
+template<int M>
+static TExact<M> exact_add(TExact<M> a, TExact<M> b)
+{
+    if (b.top() < 0)
+        return a;
+    if (a.top() < 0)
+        return b;
+    if (a.exp < b.exp)
+        std::swap(a, b); // a has the larger (or equal) exponent
+    int diff = a.exp - b.exp;
+
+    // Align a to the exponent of b. When b is too small to reach the top M + 1 digits of a, any
+    // non-zero value below that position truncates the same way, so it is replaced by a single unit.
+    // Either term may be a full product of 2 * M digits
+    static const int MAX_SHIFT = 2 * M + 2;
+    if (diff > MAX_SHIFT)
+    {
+        bool sign = b.sign;
+        b = TExact<M>();
+        b.d[0] = 1;
+        b.sign = sign;
+        b.exp = a.exp - MAX_SHIFT;
+        diff = MAX_SHIFT;
+    }
+    exact_shl(a, diff);
+
+    TExact<M> result;
+    if (a.sign == b.sign)
+    {
+        result = a;
+        exact_add_digits(result, b);
+    }
+    else if (exact_cmp(a, b) >= 0)
+    {
+        result = a;
+        exact_sub_digits(result, b);
+    }
+    else
+    {
+        result = b;
+        exact_sub_digits(result, a);
+    }
+    return result;
+}
+
+// Exact product of two values
+template<int M>
+static TExact<M> exact_mult(const TExact<M> &a, const TExact<M> &b)
+{
+    TExact<M> result;
+    int acc[TExact<M>::D + 1] = {};
+    for (int i = 0; i < M; i++)
+        for (int j = 0; j < M; j++)
+            acc[i + j] += a.d[i] * b.d[j];
+    int carry = 0;
+    for (int k = 0; k < TExact<M>::D; k++)
+    {
+        int s = acc[k] + carry;
+        result.d[k] = uint8_t(s % 10);
+        carry = s / 10;
+    }
+    result.sign = a.sign ^ b.sign;
+    result.exp = a.exp + b.exp;
+    return result;
+}
+
+// Truncated quotient of two values, computed with enough digits that its truncation to M digits is exact
+template<int M>
+static TExact<M> exact_div(TExact<M> a, const TExact<M> &b)
+{
+    static const int K = M + 2; // Extra quotient digits; since both mantissas have M digits the quotient has at least K
+    exact_shl(a, K);
+
+    TExact<M> result, rem;
+    for (int i = a.top(); i >= 0; i--)
+    {
+        // rem = rem * 10 + next digit, then subtract the divisor as many times as it fits
+        exact_shl(rem, 1);
+        rem.d[0] = a.d[i];
+        int q = 0;
+        while (exact_cmp(rem, b) >= 0)
+        {
+            exact_sub_digits(rem, b);
+            q++;
+        }
+        result.d[i] = uint8_t(q);
+    }
+    result.sign = a.sign ^ b.sign;
+    result.exp = a.exp - b.exp;
+    return result;
+}
+
+// Square of a value with any number of digits that fits
+template<int M>
+static TExact<M> exact_square(const TExact<M> &a)
+{
+    TExact<M> result;
+    int t = a.top();
+    int acc[TExact<M>::D + 1] = {};
+    for (int i = 0; i <= t; i++)
+        for (int j = 0; j <= t; j++)
+            acc[i + j] += a.d[i] * a.d[j];
+    int carry = 0;
+    for (int k = 0; k < TExact<M>::D; k++)
+    {
+        int s = acc[k] + carry;
+        result.d[k] = uint8_t(s % 10);
+        carry = s / 10;
+    }
+    result.exp = 2 * a.exp;
+    return result;
+}
+
+// Truncated square root of a positive value, computed with enough digits that its truncation to M digits is exact:
+// every digit of the root, from the top, is the largest one whose square does not exceed the radicand
+template<int M>
+static TExact<M> exact_sqrt(TExact<M> a)
+{
+    if (a.exp & 1)
+        exact_shl(a, 1);
+    while (a.top() + 1 < 2 * M + 1) // At least M + 1 digits of the root
+        exact_shl(a, 2);
+
+    TExact<M> root;
+    root.exp = a.exp / 2;
+    for (int i = a.top() / 2; i >= 0; i--)
+    {
+        int lo = 0, hi = 9;
+        while (lo < hi)
+        {
+            int mid = (lo + hi + 1) / 2;
+            root.d[i] = uint8_t(mid);
+            TExact<M> sq = exact_square(root);
+            sq.exp = a.exp;
+            if (exact_cmp(sq, a) <= 0)
+                lo = mid;
+            else
+                hi = mid - 1;
+        }
+        root.d[i] = uint8_t(lo);
+    }
+    return root;
+}
+
+// Truncates an exact non-zero value into a normalized register, saturating it outside of the exponent range
+template<int M>
+static TReg<M> exact_to_reg(const TExact<M> &e)
+{
+    TReg<M> r;
+    int t = e.top();
+    for (int i = 0; i < M; i++)
+        r.mant[i] = (t - i >= 0 ? e.d[t - i] : 0) + '0';
+    r.sign = e.sign;
+    int pow = e.exp + t;
+    r.exps = uint8_t(128 + pow);
+    if (pow > EXP_MAX) // Saturates to the largest magnitude, independently of exp_range()
+    {
+        std::memset(r.mant, '9', M);
+        r.exps = 128 + EXP_MAX;
+        r.flags = FLAG_OVERFLOW;
+    }
+    if (pow < -EXP_MAX) // Flushes to zero
+    {
+        std::memset(r.mant, '0', M);
+        r.sign = false;
+        r.exps = 128;
+        r.flags = FLAG_UNDERFLOW;
+    }
+    return r;
+}
+
+// Returns the distance of the register from the expected value in the units of its last digit, saturated at 100
+template<int M>
+static int exact_ulps(const TReg<M> &r, const TReg<M> &expected)
+{
+    TExact<M> a = exact_from_reg(r), b = exact_from_reg(expected);
+    if ((a.sign != b.sign) || (std::abs(a.exp - b.exp) > 1))
+        return 100;
+    int unit = b.exp;
+    b.sign = !b.sign;
+    TExact<M> diff = exact_add(a, b); // r - expected
+
+    int ulps = 0;
+    for (int i = diff.top(); i >= 0; i--)
+    {
+        int pos = i + diff.exp - unit; // Weight of the digit is 10^pos units
+        if (pos >= 2)
+            return 100;
+        if (pos >= 0)
+            ulps += diff.d[i] * (pos ? 10 : 1);
+        else if (diff.d[i])
+            return ulps + 1; // Round a partial unit up
+    }
+    return ulps;
+}
+
+// Truncates the exact non-zero value into the expected register and classifies the result against it
+template<int M>
+static int exact_classify(const TExact<M> &e, const TReg<M> &result, TReg<M> &expected)
+{
+    expected = exact_to_reg(e);
+    if (result == expected)
+        return CHECK_OK;
+    return exact_ulps(result, expected) <= 10 ? CHECK_NEAR : CHECK_FAIL;
+}
+
+// Computes the exact expected result of an operation (op: 0 +, 1 -, 2 *, 3 /) truncated to M digits
+// and classifies the register under test as an exact match (CHECK_OK), within 10 units of the last
+// digit (CHECK_NEAR) or wrong (CHECK_FAIL). The expected value is returned for reporting.
+template<int M>
+int exact_check(const TReg<M> &x, const TReg<M> &y, int op, const TReg<M> &result, TReg<M> &expected)
+{
+    TExact<M> a = exact_from_reg(x), b = exact_from_reg(y);
+    expected = TReg<M>();
+
+    if ((op == 3) && (b.top() < 0)) // Division by zero is signalled with its flag
+    {
+        expected.flags = FLAG_DIV0;
+        return result.flags == FLAG_DIV0 ? CHECK_OK : CHECK_FAIL;
+    }
+
+    TExact<M> e;
+    if (op < 2)
+    {
+        b.sign ^= op == 1;
+        e = exact_add(a, b);
+    }
+    else
+        e = (op == 2) ? exact_mult(a, b) : exact_div(a, b);
+
+    if (e.top() < 0) // Zero is a true zero; the sign of a zero is not checked
+        return (scratch_is_0(TAsr<M>(result)) && (result.exps == 128) && !result.flags) ? CHECK_OK : CHECK_FAIL;
+
+    return exact_classify(e, result, expected);
+}
+
+// Same as exact_check(), for the square root; the root of a negative number is signalled with FLAG_DOMAIN
+template<int M>
+int exact_sqrt_check(const TReg<M> &x, const TReg<M> &result, TReg<M> &expected)
+{
+    TExact<M> a = exact_from_reg(x);
+    expected = TReg<M>();
+    if (a.top() < 0)
+        return (scratch_is_0(TAsr<M>(result)) && (result.exps == 128) && !result.flags) ? CHECK_OK : CHECK_FAIL;
+    if (a.sign)
+    {
+        expected.flags = FLAG_DOMAIN;
+        return result.flags == FLAG_DOMAIN ? CHECK_OK : CHECK_FAIL;
+    }
+    return exact_classify(exact_sqrt(a), result, expected);
+}
+
+// Same as exact_check(), for the fused multiply-add x * y + z
+template<int M>
+int exact_fma_check(const TReg<M> &x, const TReg<M> &y, const TReg<M> &z, const TReg<M> &result, TReg<M> &expected)
+{
+    TExact<M> e = exact_add(exact_mult(exact_from_reg(x), exact_from_reg(y)), exact_from_reg(z));
+    expected = TReg<M>();
+    if (e.top() < 0)
+        return (scratch_is_0(TAsr<M>(result)) && (result.exps == 128) && !result.flags) ? CHECK_OK : CHECK_FAIL;
+    return exact_classify(e, result, expected);
+}
+
+#define INSTANTIATE(M) \
+    template int exact_check(const TReg<M> &, const TReg<M> &, int, const TReg<M> &, TReg<M> &); \
+    template int exact_sqrt_check(const TReg<M> &, const TReg<M> &, TReg<M> &); \
+    template int exact_fma_check(const TReg<M> &, const TReg<M> &, const TReg<M> &, const TReg<M> &, TReg<M> &);
+PROOF_WIDTHS(INSTANTIATE)
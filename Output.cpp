@@ -0,0 +1,117 @@
+/*  Copyright (C) 2021  Goran Devic
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+*/
+#include "Common.h"
+#include <fcntl.h>
+#ifdef _WIN32
+#include <io.h>
+static int file_open(const char *path) { return _open(path, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, 0644); }
+static int file_write(int fd, const char *data, size_t n) { return _write(fd, data, unsigned(n)); }
+static int file_close(int fd) { return _close(fd); }
+static int file_stdout() { return _fileno(stdout); }
+#else
+#include <unistd.h>
+static int file_open(const char *path) { return ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644); }
+static int file_write(int fd, const char *data, size_t n) { return int(::write(fd, data, n)); }
+static int file_close(int fd) { return ::close(fd); }
+static int file_stdout() { return fileno(stdout); }
+#endif
+
+// Ordered output of the shards of a parallel run:
+// - Every worker formats the text of a shard into its own buffer and hands the whole buffer over when
+//   the shard is done, so the workers never touch a stream or a lock while they run the cases
+// - A single writer thread writes the texts in the shard order, as soon as all shards before them are in,
+//   gathering the small ones into large write() calls
+// - The written buffers keep their capacity and are handed back to the workers on their next submit
+
+#define OUTPUT_CHUNK (1 << 20) // Writes are gathered up to this size
+
+bool TOutput::open(const char *path, int shards)
+{
+    own = path != nullptr;
+    fd = own ? file_open(path) : file_stdout();
+    if (fd < 0)
+        return false;
+    if (!own)
+        std::cout.flush(), fflush(stdout); // Everything printed so far goes out ahead of the shards
+    slots.assign(shards, std::string());
+    ready.assign(shards, 0);
+    next = 0;
+    writer = std::thread(&TOutput::run, this);
+    return true;
+}
+
+void TOutput::submit(int shard, std::string &text)
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        slots[shard].swap(text);
+        ready[shard] = 1;
+        if (!spare.empty())
+        {
+            text.swap(spare.back());
+            spare.pop_back();
+        }
+    }
+    text.clear();
+    wake.notify_one();
+}
+
+// Writes the whole buffer, the write() can take only a part of it at a time
+void TOutput::flush(const char *data, size_t n)
+{
+    while (n && !errors)
+    {
+        int k = file_write(fd, data, std::min<size_t>(n, OUTPUT_CHUNK));
+        if (k <= 0)
+            errors++;
+        else
+            data += k, n -= size_t(k);
+    }
+}
+
+void TOutput::run()
+{
+    std::string chunk;
+    chunk.reserve(OUTPUT_CHUNK);
+    std::unique_lock<std::mutex> guard(lock);
+    while (next < int(slots.size()))
+    {
+        wake.wait(guard, [this]() { return ready[next] != 0; });
+
+        // Take all texts that are next in order, then write them without holding the lock
+        std::vector<std::string> texts;
+        while ((next < int(slots.size())) && ready[next])
+            texts.emplace_back(), texts.back().swap(slots[next++]);
+        guard.unlock();
+        for (std::string &t : texts)
+        {
+            if (chunk.size() + t.size() > OUTPUT_CHUNK)
+                flush(chunk.data(), chunk.size()), chunk.clear();
+            if (t.size() >= OUTPUT_CHUNK)
+                flush(t.data(), t.size());
+            else
+                chunk += t;
+            t.clear();
+        }
+        if (next == int(slots.size()))
+            flush(chunk.data(), chunk.size());
+        guard.lock();
+        for (std::string &t : texts)
+            spare.emplace_back(), spare.back().swap(t);
+    }
+}
+
+bool TOutput::close()
+{
+    if (writer.joinable())
+        writer.join();
+    if (own && (fd >= 0) && file_close(fd))
+        errors++;
+    fd = -1;
+    return !errors;
+}
@@ -0,0 +1,483 @@
+/*  Copyright (C) 2021  Goran Devic
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+*/
+#include "Common.h"
+
+// Packed BCD engine:
+// - Each register holds two BCD nibbles per byte; the whole 16-digit scratch fits into one 64-bit word (TPASR)
+// - Digit [0] is in the topmost nibble, so the shift right/left of a scratch is a shift by 4 bits,
+//   and the compare of two scratch registers is a plain unsigned compare
+// - BCD add and subtract run on all digits at once (SWAR) using the +6 decimal adjust trick
+// - The algorithms follow the char engine step by step so the results are bit-exact with it;
+//   the char engine stays the cycle-accurate reference
+
+TPREG pack(const TREG &r)
+{
+    TPREG p;
+    p.mant = 0;
+    for (int i = 0; i < MAX_MANT; i++)
+        p.mant |= TPASR(r.mant[i] - '0') << (60 - 4 * i);
+    p.sign = r.sign;
+    p.exps = r.exps;
+    p.flags = r.flags;
+    return p;
+}
+
+void unpack(const TPREG &p, TREG &r)
+{
+    for (int i = 0; i < MAX_MANT; i++)
+        r.mant[i] = char((p.mant >> (60 - 4 * i)) & 0xF) + '0';
+    r.sign = p.sign;
+    r.exps = p.exps;
+    r.flags = p.flags;
+}
+
+// Add all 16 BCD digits with carry
+TPASR packed_adc(TPASR a, TPASR b, bool &carry)
+{
+    TPASR t1 = a + BCD_SIXES; // Bias every digit by 6 so that a decimal carry becomes a binary nibble carry
+    TPASR t2 = t1 + (b + carry); // (b + carry) can not overflow since the top digit of b is at most 9
+    bool carry_out = t2 < t1; // Carry out of the topmost digit is the carry out of the 64-bit word
+    TPASR t3 = (t2 ^ t1 ^ b) & BCD_CARRIES; // Nibble carries; a set bit means the digit below did carry
+    TPASR t4 = ~t3 & BCD_CARRIES; // Digits which did not carry still hold the +6 bias
+    TPASR t5 = (t4 >> 2) | (t4 >> 3); // Turn each flag into 6 at the digit that produced it
+    if (!carry_out)
+        t5 |= BCD_TOP_SIX;
+    carry = carry_out;
+    return t2 - t5; // "DAA" - does not borrow across digits since every biased digit is >= 6
+}
+
+// Subtract all 16 BCD digits with borrow
+TPASR packed_sbc(TPASR a, TPASR b, bool &borrow)
+{
+    TPASR t1 = a - b - borrow;
+    bool borrow_out = a < b + borrow; // Borrow out of the topmost digit
+    TPASR t2 = (t1 ^ a ^ b) & BCD_CARRIES; // Nibble borrows; a set bit means the digit below did borrow
+    TPASR t3 = (t2 >> 2) | (t2 >> 3); // Turn each flag into 6 at the digit that produced it
+    if (borrow_out)
+        t3 |= BCD_TOP_SIX;
+    borrow = borrow_out;
+    return t1 - t3; // "DAS" - does not borrow across digits since every wrapped digit is >= 6
+}
+
+// Scalar lane kernels of the batch operations, kept next to the SWAR kernels so they get inlined
+void batch_adc_scalar(const TPASR *a, const TPASR *b, TPASR *r, uint8_t *carry, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        bool c = 0;
+        r[i] = packed_adc(a[i], b[i], c);
+        carry[i] = c;
+    }
+}
+
+void batch_sbc_scalar(const TPASR *a, const TPASR *b, TPASR *r, uint8_t *borrow, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        bool c = 0;
+        r[i] = packed_sbc(a[i], b[i], c);
+        borrow[i] = c;
+    }
+}
+
+void batch_normalize_scalar(TPASR *r, uint8_t *zeros, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        // Counts the leading zero digits in halving steps, a zero register has 16 of them
+        TPASR scratch = r[i];
+        int count = 0, step;
+        step = (scratch >> 32) == 0, scratch <<= 32 * step, count += 8 * step;
+        step = (scratch >> 48) == 0, scratch <<= 16 * step, count += 4 * step;
+        step = (scratch >> 56) == 0, scratch <<= 8 * step, count += 2 * step;
+        step = (scratch >> 60) == 0, scratch <<= 4 * step, count += step;
+        r[i] = scratch;
+        zeros[i] = uint8_t(count + (scratch == 0));
+    }
+}
+
+// Returns the topmost digit of a packed scratch register
+static inline int packed_digit0(TPASR scratch) { return int(scratch >> 60); }
+
+// See add_sub() in AddSub.cpp for the heuristic
+TPREG add_sub(TPREG x, TPREG y, bool is_sub)
+{
+    TPREG result;
+
+    TPASR scratch1 = x.mant; // scratch1 == Augend == x
+    TPASR scratch2 = y.mant; // scratch2 == Addend == y
+    TPASR scratch3 = 0; // result
+
+    // This one needs to go first to capture the (x==0 && y==0) case
+    if (y.mant == 0)
+    {
+        result = x;
+        result.flags = 0; // The flags belong to the operation, not to the operands
+        if (x.mant == 0) // Make it a true 0 (not potentially a negative zero)
+        {
+            result.exps = 128;
+            result.sign = false;
+        }
+        return result;
+    }
+    if (x.mant == 0)
+    {
+        result = y;
+        result.flags = 0;
+        result.sign = y.sign ^ is_sub; // Notice the ^ is_sub !
+        return result;
+    }
+
+    // If the required alignment shift is larger than the mantissa width, return the larger value unchanged
+    if (x.exps < y.exps) // Shift right mantissa x
+    {
+        uint8_t shift = y.exps - x.exps;
+        if (shift >= MAX_MANT)
+        {
+            result = y;
+            result.flags = 0;
+            result.sign = y.sign ^ is_sub; // Notice the ^ is_sub !
+            return result;
+        }
+        scratch1 >>= 4 * shift;
+        result.exps = y.exps;
+    }
+    else // Shift right mantissa y
+    {
+        uint8_t shift = x.exps - y.exps;
+        if (shift >= MAX_MANT)
+        {
+            result = x;
+            result.flags = 0;
+            return result;
+        }
+        scratch2 >>= 4 * shift;
+        result.exps = x.exps;
+    }
+
+    bool is_addition = (x.sign == y.sign) ^ is_sub;
+
+    if (is_addition)
+    {
+        // Only the mantissa digits take part; the nibbles shifted out below them are dropped
+        bool carry = 0;
+        scratch3 = packed_adc(scratch1 & PACKED_MANT_MASK, scratch2 & PACKED_MANT_MASK, carry);
+
+        // If we have a carry set after the MSB digit, we need to insert "1" as the topmost digit
+        if (carry)
+        {
+            scratch3 = (scratch3 >> 4) | (TPASR(1) << 60);
+            result.exps++;
+        }
+        result.sign = x.sign;
+    }
+    else
+    {
+        // The compare uses all scratch digits, just like scratch_is_greater_or_equal()
+        bool x_ge_y = packed_is_greater_or_equal(scratch1, scratch2);
+        if (!x_ge_y)
+            std::swap(scratch1, scratch2);
+
+        bool borrow = 0;
+        scratch3 = packed_sbc(scratch1 & PACKED_MANT_MASK, scratch2 & PACKED_MANT_MASK, borrow);
+
+        result.sign = x.sign ^ !x_ge_y;
+
+        if (scratch3 == 0)
+        {
+            result.exps = 128; // Make the result true 0
+            result.sign = false;
+        }
+        else // Normalize the result
+        {
+            while (packed_digit0(scratch3) == 0)
+            {
+                scratch3 <<= 4;
+                result.exps--;
+            }
+        }
+    }
+
+    result.mant = scratch3 & PACKED_MANT_MASK;
+    exp_range(result);
+
+    return result;
+}
+
+// Multiplies two non-zero packed mantissas, returns the (not normalized) product scratch register.
+// The char engine adds each digit product into the running total separately; since those additions
+// never overflow, adding the whole partial product row (the multiplicand times one multiplier digit)
+// at once gives the same result
+TPASR packed_mult_mant(TPASR x, TPASR y)
+{
+    // Multiples 0x..9x of the multiplicand, aligned one digit to the right (the same as the char engine
+    // stores the two digits of a product at [i] and [i+1])
+    TPASR multiple[10];
+    multiple[0] = 0;
+    multiple[1] = x >> 4;
+    for (int d = 2; d < 10; d++)
+    {
+        bool carry = 0;
+        multiple[d] = packed_adc(multiple[d - 1], multiple[1], carry);
+    }
+
+    TPASR scratch3 = 0; // result
+    for (int8_t j = MAX_MANT - 1; j >= 0; j--) // Index of y.mant
+    {
+        scratch3 >>= 4;
+        bool carry = 0;
+        scratch3 = packed_adc(scratch3, multiple[(y >> (60 - 4 * j)) & 0xF], carry);
+        if (carry)
+            std::cerr << "Unexpected carry in " << __FUNCTION__ << ":" << __LINE__ << "\n";
+    }
+    return scratch3;
+}
+
+// Divides two non-zero packed mantissas, returns the (not normalized) quotient scratch register
+TPASR packed_div_mant(TPASR x, TPASR y)
+{
+    // Shift both dividend and divisor one digit to the right, freeing the most significant digit
+    TPASR scratch1 = x >> 4; // Dividend
+    TPASR scratch2 = y >> 4; // Divisor
+    TPASR scratch3 = 0; // result
+
+    for (int8_t i = 0; i < MAX_SCRATCH; i++) // MSB to LSB processing
+    {
+        TPASR digit = 0;
+        while (packed_is_greater_or_equal(scratch1, scratch2)) // Divisor will go into a dividend
+        {
+            bool borrow = 0;
+            scratch1 = packed_sbc(scratch1, scratch2, borrow);
+            digit++;
+        }
+        scratch3 |= digit << (60 - 4 * i);
+
+        // Shift left dividend by one digit; the top digit is always zero since dividend < divisor
+        scratch1 <<= 4;
+    }
+    return scratch3;
+}
+
+// See mult() in Mult.cpp for the heuristic
+TPREG mult(TPREG x, TPREG y)
+{
+    TPREG result;
+
+    // The sign of the result is the xor of the signs of individual terms
+    result.sign = x.sign ^ y.sign;
+
+    if ((x.mant == 0) || (y.mant == 0))
+        return result; // Return zero
+
+    result.exps = exp_add(x, y); // The range is checked once the result is normalized
+
+    TPASR scratch3 = packed_mult_mant(x.mant, y.mant);
+
+    // Normalize the result in the scratch register
+    if (packed_digit0(scratch3) == 0)
+        scratch3 <<= 4;
+    else
+        result.exps++;
+
+    result.mant = scratch3 & PACKED_MANT_MASK;
+    exp_range(result);
+
+    return result;
+}
+
+// See div() in Div.cpp for the heuristic
+TPREG div(TPREG x, TPREG y)
+{
+    TPREG result;
+
+    // The sign of the result is the xor of the signs of the individual terms
+    result.sign = x.sign ^ y.sign;
+
+    if (y.mant == 0)
+    {
+        result.flags = FLAG_DIV0;
+        return result;
+    }
+    if (x.mant == 0)
+        return result; // Return zero
+
+    result.exps = exp_sub(x, y); // The range is checked once the result is normalized
+
+    TPASR scratch3 = packed_div_mant(x.mant, y.mant);
+
+    // Normalize the result in the scratch register
+    if (packed_digit0(scratch3) == 0)
+    {
+        scratch3 <<= 4;
+        result.exps--;
+    }
+
+    result.mant = scratch3 & PACKED_MANT_MASK;
+    exp_range(result);
+
+    return result;
+}
+
+// Operands of all checked cases, one list per operation; they are run again through the batch operations
+static std::vector<std::string> batch_x[4], batch_y[4];
+
+// Runs one operation through both engines and reports if the results differ
+static void packed_check(const std::string &a, const std::string &b, int op, int test_number)
+{
+    batch_x[op].push_back(a);
+    batch_y[op].push_back(b);
+
+    static const char op_char[4] = { '+', '-', '*', '/' };
+    TREG x = input(a.c_str());
+    TREG y = input(b.c_str());
+    TPREG px = pack(x);
+    TPREG py = pack(y);
+
+    TREG expected = op < 2 ? add_sub(x, y, op == 1) : (op == 2 ? mult(x, y) : div(x, y));
+    TPREG packed = op < 2 ? add_sub(px, py, op == 1) : (op == 2 ? mult(px, py) : div(px, py));
+    TPREG reference = pack(expected);
+
+    tests_total++;
+    if ((packed.mant == reference.mant) && (packed.sign == reference.sign) && (packed.exps == reference.exps) && (packed.flags == reference.flags))
+    {
+        tests_pass++;
+        return;
+    }
+    tests_fail++;
+
+    TREG r;
+    unpack(packed, r);
+    printf("%s %c %s  char: %c%s (%3d)  packed: %c%s (%3d) %4d  FAIL\n", a.c_str(), op_char[op], b.c_str(),
+        expected.sign ? '-' : '+', expected.mant, expected.exps, r.sign ? '-' : '+', r.mant, r.exps, test_number);
+}
+
+void packed_test()
+{
+    std::cout << "PACKED BCD ENGINE TEST\n";
+
+    const std::deque<TCORPUSNUMBER> &c = corpus();
+    uint64_t fail = tests_fail;
+    int test_number = 1;
+
+    // Run all four operations using our set of test numbers and all sign variations
+    for (int op = 0; op < 4; op++)
+    {
+        for (int signs = 0; signs < 4; signs++)
+            corpus_cross(c, signs, [&](const TVERIF &x, const TVERIF &y) { packed_check(x.src, y.src, op, test_number++); });
+    }
+
+    // Pseudo-random exponential tests, generated the same way as in the other test suites
+    rnd.seed(43); // Reproducible random number seed
+    for (int i = 1; i <= 4 * 500; i++)
+    {
+        int index1 = rnd() % c.size();
+        int index2 = rnd() % c.size();
+        int op = rnd() % 4;
+
+        std::string s1 = random_operand(rnd, c[index1].src[0]);
+        std::string s2 = random_operand(rnd, c[index2].src[0]);
+
+        packed_check(s1, s2, op, test_number++);
+    }
+
+    std::cout << "Packed engine operations checked: " << (test_number - 1) << "  mismatches: " << (tests_fail - fail) << "\n";
+
+    // Run the same cases through the batch operations, one batch per operation, and compare
+    // each lane against the single register operation
+    static const char op_char[4] = { '+', '-', '*', '/' };
+    fail = tests_fail;
+    int lanes = 0;
+    for (int op = 0; op < 4; op++)
+    {
+        size_t n = batch_x[op].size();
+        std::vector<const char *> a(n), b(n);
+        for (size_t i = 0; i < n; i++)
+            a[i] = batch_x[op][i].c_str(), b[i] = batch_y[op][i].c_str();
+
+        TBATCH x, y, result;
+        TBATCHWORK work;
+        input(a.data(), n, x);
+        input(b.data(), n, y);
+        if (op < 2)
+            add_sub(x, y, op == 1, result, work);
+        else if (op == 2)
+            mult(x, y, result, work);
+        else
+            div(x, y, result);
+
+        for (size_t i = 0; i < n; i++, lanes++)
+        {
+            TPREG px = x.get(i), py = y.get(i);
+            TPREG expected = op < 2 ? add_sub(px, py, op == 1) : (op == 2 ? mult(px, py) : div(px, py));
+            TPREG lane = result.get(i);
+            tests_total++;
+            if ((lane.mant == expected.mant) && (lane.sign == expected.sign) && (lane.exps == expected.exps) && (lane.flags == expected.flags))
+            {
+                tests_pass++;
+                continue;
+            }
+            tests_fail++;
+            TREG r;
+            unpack(lane, r);
+            printf("%s %c %s  batch lane %d: %c%s (%3d)  FAIL\n", a[i], op_char[op], b[i], int(i), r.sign ? '-' : '+', r.mant, r.exps);
+        }
+    }
+    std::cout << "Batch operations checked: " << lanes << "  mismatches: " << (tests_fail - fail) << "\n";
+
+    // Check the lean packed parser against the reference parser: all operands of the cases above,
+    // followed by random buffers built from the characters allowed at each position
+    fail = tests_fail;
+    int parsed = 0, rejected = 0;
+    auto parse_check = [&](const char *in)
+    {
+        TPREG packed;
+        tests_total++;
+        if (!input_packed(in, packed))
+        {
+            rejected++, tests_pass++;
+            return;
+        }
+        parsed++;
+        TPREG reference = pack(input(in));
+        if ((packed.mant == reference.mant) && (packed.sign == reference.sign) && (packed.exps == reference.exps) && (packed.flags == reference.flags))
+        {
+            tests_pass++;
+            return;
+        }
+        tests_fail++;
+        printf("%s  input_packed(): %016llx (%3d)  FAIL\n", in, (unsigned long long) packed.mant, packed.exps);
+    };
+    for (int op = 0; op < 4; op++)
+    {
+        for (size_t i = 0; i < batch_x[op].size(); i++)
+        {
+            parse_check(batch_x[op][i].c_str());
+            parse_check(batch_y[op][i].c_str());
+        }
+    }
+    std::minstd_rand r(43); // Reproducible random number seed
+    static const char mant_chars[] = "0000000123456789. ";
+    for (int i = 0; i < 20000; i++)
+    {
+        char in[17];
+        in[0] = (r() & 1) ? ' ' : '-';
+        int spaces = 1 + r() % 15; // Start of the trailing spaces, mostly after the last position
+        for (int k = 1; k < 16; k++)
+            in[k] = k >= spaces + 10 ? ' ' : mant_chars[r() % (sizeof(mant_chars) - 1)];
+        if (r() & 1)
+        {
+            in[12] = 'E';
+            in[13] = (r() & 1) ? '+' : '-';
+            in[14] = rdigit(r, 10);
+            in[15] = rdigit(r, 10);
+        }
+        in[16] = 0;
+        parse_check(in);
+    }
+    std::cout << "Packed parser inputs checked: " << (parsed + rejected) << "  rejected: " << rejected << "  mismatches: " << (tests_fail - fail) << "\n";
+}
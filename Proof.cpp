@@ -5,23 +5,145 @@
     the Free Software Foundation, either version 3 of the License, or
     (at your option) any later version.
 */
-#include "TReg.h"
+#include "Common.h"
 
 void input_test();
+void fuzz_test();
 void add_sub_test();
 void mult_test();
 void div_test();
+void sqrt_test();
+void fma_test();
+void cordic_test();
+void packed_test();
+void range_test();
+void rpn_test();
+void simd_test();
+void cache_test();
+void width_test();
 
-uint32_t tests_total = 0;
-uint32_t tests_pass = 0;
-uint32_t tests_fail = 0;
+static void usage()
+{
+    std::cout << "Usage: calcproof [-r <cases> [-j <threads>] [-f | -p] [-x] [-v] [-o <file>] [-g <golden> | -u <cache> [--force]]] [-d <golden1> <golden2>] [-c <cases>] [-w <evals> [-j <threads>]] [-i <cases> [-j <threads>]] [-s <file> [-f | -p] [-m]] [-k <keystrokes>]\n";
+    std::cout << "  With no options, runs all test suites\n";
+    std::cout << "  -r <cases>    Run the given number of randomized cases in parallel, print only failures\n";
+    std::cout << "  -j <threads>  Number of threads to use (default: all cores)\n";
+    std::cout << "  -f            Use mult_column() and div_table() instead of mult() and div()\n";
+    std::cout << "  -p            Use the packed BCD engine instead of the char engine\n";
+    std::cout << "  -x            Check the results against the exact oracle instead of floating point values\n";
+    std::cout << "  -v            Print every randomized case, not only the failures\n";
+    std::cout << "  -o <file>     Write the printout of the randomized cases into the file instead of stdout\n";
+    std::cout << "  -g <golden>   Also write the binary golden record of every randomized case into the file\n";
+    std::cout << "  -u <cache>    Run the suites add_sub, mult and div of the randomized cases separately, keeping their golden\n";
+    std::cout << "                files in the cache directory; re-run only the suites whose sources changed\n";
+    std::cout << "  --force       Re-run all suites of -u\n";
+    std::cout << "  -d <golden1> <golden2>  Compare two golden files and print the records that differ\n";
+    std::cout << "  -s <file>     Evaluate the operations listed in the file (\"-\" for stdin), one per line\n";
+    std::cout << "  -m            Serve repeated operations of -s from the memoization cache\n";
+    std::cout << "  -k <keystrokes>  Run the RPN program, e.g. \"2 enter 3 +\", print X and the time per keystroke\n";
+    std::cout << "  -w <evals>    Search for the operand pairs with the largest primitive counts, with about the given evaluations per operation\n";
+    std::cout << "  -i <cases>    Fuzz the input parser: all enumerated buffers and the given number of random ones (in shards of 100000)\n";
+    std::cout << "  -c <cases>    Report the primitive counts of each operation over the given number of randomized cases\n";
+}
 
-int main()
+int main(int argc, char *argv[])
 {
+    uint64_t cases = 0;
+    uint64_t count_cases = 0;
+    uint64_t fuzz_cases = 0;
+    uint64_t worst_evals = 0;
+    bool fuzz = false;
+    const char *stream = nullptr;
+    const char *keystrokes = nullptr;
+    const char *golden = nullptr;
+    const char *cache = nullptr;
+    bool force = false;
+    const char *golden_diff[2] = {};
+    bool memo = false;
+    int threads = 0;
+    int engine = ENGINE_CHAR;
+    bool exact = false;
+    bool verbose = false;
+    const char *output = nullptr;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-r") && (i + 1 < argc))
+            cases = strtoull(argv[++i], nullptr, 10);
+        else if (!strcmp(argv[i], "-j") && (i + 1 < argc))
+            threads = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-f"))
+            engine = ENGINE_FAST;
+        else if (!strcmp(argv[i], "-p"))
+            engine = ENGINE_PACKED;
+        else if (!strcmp(argv[i], "-x"))
+            exact = true;
+        else if (!strcmp(argv[i], "-v"))
+            verbose = true;
+        else if (!strcmp(argv[i], "-o") && (i + 1 < argc))
+            output = argv[++i];
+        else if (!strcmp(argv[i], "-c") && (i + 1 < argc))
+            count_cases = strtoull(argv[++i], nullptr, 10);
+        else if (!strcmp(argv[i], "-w") && (i + 1 < argc))
+            worst_evals = strtoull(argv[++i], nullptr, 10);
+        else if (!strcmp(argv[i], "-i") && (i + 1 < argc))
+            fuzz = true, fuzz_cases = strtoull(argv[++i], nullptr, 10);
+        else if (!strcmp(argv[i], "-g") && (i + 1 < argc))
+            golden = argv[++i];
+        else if (!strcmp(argv[i], "-u") && (i + 1 < argc))
+            cache = argv[++i];
+        else if (!strcmp(argv[i], "--force"))
+            force = true;
+        else if (!strcmp(argv[i], "-d") && (i + 2 < argc))
+            golden_diff[0] = argv[i + 1], golden_diff[1] = argv[i + 2], i += 2;
+        else if (!strcmp(argv[i], "-s") && (i + 1 < argc))
+            stream = argv[++i];
+        else if (!strcmp(argv[i], "-m"))
+            memo = true;
+        else if (!strcmp(argv[i], "-k") && (i + 1 < argc))
+            keystrokes = argv[++i];
+        else
+            return usage(), 1;
+    }
+
+    if (stream)
+    {
+        FILE *in = strcmp(stream, "-") ? fopen(stream, "rb") : stdin;
+        if (!in)
+            return std::cerr << "Unable to open " << stream << "\n", 1;
+        uint64_t errors = stream_eval(in, stdout, engine, memo);
+        if (in != stdin)
+            fclose(in);
+        return errors ? 1 : 0;
+    }
+    if (keystrokes)
+        return rpn_eval(keystrokes);
+    if (fuzz)
+        return fuzz_parallel(fuzz_cases, threads) ? 1 : 0;
+    if (worst_evals)
+        return counters_worst(worst_evals, threads), 0;
+    if (golden_diff[0])
+        return golden_compare(golden_diff[0], golden_diff[1]) ? 1 : 0;
+    if (count_cases)
+        return counters_test(count_cases), 0;
+    if (cases && cache)
+        return verify_incremental(cases, threads, engine, exact, cache, force) ? 1 : 0;
+    if (cases)
+        return verify_parallel(cases, threads, engine, exact, golden, VERIFY_OPS_ALL, 0, verbose, output) ? 1 : 0;
+
     input_test();
+    fuzz_test();
     add_sub_test();
     mult_test();
     div_test();
+    sqrt_test();
+    fma_test();
+    cordic_test();
+    packed_test();
+    range_test();
+    rpn_test();
+    simd_test();
+    cache_test();
+    width_test();
 
     std::cout << "Total tests: " << tests_total << "  fail: " << tests_fail << "  rounding errors: " << (tests_total - (tests_pass + tests_fail)) << "\n";
 }
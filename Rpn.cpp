@@ -0,0 +1,382 @@
+/*  Copyright (C) 2021  Goran Devic
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+*/
+#include "Common.h"
+#include <chrono>
+
+// RPN keystroke programs:
+// - A program is a line of keystrokes separated by spaces. It is compiled once into a compact bytecode,
+//   with every number already parsed into a packed register of the constant pool
+// - The interpreter keeps the X, Y, Z and T stack and the memory registers as packed registers in the
+//   state block and works on them in place: the operands are never parsed again or unpacked
+// - The dispatch is threaded (computed goto) with GCC and clang; other compilers use a switch in a loop
+// - The stack lift follows the classic RPN calculators: ENTER and CLX disable the lift of the next number
+// - The flags of all results are accumulated in the state, so a program is checked once at its end
+// - An Error (a divide by zero) stops the program the same as on the calculator: the stack keeps the
+//   operands of the faulting keystroke and the state flags tell the error
+//
+// Keystrokes:
+//   <number>       Mantissa with an optional exponent, "-1.5", "6.02E23", "1E-5"
+//   enter          Lift the stack, X stays
+//   + - * /        Y op X, the stack drops
+//   x<>y rdn       Swap X and Y, roll the stack down
+//   chs clx        Change the sign of X, clear X
+//   sto<n> rcl<n>  Store X into, recall X from the memory register n (0..9)
+//   rep <n> ... end  Run the keystrokes in between n times, nested up to RPN_LOOPS deep
+
+#define RPN_LOOPS 4 // Nesting depth of the loops
+
+enum { RPN_END, RPN_NUM, RPN_ENTER, RPN_ADD, RPN_SUB, RPN_MUL, RPN_DIV, RPN_SWAP, RPN_RDN, RPN_CHS, RPN_CLX, RPN_STO, RPN_RCL, RPN_REP, RPN_LOOP };
+
+static inline uint16_t read16(const uint8_t *p) { return uint16_t(p[0] | (p[1] << 8)); }
+
+static void emit16(std::vector<uint8_t> &code, size_t v)
+{
+    code.push_back(uint8_t(v));
+    code.push_back(uint8_t(v >> 8));
+}
+
+// Builds the 16 char input buffer of a number keystroke and parses it; returns false if it does not fit
+static bool rpn_number(const std::string &key, TPREG &r)
+{
+    size_t e = key.find_first_of("Ee");
+    std::string mant = key.substr(0, e), pow = e == std::string::npos ? "" : key.substr(e + 1);
+    bool neg = !mant.empty() && (mant[0] == '-');
+    if (neg)
+        mant.erase(0, 1);
+    char sign = '+';
+    if (!pow.empty() && ((pow[0] == '+') || (pow[0] == '-')))
+        sign = pow[0], pow.erase(0, 1);
+    if (mant.empty() || (mant.size() > ((e == std::string::npos) ? 15u : 11u)) || (e != std::string::npos && (pow.empty() || pow.size() > 2)))
+        return false;
+
+    char in[17];
+    std::memset(in, ' ', 16);
+    in[16] = 0;
+    in[0] = neg ? '-' : ' ';
+    std::memcpy(in + 1, mant.data(), mant.size());
+    if (e != std::string::npos)
+    {
+        in[12] = 'E';
+        in[13] = sign;
+        in[14] = pow.size() == 2 ? pow[0] : '0';
+        in[15] = pow.back();
+    }
+    return input_packed(in, r);
+}
+
+bool rpn_compile(const char *text, TRPNPROGRAM &prog, std::string &error)
+{
+    static const char *simple[] = { "enter", "+", "-", "*", "/", "x<>y", "rdn", "chs", "clx" };
+    static const uint8_t simple_op[] = { RPN_ENTER, RPN_ADD, RPN_SUB, RPN_MUL, RPN_DIV, RPN_SWAP, RPN_RDN, RPN_CHS, RPN_CLX };
+
+    prog.code.clear();
+    prog.constants.clear();
+    prog.keystrokes = 0;
+    std::vector<size_t> loops; // Offsets of the open rep instructions
+    std::istringstream keys(text);
+    std::string key;
+    while (keys >> key)
+    {
+        prog.keystrokes++;
+        size_t k = std::find(simple, simple + 9, key) - simple;
+        TPREG r;
+        if (k < 9)
+            prog.code.push_back(simple_op[k]);
+        else if (((key.compare(0, 3, "sto") == 0) || (key.compare(0, 3, "rcl") == 0)) && (key.size() == 4) && isdigit(key[3]))
+        {
+            prog.code.push_back(key[0] == 's' ? RPN_STO : RPN_RCL);
+            prog.code.push_back(uint8_t(key[3] - '0'));
+        }
+        else if (key == "rep")
+        {
+            std::string count;
+            if (!(keys >> count) || (count.find_first_not_of("0123456789") != std::string::npos) || (count.size() > 5) || (std::stoul(count) > 0xFFFF))
+                return error = "rep needs a count of 0..65535", false;
+            if (loops.size() == RPN_LOOPS)
+                return error = "Loops are nested too deep", false;
+            loops.push_back(prog.code.size());
+            prog.code.push_back(RPN_REP);
+            emit16(prog.code, std::stoul(count));
+            emit16(prog.code, 0); // Offset past the end of the loop, patched by its end
+        }
+        else if (key == "end")
+        {
+            if (loops.empty())
+                return error = "end without rep", false;
+            size_t rep = loops.back();
+            loops.pop_back();
+            prog.code.push_back(RPN_LOOP);
+            emit16(prog.code, rep + 5); // The first instruction of the body
+            prog.code[rep + 3] = uint8_t(prog.code.size());
+            prog.code[rep + 4] = uint8_t(prog.code.size() >> 8);
+        }
+        else if (rpn_number(key, r))
+        {
+            prog.code.push_back(RPN_NUM);
+            emit16(prog.code, prog.constants.size());
+            prog.constants.push_back(r);
+        }
+        else
+            return error = "Unknown keystroke \"" + key + "\"", false;
+        if ((prog.code.size() > 0xFFF0) || (prog.constants.size() > 0xFFFF))
+            return error = "Program is too long", false;
+    }
+    if (!loops.empty())
+        return error = "rep without end", false;
+    prog.code.push_back(RPN_END);
+    return true;
+}
+
+static inline void rpn_lift(TRPNSTATE &s)
+{
+    s.t = s.z;
+    s.z = s.y;
+    s.y = s.x;
+}
+
+static inline void rpn_drop(TRPNSTATE &s, const TPREG &x)
+{
+    s.x = x;
+    s.y = s.z;
+    s.z = s.t;
+    s.flags |= x.flags;
+    s.lift = true;
+}
+
+uint64_t rpn_run(const TRPNPROGRAM &prog, TRPNSTATE &s)
+{
+    const uint8_t *code = prog.code.data();
+    const uint8_t *pc = code;
+    const TPREG *constants = prog.constants.data();
+    uint16_t loop[RPN_LOOPS];
+    int depth = 0;
+    uint64_t steps = 0;
+
+#if defined(__GNUC__)
+    // Every instruction jumps straight to the next one, so each has its own, better predicted, branch
+    static void *const dispatch[] = { &&op_END, &&op_NUM, &&op_ENTER, &&op_ADD, &&op_SUB, &&op_MUL, &&op_DIV, &&op_SWAP, &&op_RDN,
+                                      &&op_CHS, &&op_CLX, &&op_STO, &&op_RCL, &&op_REP, &&op_LOOP };
+#define RPN_OP(op) op_##op:
+#define RPN_NEXT do { steps++; goto *dispatch[*pc++]; } while (0)
+    RPN_NEXT;
+#else
+#define RPN_OP(op) case RPN_##op:
+#define RPN_NEXT continue
+    for (;;)
+    {
+        steps++;
+        switch (*pc++)
+        {
+#endif
+    RPN_OP(END)
+        return steps - 1;
+    RPN_OP(NUM)
+        if (s.lift)
+            rpn_lift(s);
+        s.x = constants[read16(pc)];
+        s.lift = true;
+        pc += 2;
+        RPN_NEXT;
+    RPN_OP(ENTER)
+        rpn_lift(s);
+        s.lift = false;
+        RPN_NEXT;
+    RPN_OP(ADD)
+        rpn_drop(s, add_sub(s.y, s.x, false));
+        RPN_NEXT;
+    RPN_OP(SUB)
+        rpn_drop(s, add_sub(s.y, s.x, true));
+        RPN_NEXT;
+    RPN_OP(MUL)
+        rpn_drop(s, mult(s.y, s.x));
+        RPN_NEXT;
+    RPN_OP(DIV)
+    {
+        TPREG r = div(s.y, s.x);
+        if (r.flags & FLAGS_ERROR)
+        {
+            s.flags |= r.flags;
+            return steps; // The faulting keystroke is the last one executed
+        }
+        rpn_drop(s, r);
+        RPN_NEXT;
+    }
+    RPN_OP(SWAP)
+        std::swap(s.x, s.y);
+        s.lift = true;
+        RPN_NEXT;
+    RPN_OP(RDN)
+    {
+        TPREG x = s.x;
+        s.x = s.y;
+        s.y = s.z;
+        s.z = s.t;
+        s.t = x;
+        s.lift = true;
+        RPN_NEXT;
+    }
+    RPN_OP(CHS)
+        s.x.sign ^= s.x.mant != 0; // Zero stays a true zero
+        RPN_NEXT;
+    RPN_OP(CLX)
+        s.x = TPREG();
+        s.lift = false;
+        RPN_NEXT;
+    RPN_OP(STO)
+        s.mem[*pc++] = s.x;
+        s.lift = true;
+        RPN_NEXT;
+    RPN_OP(RCL)
+        if (s.lift)
+            rpn_lift(s);
+        s.x = s.mem[*pc++];
+        s.lift = true;
+        RPN_NEXT;
+    RPN_OP(REP)
+        if (read16(pc))
+        {
+            loop[depth++] = read16(pc);
+            pc += 4;
+        }
+        else
+            pc = code + read16(pc + 2); // Zero times, skip the whole loop
+        RPN_NEXT;
+    RPN_OP(LOOP)
+        if (--loop[depth - 1])
+            pc = code + read16(pc);
+        else
+        {
+            depth--;
+            pc += 2;
+        }
+        RPN_NEXT;
+#if !defined(__GNUC__)
+        }
+    }
+#endif
+#undef RPN_OP
+#undef RPN_NEXT
+    return steps;
+}
+
+static void print_x(const TRPNSTATE &s)
+{
+    static const char *names[] = { "OVERFLOW", "UNDERFLOW", "DIV0", "DOMAIN" };
+    TREG x; // Unpacked only to be shown
+    unpack(s.x, x);
+    if (s.flags & FLAGS_ERROR)
+        printf("Error                 flags:");
+    else
+        printf("%c%s E%c%02d  flags:", x.sign ? '-' : '+', x.mant, x.exps >= 128 ? '+' : '-', std::abs(int(x.exps) - 128));
+    for (int i = 0; i < 4; i++)
+        if (s.flags & (1 << i))
+            printf(" %s", names[i]);
+    if (!s.flags)
+        printf(" none");
+}
+
+int rpn_eval(const char *text)
+{
+    TRPNPROGRAM prog;
+    std::string error;
+    if (!rpn_compile(text, prog, error))
+        return std::cerr << error << "\n", 1;
+
+    // The first run gives the result, the following ones measure the steady state of the interpreter
+    TRPNSTATE s;
+    uint64_t steps = rpn_run(prog, s);
+    std::cout << "X: ";
+    print_x(s);
+    std::cout << "\n";
+    if (s.flags & FLAGS_ERROR)
+        return std::cerr << "Program stopped on Error after " << steps << " executed keystrokes\n", 1;
+
+    int runs = int(std::min<uint64_t>(100000, std::max<uint64_t>(1, 10000000 / std::max<uint64_t>(steps, 1))));
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int i = 0; i < runs; i++)
+    {
+        TRPNSTATE t;
+        rpn_run(prog, t);
+    }
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / runs;
+    printf("Keystrokes: %u  bytecode: %u bytes  constants: %u  executed: %llu  in %.0f ns (%.1f ns per keystroke)\n", prog.keystrokes,
+           unsigned(prog.code.size()), unsigned(prog.constants.size()), (unsigned long long) steps, ns, ns / std::max<uint64_t>(steps, 1));
+    return 0;
+}
+
+void rpn_test()
+{
+    std::cout << "RPN PROGRAM TEST\n";
+    uint32_t total = 0, fail = 0;
+
+    // Expected results come from the same operations called directly in the order of the keystrokes
+    auto num = [](const char *key) { TPREG r; rpn_number(key, r); return r; };
+    TPREG loan, harmonic, k;
+    TPREG q = num("1");
+    for (int i = 0; i < 36; i++)
+        q = mult(q, num("1.005"));
+    loan = div(mult(mult(q, num("10000")), num("0.005")), add_sub(q, num("1"), true));
+    for (int i = 0; i < 100; i++)
+    {
+        k = add_sub(k, num("1"), false);
+        harmonic = add_sub(harmonic, div(num("1"), k), false);
+    }
+
+    struct TRpnCase
+    {
+        const char *text;
+        TPREG x;
+        uint8_t flags;
+    };
+    const TRpnCase cases[] = {
+        { "2 enter 3 + 4 * +", num("20"), 0 }, // Numbers after enter replace X, so the stack below stays clear
+        { "1 enter 2 enter 3 enter 4 rdn rdn x<>y -", num("1"), 0 }, // 2 - 1 after the rolls and the swap
+        { "5 enter clx 7 +", num("12"), 0 }, // clx disables the lift, 7 replaces X
+        { "3 chs sto4 clx rcl4 rcl4 *", num("9"), 0 },
+        { "1 rep 36 1.005 * end sto0 10000 * 0.005 * rcl0 1 - /", loan, 0 }, // Monthly payment of a loan
+        { "0 rep 100 rcl1 1 + sto1 1 x<>y / + end", harmonic, 0 }, // Sum of 1/k for k = 1..100
+        { "2 rep 0 3 * end", num("2"), 0 },
+        { "1E99 enter * 1 +", add_sub(mult(num("1E99"), num("1E99")), num("1"), false), FLAG_OVERFLOW },
+        { "1E-99 enter * 1E-99 +", num("1E-99"), FLAG_UNDERFLOW },
+        { "1 0 / 2 +", num("0"), FLAG_DIV0 }, // Stops on Error, the divisor stays in X
+        { "3 rep 5 2 * 0 / end 7 +", num("0"), FLAG_DIV0 }, // Also from inside of a loop
+    };
+    for (const TRpnCase &c : cases)
+    {
+        TRPNPROGRAM prog;
+        std::string error;
+        TRPNSTATE s;
+        bool ok = rpn_compile(c.text, prog, error);
+        if (ok)
+            rpn_run(prog, s);
+        ok = ok && (s.x.mant == c.x.mant) && (s.x.sign == c.x.sign) && (s.x.exps == c.x.exps) && (s.flags == c.flags);
+        printf("%-56s X: ", c.text);
+        print_x(s);
+        printf("  %s\n", ok ? "OK" : "FAIL");
+        fail += !ok;
+        total++;
+    }
+
+    // Malformed programs are rejected at compile time
+    static const char *malformed[] = { "2 foo", "rep 3 1", "1 end", "sto12", "rep x 1 end", "123456789012E5", "rep 1 rep 1 rep 1 rep 1 rep 1 end end end end end" };
+    for (const char *text : malformed)
+    {
+        TRPNPROGRAM prog;
+        std::string error;
+        bool ok = !rpn_compile(text, prog, error);
+        if (!ok)
+            printf("%-56s compiled  FAIL\n", text);
+        fail += !ok;
+        total++;
+    }
+
+    std::cout << "RPN programs checked: " << total << "  fail: " << fail << "\n";
+    tests_total += total;
+    tests_pass += total - fail;
+    tests_fail += fail;
+}
@@ -0,0 +1,693 @@
+/*  Copyright (C) 2021  Goran Devic
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+*/
+#include "Common.h"
+
+// SIMD lane kernels of the batch operations:
+// - Every 64-bit lane holds one packed scratch register (16 BCD digits), so one AVX2 instruction
+//   works on 4 registers (64 digits) and one SSE2 or NEON instruction on 2 registers (32 digits)
+// - The digit carries and borrows are resolved with the same +6 decimal adjust trick as packed_adc()
+//   and packed_sbc(); the carry out of the topmost digit is computed from the top bits, since
+//   SSE2 and AVX2 have no unsigned 64-bit compare
+// - The kernel set is picked at runtime; the scalar kernels handle the lanes left over. Tests can select
+//   any supported set with simd_select(), the batch operations then run on it
+// - The alignment pass selects with compare masks and shifts every lane by its own count; SSE2 has no
+//   per-lane shift nor 64-bit compare, it shifts each half separately and compares the 32-bit halves
+// - simd_test() checks every supported kernel set against the scalar bcd_adc()/bcd_sbc(), and the
+//   alignment and normalization kernels against their scalar versions
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_X86
+#define SIMD_TARGET(t) __attribute__((target(t)))
+#include <immintrin.h>
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#define SIMD_X86
+#define SIMD_TARGET(t)
+#include <immintrin.h>
+#include <intrin.h>
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+#define SIMD_ARM
+#include <arm_neon.h>
+#endif
+
+typedef void (*TLaneKernel)(const TPASR *a, const TPASR *b, TPASR *r, uint8_t *c, size_t n);
+
+// The scalar alignment pass over all lanes, the SIMD ones hand it their leftover lanes
+static void batch_align_all_scalar(const TBATCH &x, const TBATCH &y, bool is_sub, TBATCH &result, TPASR *a, TPASR *b, uint8_t *op)
+{
+    batch_align_scalar(x, y, is_sub, result, a, b, op, 0);
+}
+
+#ifdef SIMD_X86
+SIMD_TARGET("sse2")
+static void batch_adc_sse2(const TPASR *a, const TPASR *b, TPASR *r, uint8_t *carry, size_t n)
+{
+    const __m128i sixes = _mm_set1_epi64x(BCD_SIXES);
+    const __m128i carries = _mm_set1_epi64x(BCD_CARRIES);
+    const __m128i top_six = _mm_set1_epi64x(BCD_TOP_SIX);
+    const __m128i one = _mm_set1_epi64x(1);
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2)
+    {
+        __m128i va = _mm_loadu_si128((const __m128i *) (a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *) (b + i));
+        __m128i t1 = _mm_add_epi64(va, sixes);
+        __m128i t2 = _mm_add_epi64(t1, vb);
+        // Carry out of the topmost bit: (t1 & b) | ((t1 | b) & ~t2)
+        __m128i co = _mm_srli_epi64(_mm_or_si128(_mm_and_si128(t1, vb), _mm_andnot_si128(t2, _mm_or_si128(t1, vb))), 63);
+        __m128i t3 = _mm_and_si128(_mm_xor_si128(_mm_xor_si128(t2, t1), vb), carries);
+        __m128i t4 = _mm_andnot_si128(t3, carries);
+        __m128i t5 = _mm_or_si128(_mm_srli_epi64(t4, 2), _mm_srli_epi64(t4, 3));
+        t5 = _mm_or_si128(t5, _mm_and_si128(_mm_sub_epi64(_mm_setzero_si128(), _mm_xor_si128(co, one)), top_six));
+        _mm_storeu_si128((__m128i *) (r + i), _mm_sub_epi64(t2, t5));
+        alignas(16) uint64_t c[2];
+        _mm_store_si128((__m128i *) c, co);
+        carry[i] = uint8_t(c[0]), carry[i + 1] = uint8_t(c[1]);
+    }
+    batch_adc_scalar(a + i, b + i, r + i, carry + i, n - i);
+}
+
+SIMD_TARGET("sse2")
+static void batch_sbc_sse2(const TPASR *a, const TPASR *b, TPASR *r, uint8_t *borrow, size_t n)
+{
+    const __m128i carries = _mm_set1_epi64x(BCD_CARRIES);
+    const __m128i top_six = _mm_set1_epi64x(BCD_TOP_SIX);
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2)
+    {
+        __m128i va = _mm_loadu_si128((const __m128i *) (a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *) (b + i));
+        __m128i t1 = _mm_sub_epi64(va, vb);
+        // Borrow out of the topmost bit: (~a & b) | (~(a ^ b) & t1)
+        __m128i bo = _mm_srli_epi64(_mm_or_si128(_mm_andnot_si128(va, vb), _mm_andnot_si128(_mm_xor_si128(va, vb), t1)), 63);
+        __m128i t2 = _mm_and_si128(_mm_xor_si128(_mm_xor_si128(t1, va), vb), carries);
+        __m128i t3 = _mm_or_si128(_mm_srli_epi64(t2, 2), _mm_srli_epi64(t2, 3));
+        t3 = _mm_or_si128(t3, _mm_and_si128(_mm_sub_epi64(_mm_setzero_si128(), bo), top_six));
+        _mm_storeu_si128((__m128i *) (r + i), _mm_sub_epi64(t1, t3));
+        alignas(16) uint64_t c[2];
+        _mm_store_si128((__m128i *) c, bo);
+        borrow[i] = uint8_t(c[0]), borrow[i + 1] = uint8_t(c[1]);
+    }
+    batch_sbc_scalar(a + i, b + i, r + i, borrow + i, n - i);
+}
+
+// Selects the lanes of a where the mask is set, and the lanes of b elsewhere
+SIMD_TARGET("sse2")
+static inline __m128i select_sse2(__m128i mask, __m128i a, __m128i b)
+{
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+// Sets all bits of the 64-bit lanes that are zero; SSE2 compares at most 32 bits at a time
+SIMD_TARGET("sse2")
+static inline __m128i is_zero_sse2(__m128i v)
+{
+    __m128i e = _mm_cmpeq_epi32(v, _mm_setzero_si128());
+    return _mm_and_si128(e, _mm_shuffle_epi32(e, _MM_SHUFFLE(2, 3, 0, 1)));
+}
+
+// The 64-bit lanes of a > b, for values that fit into 31 bits; SSE2 compares at most 32 bits at a time
+SIMD_TARGET("sse2")
+static inline __m128i is_greater_sse2(__m128i a, __m128i b)
+{
+    return _mm_shuffle_epi32(_mm_cmpgt_epi32(a, b), _MM_SHUFFLE(2, 2, 0, 0));
+}
+
+// Shifts each 64-bit lane right by its own count; SSE2 shifts both lanes by the same count
+SIMD_TARGET("sse2")
+static inline __m128i shift_right_sse2(__m128i v, __m128i bits)
+{
+    __m128i r0 = _mm_srl_epi64(v, bits);
+    __m128i r1 = _mm_srl_epi64(v, _mm_unpackhi_epi64(bits, bits));
+    return _mm_castpd_si128(_mm_move_sd(_mm_castsi128_pd(r1), _mm_castsi128_pd(r0)));
+}
+
+SIMD_TARGET("sse2")
+static void batch_align_sse2(const TBATCH &x, const TBATCH &y, bool is_sub, TBATCH &result, TPASR *a, TPASR *b, uint8_t *op)
+{
+    const __m128i one = _mm_set1_epi64x(1);
+    const __m128i mask = _mm_set1_epi64x(PACKED_MANT_MASK);
+    const __m128i sub = _mm_set1_epi64x(is_sub ? -1 : 0);
+    size_t n = x.size(), i = 0;
+    for (; i + 2 <= n; i += 2)
+    {
+        __m128i vx = _mm_loadu_si128((const __m128i *) (x.mant.data() + i));
+        __m128i vy = _mm_loadu_si128((const __m128i *) (y.mant.data() + i));
+        __m128i exp_x = _mm_set_epi64x(x.exps[i + 1], x.exps[i]), exp_y = _mm_set_epi64x(y.exps[i + 1], y.exps[i]);
+        __m128i sign_x = _mm_set_epi64x(x.sign[i + 1], x.sign[i]), sign_y = _mm_set_epi64x(y.sign[i + 1], y.sign[i]);
+
+        // Terms which are zero or too small to be aligned return the other term
+        __m128i x_lt_y = is_greater_sse2(exp_y, exp_x);
+        __m128i shift = select_sse2(x_lt_y, _mm_sub_epi64(exp_y, exp_x), _mm_sub_epi64(exp_x, exp_y));
+        __m128i x_is_0 = is_zero_sse2(vx), y_is_0 = is_zero_sse2(vy);
+        __m128i too_small = is_greater_sse2(shift, _mm_set1_epi64x(MAX_MANT - 1));
+        __m128i return_x = _mm_or_si128(y_is_0, _mm_andnot_si128(x_is_0, _mm_andnot_si128(x_lt_y, too_small)));
+        __m128i return_y = _mm_andnot_si128(return_x, _mm_or_si128(x_is_0, too_small));
+        __m128i done = _mm_or_si128(return_x, return_y);
+        __m128i bits = _mm_slli_epi64(_mm_andnot_si128(done, shift), 2);
+        _mm_storeu_si128((__m128i *) (result.mant.data() + i), select_sse2(return_x, vx, vy));
+        __m128i scratch1 = _mm_and_si128(shift_right_sse2(vx, _mm_and_si128(x_lt_y, bits)), mask);
+        __m128i scratch2 = _mm_and_si128(shift_right_sse2(vy, _mm_andnot_si128(x_lt_y, bits)), mask);
+
+        // Subtract smaller from the larger value; scratch1 < scratch2 is the borrow out of scratch1 - scratch2
+        __m128i is_addition = _mm_xor_si128(is_zero_sse2(_mm_xor_si128(sign_x, sign_y)), sub);
+        __m128i borrow = _mm_or_si128(_mm_andnot_si128(scratch1, scratch2), _mm_andnot_si128(_mm_xor_si128(scratch1, scratch2), _mm_sub_epi64(scratch1, scratch2)));
+        __m128i swap = _mm_andnot_si128(is_addition, _mm_sub_epi64(_mm_setzero_si128(), _mm_srli_epi64(borrow, 63)));
+        _mm_storeu_si128((__m128i *) (a + i), select_sse2(swap, scratch2, scratch1));
+        _mm_storeu_si128((__m128i *) (b + i), select_sse2(swap, scratch1, scratch2));
+
+        // Signs, exponents and the operations, one byte each in every 64-bit lane
+        __m128i exps = select_sse2(return_x, select_sse2(x_is_0, _mm_set1_epi64x(128), exp_x), select_sse2(return_y, exp_y, select_sse2(x_lt_y, exp_y, exp_x)));
+        __m128i sign = select_sse2(return_x, _mm_andnot_si128(x_is_0, sign_x),
+                                   select_sse2(return_y, _mm_xor_si128(sign_y, _mm_and_si128(sub, one)), _mm_xor_si128(sign_x, _mm_and_si128(swap, one))));
+        __m128i ops = _mm_andnot_si128(done, select_sse2(is_addition, one, _mm_set1_epi64x(2)));
+        alignas(16) uint64_t t[2];
+        _mm_store_si128((__m128i *) t, _mm_or_si128(sign, _mm_or_si128(_mm_slli_epi64(exps, 8), _mm_slli_epi64(ops, 16))));
+        for (int k = 0; k < 2; k++)
+        {
+            result.sign[i + k] = uint8_t(t[k]);
+            result.exps[i + k] = uint8_t(t[k] >> 8);
+            result.flags[i + k] = 0;
+            op[i + k] = uint8_t(t[k] >> 16);
+        }
+    }
+    batch_align_scalar(x, y, is_sub, result, a, b, op, i);
+}
+
+SIMD_TARGET("sse2")
+static void batch_normalize_sse2(TPASR *r, uint8_t *zeros, size_t n)
+{
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2)
+    {
+        // Counts the leading zero digits in halving steps, the same as batch_normalize_scalar()
+        __m128i x = _mm_loadu_si128((const __m128i *) (r + i));
+        __m128i m = is_zero_sse2(_mm_srli_epi64(x, 32));
+        __m128i count = _mm_and_si128(m, _mm_set1_epi64x(8));
+        x = select_sse2(m, _mm_slli_epi64(x, 32), x);
+        m = is_zero_sse2(_mm_srli_epi64(x, 48));
+        count = _mm_add_epi64(count, _mm_and_si128(m, _mm_set1_epi64x(4)));
+        x = select_sse2(m, _mm_slli_epi64(x, 16), x);
+        m = is_zero_sse2(_mm_srli_epi64(x, 56));
+        count = _mm_add_epi64(count, _mm_and_si128(m, _mm_set1_epi64x(2)));
+        x = select_sse2(m, _mm_slli_epi64(x, 8), x);
+        m = is_zero_sse2(_mm_srli_epi64(x, 60));
+        count = _mm_add_epi64(count, _mm_and_si128(m, _mm_set1_epi64x(1)));
+        x = select_sse2(m, _mm_slli_epi64(x, 4), x);
+        count = _mm_add_epi64(count, _mm_and_si128(is_zero_sse2(x), _mm_set1_epi64x(1)));
+        _mm_storeu_si128((__m128i *) (r + i), x);
+        alignas(16) uint64_t c[2];
+        _mm_store_si128((__m128i *) c, count);
+        zeros[i] = uint8_t(c[0]), zeros[i + 1] = uint8_t(c[1]);
+    }
+    batch_normalize_scalar(r + i, zeros + i, n - i);
+}
+
+SIMD_TARGET("avx2")
+static void batch_adc_avx2(const TPASR *a, const TPASR *b, TPASR *r, uint8_t *carry, size_t n)
+{
+    const __m256i sixes = _mm256_set1_epi64x(BCD_SIXES);
+    const __m256i carries = _mm256_set1_epi64x(BCD_CARRIES);
+    const __m256i top_six = _mm256_set1_epi64x(BCD_TOP_SIX);
+    const __m256i one = _mm256_set1_epi64x(1);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m256i va = _mm256_loadu_si256((const __m256i *) (a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i *) (b + i));
+        __m256i t1 = _mm256_add_epi64(va, sixes);
+        __m256i t2 = _mm256_add_epi64(t1, vb);
+        // Carry out of the topmost bit: (t1 & b) | ((t1 | b) & ~t2)
+        __m256i co = _mm256_srli_epi64(_mm256_or_si256(_mm256_and_si256(t1, vb), _mm256_andnot_si256(t2, _mm256_or_si256(t1, vb))), 63);
+        __m256i t3 = _mm256_and_si256(_mm256_xor_si256(_mm256_xor_si256(t2, t1), vb), carries);
+        __m256i t4 = _mm256_andnot_si256(t3, carries);
+        __m256i t5 = _mm256_or_si256(_mm256_srli_epi64(t4, 2), _mm256_srli_epi64(t4, 3));
+        t5 = _mm256_or_si256(t5, _mm256_and_si256(_mm256_sub_epi64(_mm256_setzero_si256(), _mm256_xor_si256(co, one)), top_six));
+        _mm256_storeu_si256((__m256i *) (r + i), _mm256_sub_epi64(t2, t5));
+        alignas(32) uint64_t c[4];
+        _mm256_store_si256((__m256i *) c, co);
+        for (int k = 0; k < 4; k++)
+            carry[i + k] = uint8_t(c[k]);
+    }
+    batch_adc_scalar(a + i, b + i, r + i, carry + i, n - i);
+}
+
+SIMD_TARGET("avx2")
+static void batch_sbc_avx2(const TPASR *a, const TPASR *b, TPASR *r, uint8_t *borrow, size_t n)
+{
+    const __m256i carries = _mm256_set1_epi64x(BCD_CARRIES);
+    const __m256i top_six = _mm256_set1_epi64x(BCD_TOP_SIX);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m256i va = _mm256_loadu_si256((const __m256i *) (a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i *) (b + i));
+        __m256i t1 = _mm256_sub_epi64(va, vb);
+        // Borrow out of the topmost bit: (~a & b) | (~(a ^ b) & t1)
+        __m256i bo = _mm256_srli_epi64(_mm256_or_si256(_mm256_andnot_si256(va, vb), _mm256_andnot_si256(_mm256_xor_si256(va, vb), t1)), 63);
+        __m256i t2 = _mm256_and_si256(_mm256_xor_si256(_mm256_xor_si256(t1, va), vb), carries);
+        __m256i t3 = _mm256_or_si256(_mm256_srli_epi64(t2, 2), _mm256_srli_epi64(t2, 3));
+        t3 = _mm256_or_si256(t3, _mm256_and_si256(_mm256_sub_epi64(_mm256_setzero_si256(), bo), top_six));
+        _mm256_storeu_si256((__m256i *) (r + i), _mm256_sub_epi64(t1, t3));
+        alignas(32) uint64_t c[4];
+        _mm256_store_si256((__m256i *) c, bo);
+        for (int k = 0; k < 4; k++)
+            borrow[i + k] = uint8_t(c[k]);
+    }
+    batch_sbc_scalar(a + i, b + i, r + i, borrow + i, n - i);
+}
+
+SIMD_TARGET("avx2")
+static inline __m256i select_avx2(__m256i mask, __m256i a, __m256i b)
+{
+    return _mm256_or_si256(_mm256_and_si256(mask, a), _mm256_andnot_si256(mask, b));
+}
+
+// Loads 4 bytes into the 64-bit lanes
+SIMD_TARGET("avx2")
+static inline __m256i load_bytes_avx2(const uint8_t *p)
+{
+    int32_t v;
+    memcpy(&v, p, sizeof(v));
+    return _mm256_cvtepu8_epi64(_mm_cvtsi32_si128(v));
+}
+
+SIMD_TARGET("avx2")
+static void batch_align_avx2(const TBATCH &x, const TBATCH &y, bool is_sub, TBATCH &result, TPASR *a, TPASR *b, uint8_t *op)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi64x(1);
+    const __m256i mask = _mm256_set1_epi64x(PACKED_MANT_MASK);
+    const __m256i sub = _mm256_set1_epi64x(is_sub ? -1 : 0);
+    size_t n = x.size(), i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m256i vx = _mm256_loadu_si256((const __m256i *) (x.mant.data() + i));
+        __m256i vy = _mm256_loadu_si256((const __m256i *) (y.mant.data() + i));
+        __m256i exp_x = load_bytes_avx2(x.exps.data() + i), exp_y = load_bytes_avx2(y.exps.data() + i);
+        __m256i sign_x = load_bytes_avx2(x.sign.data() + i), sign_y = load_bytes_avx2(y.sign.data() + i);
+
+        // Terms which are zero or too small to be aligned return the other term
+        __m256i x_lt_y = _mm256_cmpgt_epi64(exp_y, exp_x);
+        __m256i shift = select_avx2(x_lt_y, _mm256_sub_epi64(exp_y, exp_x), _mm256_sub_epi64(exp_x, exp_y));
+        __m256i x_is_0 = _mm256_cmpeq_epi64(vx, zero), y_is_0 = _mm256_cmpeq_epi64(vy, zero);
+        __m256i too_small = _mm256_cmpgt_epi64(shift, _mm256_set1_epi64x(MAX_MANT - 1));
+        __m256i return_x = _mm256_or_si256(y_is_0, _mm256_andnot_si256(x_is_0, _mm256_andnot_si256(x_lt_y, too_small)));
+        __m256i return_y = _mm256_andnot_si256(return_x, _mm256_or_si256(x_is_0, too_small));
+        __m256i done = _mm256_or_si256(return_x, return_y);
+        __m256i bits = _mm256_slli_epi64(_mm256_andnot_si256(done, shift), 2);
+        _mm256_storeu_si256((__m256i *) (result.mant.data() + i), select_avx2(return_x, vx, vy));
+        __m256i scratch1 = _mm256_and_si256(_mm256_srlv_epi64(vx, _mm256_and_si256(x_lt_y, bits)), mask);
+        __m256i scratch2 = _mm256_and_si256(_mm256_srlv_epi64(vy, _mm256_andnot_si256(x_lt_y, bits)), mask);
+
+        // Subtract smaller from the larger value; scratch1 < scratch2 is the borrow out of scratch1 - scratch2
+        __m256i is_addition = _mm256_xor_si256(_mm256_cmpeq_epi64(sign_x, sign_y), sub);
+        __m256i borrow = _mm256_or_si256(_mm256_andnot_si256(scratch1, scratch2), _mm256_andnot_si256(_mm256_xor_si256(scratch1, scratch2), _mm256_sub_epi64(scratch1, scratch2)));
+        __m256i swap = _mm256_andnot_si256(is_addition, _mm256_sub_epi64(zero, _mm256_srli_epi64(borrow, 63)));
+        _mm256_storeu_si256((__m256i *) (a + i), select_avx2(swap, scratch2, scratch1));
+        _mm256_storeu_si256((__m256i *) (b + i), select_avx2(swap, scratch1, scratch2));
+
+        // Signs, exponents and the operations, one byte each in every 64-bit lane
+        __m256i exps = select_avx2(return_x, select_avx2(x_is_0, _mm256_set1_epi64x(128), exp_x), select_avx2(return_y, exp_y, select_avx2(x_lt_y, exp_y, exp_x)));
+        __m256i sign = select_avx2(return_x, _mm256_andnot_si256(x_is_0, sign_x),
+                                   select_avx2(return_y, _mm256_xor_si256(sign_y, _mm256_and_si256(sub, one)), _mm256_xor_si256(sign_x, _mm256_and_si256(swap, one))));
+        __m256i ops = _mm256_andnot_si256(done, select_avx2(is_addition, one, _mm256_set1_epi64x(2)));
+        alignas(32) uint64_t t[4];
+        _mm256_store_si256((__m256i *) t, _mm256_or_si256(sign, _mm256_or_si256(_mm256_slli_epi64(exps, 8), _mm256_slli_epi64(ops, 16))));
+        for (int k = 0; k < 4; k++)
+        {
+            result.sign[i + k] = uint8_t(t[k]);
+            result.exps[i + k] = uint8_t(t[k] >> 8);
+            result.flags[i + k] = 0;
+            op[i + k] = uint8_t(t[k] >> 16);
+        }
+    }
+    batch_align_scalar(x, y, is_sub, result, a, b, op, i);
+}
+
+SIMD_TARGET("avx2")
+static void batch_normalize_avx2(TPASR *r, uint8_t *zeros, size_t n)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        // Counts the leading zero digits in halving steps, the same as batch_normalize_scalar()
+        __m256i x = _mm256_loadu_si256((const __m256i *) (r + i));
+        __m256i m = _mm256_cmpeq_epi64(_mm256_srli_epi64(x, 32), zero);
+        __m256i count = _mm256_and_si256(m, _mm256_set1_epi64x(8));
+        x = select_avx2(m, _mm256_slli_epi64(x, 32), x);
+        m = _mm256_cmpeq_epi64(_mm256_srli_epi64(x, 48), zero);
+        count = _mm256_add_epi64(count, _mm256_and_si256(m, _mm256_set1_epi64x(4)));
+        x = select_avx2(m, _mm256_slli_epi64(x, 16), x);
+        m = _mm256_cmpeq_epi64(_mm256_srli_epi64(x, 56), zero);
+        count = _mm256_add_epi64(count, _mm256_and_si256(m, _mm256_set1_epi64x(2)));
+        x = select_avx2(m, _mm256_slli_epi64(x, 8), x);
+        m = _mm256_cmpeq_epi64(_mm256_srli_epi64(x, 60), zero);
+        count = _mm256_add_epi64(count, _mm256_and_si256(m, _mm256_set1_epi64x(1)));
+        x = select_avx2(m, _mm256_slli_epi64(x, 4), x);
+        count = _mm256_add_epi64(count, _mm256_and_si256(_mm256_cmpeq_epi64(x, zero), _mm256_set1_epi64x(1)));
+        _mm256_storeu_si256((__m256i *) (r + i), x);
+        alignas(32) uint64_t c[4];
+        _mm256_store_si256((__m256i *) c, count);
+        for (int k = 0; k < 4; k++)
+            zeros[i + k] = uint8_t(c[k]);
+    }
+    batch_normalize_scalar(r + i, zeros + i, n - i);
+}
+#endif // SIMD_X86
+
+#ifdef SIMD_ARM
+static void batch_adc_neon(const TPASR *a, const TPASR *b, TPASR *r, uint8_t *carry, size_t n)
+{
+    const uint64x2_t sixes = vdupq_n_u64(BCD_SIXES);
+    const uint64x2_t carries = vdupq_n_u64(BCD_CARRIES);
+    const uint64x2_t top_six = vdupq_n_u64(BCD_TOP_SIX);
+    const uint64x2_t one = vdupq_n_u64(1);
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2)
+    {
+        uint64x2_t va = vld1q_u64(a + i);
+        uint64x2_t vb = vld1q_u64(b + i);
+        uint64x2_t t1 = vaddq_u64(va, sixes);
+        uint64x2_t t2 = vaddq_u64(t1, vb);
+        // Carry out of the topmost bit: (t1 & b) | ((t1 | b) & ~t2)
+        uint64x2_t co = vshrq_n_u64(vorrq_u64(vandq_u64(t1, vb), vbicq_u64(vorrq_u64(t1, vb), t2)), 63);
+        uint64x2_t t3 = vandq_u64(veorq_u64(veorq_u64(t2, t1), vb), carries);
+        uint64x2_t t4 = vbicq_u64(carries, t3);
+        uint64x2_t t5 = vorrq_u64(vshrq_n_u64(t4, 2), vshrq_n_u64(t4, 3));
+        t5 = vorrq_u64(t5, vandq_u64(vsubq_u64(vdupq_n_u64(0), veorq_u64(co, one)), top_six));
+        vst1q_u64(r + i, vsubq_u64(t2, t5));
+        carry[i] = uint8_t(vgetq_lane_u64(co, 0)), carry[i + 1] = uint8_t(vgetq_lane_u64(co, 1));
+    }
+    batch_adc_scalar(a + i, b + i, r + i, carry + i, n - i);
+}
+
+static void batch_sbc_neon(const TPASR *a, const TPASR *b, TPASR *r, uint8_t *borrow, size_t n)
+{
+    const uint64x2_t carries = vdupq_n_u64(BCD_CARRIES);
+    const uint64x2_t top_six = vdupq_n_u64(BCD_TOP_SIX);
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2)
+    {
+        uint64x2_t va = vld1q_u64(a + i);
+        uint64x2_t vb = vld1q_u64(b + i);
+        uint64x2_t t1 = vsubq_u64(va, vb);
+        // Borrow out of the topmost bit: (~a & b) | (~(a ^ b) & t1)
+        uint64x2_t bo = vshrq_n_u64(vorrq_u64(vbicq_u64(vb, va), vbicq_u64(t1, veorq_u64(va, vb))), 63);
+        uint64x2_t t2 = vandq_u64(veorq_u64(veorq_u64(t1, va), vb), carries);
+        uint64x2_t t3 = vorrq_u64(vshrq_n_u64(t2, 2), vshrq_n_u64(t2, 3));
+        t3 = vorrq_u64(t3, vandq_u64(vsubq_u64(vdupq_n_u64(0), bo), top_six));
+        vst1q_u64(r + i, vsubq_u64(t1, t3));
+        borrow[i] = uint8_t(vgetq_lane_u64(bo, 0)), borrow[i + 1] = uint8_t(vgetq_lane_u64(bo, 1));
+    }
+    batch_sbc_scalar(a + i, b + i, r + i, borrow + i, n - i);
+}
+
+// Sets all bits of the 64-bit lanes that are zero, with the 32-bit compare that all NEON versions have
+static inline uint64x2_t is_zero_neon(uint64x2_t v)
+{
+    uint32x4_t e = vceqq_u32(vreinterpretq_u32_u64(v), vdupq_n_u32(0));
+    return vreinterpretq_u64_u32(vandq_u32(e, vrev64q_u32(e)));
+}
+
+static void batch_normalize_neon(TPASR *r, uint8_t *zeros, size_t n)
+{
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2)
+    {
+        // Counts the leading zero digits in halving steps, the same as batch_normalize_scalar()
+        uint64x2_t x = vld1q_u64(r + i);
+        uint64x2_t m = is_zero_neon(vshrq_n_u64(x, 32));
+        uint64x2_t count = vandq_u64(m, vdupq_n_u64(8));
+        x = vbslq_u64(m, vshlq_n_u64(x, 32), x);
+        m = is_zero_neon(vshrq_n_u64(x, 48));
+        count = vaddq_u64(count, vandq_u64(m, vdupq_n_u64(4)));
+        x = vbslq_u64(m, vshlq_n_u64(x, 16), x);
+        m = is_zero_neon(vshrq_n_u64(x, 56));
+        count = vaddq_u64(count, vandq_u64(m, vdupq_n_u64(2)));
+        x = vbslq_u64(m, vshlq_n_u64(x, 8), x);
+        m = is_zero_neon(vshrq_n_u64(x, 60));
+        count = vaddq_u64(count, vandq_u64(m, vdupq_n_u64(1)));
+        x = vbslq_u64(m, vshlq_n_u64(x, 4), x);
+        count = vaddq_u64(count, vandq_u64(is_zero_neon(x), vdupq_n_u64(1)));
+        vst1q_u64(r + i, x);
+        zeros[i] = uint8_t(vgetq_lane_u64(count, 0)), zeros[i + 1] = uint8_t(vgetq_lane_u64(count, 1));
+    }
+    batch_normalize_scalar(r + i, zeros + i, n - i);
+}
+#endif // SIMD_ARM
+
+// Kernel sets indexed by SIMD_* level; unsupported sets fall back to the scalar kernels. NEON has no
+// alignment pass of its own, its 64-bit compares need AArch64
+#define SCALAR_KERNELS batch_adc_scalar, batch_sbc_scalar, batch_align_all_scalar, batch_normalize_scalar
+static const struct
+{
+    const char *name;
+    TLaneKernel adc;
+    TLaneKernel sbc;
+    void (*align)(const TBATCH &x, const TBATCH &y, bool is_sub, TBATCH &result, TPASR *a, TPASR *b, uint8_t *op);
+    void (*normalize)(TPASR *r, uint8_t *zeros, size_t n);
+} kernels[SIMD_MAX] = {
+    { "scalar", SCALAR_KERNELS },
+#ifdef SIMD_X86
+    { "sse2", batch_adc_sse2, batch_sbc_sse2, batch_align_sse2, batch_normalize_sse2 },
+    { "avx2", batch_adc_avx2, batch_sbc_avx2, batch_align_avx2, batch_normalize_avx2 },
+#else
+    { "sse2", SCALAR_KERNELS },
+    { "avx2", SCALAR_KERNELS },
+#endif
+#ifdef SIMD_ARM
+    { "neon", batch_adc_neon, batch_sbc_neon, batch_align_all_scalar, batch_normalize_neon },
+#else
+    { "neon", SCALAR_KERNELS },
+#endif
+};
+
+bool simd_supported(int level)
+{
+    switch (level)
+    {
+    case SIMD_SCALAR:
+        return true;
+#ifdef SIMD_X86
+    case SIMD_SSE2:
+        return true; // Always present on x86-64; also assumed on 32-bit x86
+    case SIMD_AVX2:
+#ifdef _MSC_VER
+    {
+        int regs[4];
+        __cpuidex(regs, 7, 0);
+        return (regs[1] & (1 << 5)) != 0;
+    }
+#else
+        return __builtin_cpu_supports("avx2");
+#endif
+#endif
+#ifdef SIMD_ARM
+    case SIMD_NEON:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+const char *simd_name(int level)
+{
+    return kernels[level].name;
+}
+
+static int selected = -1; // Kernel set chosen with simd_select(), -1 for the best one
+
+int simd_level()
+{
+    static const int best = []()
+    {
+        int level = SIMD_SCALAR;
+        for (int l = 0; l < SIMD_MAX; l++)
+            if (simd_supported(l))
+                level = l;
+        return level;
+    }();
+    return selected >= 0 ? selected : best;
+}
+
+void simd_select(int level)
+{
+    selected = ((level >= 0) && (level < SIMD_MAX) && simd_supported(level)) ? level : -1;
+}
+
+void batch_adc(int level, const TPASR *a, const TPASR *b, TPASR *r, uint8_t *carry, size_t n)
+{
+    kernels[level].adc(a, b, r, carry, n);
+}
+
+void batch_sbc(int level, const TPASR *a, const TPASR *b, TPASR *r, uint8_t *borrow, size_t n)
+{
+    kernels[level].sbc(a, b, r, borrow, n);
+}
+
+void batch_adc(const TPASR *a, const TPASR *b, TPASR *r, uint8_t *carry, size_t n)
+{
+    kernels[simd_level()].adc(a, b, r, carry, n);
+}
+
+void batch_sbc(const TPASR *a, const TPASR *b, TPASR *r, uint8_t *borrow, size_t n)
+{
+    kernels[simd_level()].sbc(a, b, r, borrow, n);
+}
+
+void batch_align(int level, const TBATCH &x, const TBATCH &y, bool is_sub, TBATCH &result, TPASR *a, TPASR *b, uint8_t *op)
+{
+    kernels[level].align(x, y, is_sub, result, a, b, op);
+}
+
+void batch_normalize(int level, TPASR *r, uint8_t *zeros, size_t n)
+{
+    kernels[level].normalize(r, zeros, n);
+}
+
+void batch_align(const TBATCH &x, const TBATCH &y, bool is_sub, TBATCH &result, TPASR *a, TPASR *b, uint8_t *op)
+{
+    kernels[simd_level()].align(x, y, is_sub, result, a, b, op);
+}
+
+void batch_normalize(TPASR *r, uint8_t *zeros, size_t n)
+{
+    kernels[simd_level()].normalize(r, zeros, n);
+}
+
+// Converts a packed scratch register to a char scratch register
+static TASR to_scratch(TPASR p)
+{
+    TASR scratch;
+    for (int i = 0; i < MAX_SCRATCH; i++)
+        scratch.mant[i] = char((p >> (60 - 4 * i)) & 0xF) + '0';
+    return scratch;
+}
+
+// Checks every supported kernel set against the char engine primitives (bcd_adc, bcd_sbc)
+void simd_test()
+{
+    std::cout << "SIMD LANE KERNEL TEST\n";
+
+    // Random scratch operands, with every few lanes forced to all 0s or all 9s to stress the carry chains
+    const size_t n = 4099; // Not a multiple of the vector width, so the scalar tail is also exercised
+    const TPASR nines = 0x9999999999999999ull << (4 * (16 - MAX_SCRATCH));
+    std::vector<TPASR> a(n), b(n), r(n);
+    std::vector<uint8_t> c(n);
+    std::minstd_rand rng(43); // Reproducible random number seed
+    for (size_t i = 0; i < n; i++)
+    {
+        for (int k = 0; k < MAX_SCRATCH; k++)
+        {
+            a[i] = (a[i] << 4) | (rng() % 10);
+            b[i] = (b[i] << 4) | (rng() % 10);
+        }
+        a[i] <<= 4 * (16 - MAX_SCRATCH);
+        b[i] <<= 4 * (16 - MAX_SCRATCH);
+        if (i % 7 == 1)
+            a[i] = nines;
+        if (i % 11 == 2)
+            b[i] = i & 1 ? nines : 0;
+    }
+
+    for (int level = 0; level < SIMD_MAX; level++)
+    {
+        if (!simd_supported(level))
+            continue;
+        uint32_t fail = 0;
+        for (int sub = 0; sub < 2; sub++)
+        {
+            if (sub)
+                batch_sbc(level, a.data(), b.data(), r.data(), c.data(), n);
+            else
+                batch_adc(level, a.data(), b.data(), r.data(), c.data(), n);
+
+            for (size_t i = 0; i < n; i++)
+            {
+                TASR expected = to_scratch(a[i]);
+                bool carry = sub ? scratch_sub(expected, to_scratch(b[i])) : scratch_add(expected, to_scratch(b[i]));
+                bool ok = !memcmp(expected.mant, to_scratch(r[i]).mant, MAX_SCRATCH) && (carry == bool(c[i]));
+                tests_total++;
+                tests_pass += ok;
+                tests_fail += !ok;
+                if (!ok && (fail++ < 10))
+                    std::cout << simd_name(level) << (sub ? " sbc " : " adc ") << to_scratch(a[i]).mant << ", " << to_scratch(b[i]).mant
+                              << " = " << to_scratch(r[i]).mant << " (" << int(c[i]) << ") expected " << expected.mant << " (" << carry << ")  FAIL\n";
+            }
+        }
+        std::cout << "Kernel set " << simd_name(level) << (level == simd_level() ? " (selected)" : "") << ": lanes checked: " << 2 * n << "  mismatches: " << fail << "\n";
+    }
+
+    // Random packed registers for the alignment and normalization passes, with every few lanes forced to
+    // zero, equal exponents, shifts past the mantissa width or equal mantissas
+    TBATCH x(n), y(n), expected(n), result(n);
+    std::vector<TPASR> ea(n), eb(n);
+    std::vector<uint8_t> eop(n), op(n), ezeros(n), zeros(n);
+    for (size_t i = 0; i < n; i++)
+    {
+        x.mant[i] = a[i] & PACKED_MANT_MASK;
+        y.mant[i] = b[i] & PACKED_MANT_MASK;
+        x.sign[i] = rng() & 1;
+        y.sign[i] = rng() & 1;
+        x.exps[i] = uint8_t(128 - 10 + rng() % 21);
+        y.exps[i] = i % 5 == 0 ? x.exps[i] : uint8_t(128 - 10 + rng() % 21);
+        if (i % 13 == 3)
+            y.exps[i] = uint8_t(x.exps[i] + MAX_MANT + rng() % 2);
+        if (i % 17 == 4)
+            y.mant[i] = x.mant[i];
+        if (i % 19 == 5)
+        {
+            x.mant[i] = 0;
+            x.exps[i] = 128;
+        }
+        if (i % 23 == 6)
+        {
+            y.mant[i] = 0;
+            y.exps[i] = 128;
+        }
+    }
+
+    for (int level = 0; level < SIMD_MAX; level++)
+    {
+        if (!simd_supported(level))
+            continue;
+        uint32_t fail = 0;
+        for (int sub = 0; sub < 2; sub++)
+        {
+            batch_align_scalar(x, y, sub, expected, ea.data(), eb.data(), eop.data(), 0);
+            batch_align(level, x, y, sub, result, a.data(), b.data(), op.data());
+            for (size_t i = 0; i < n; i++)
+            {
+                // The aligned operands only matter to the lanes which still have an operation to do
+                bool ok = expected.mant[i] == result.mant[i] && expected.sign[i] == result.sign[i] && expected.exps[i] == result.exps[i]
+                          && expected.flags[i] == result.flags[i] && eop[i] == op[i] && (!op[i] || (ea[i] == a[i] && eb[i] == b[i]));
+                tests_total++;
+                tests_pass += ok;
+                tests_fail += !ok;
+                if (!ok && (fail++ < 10))
+                    std::cout << simd_name(level) << (sub ? " align sub " : " align add ") << "lane " << i << "  FAIL\n";
+            }
+        }
+        // Normalizes the lanes of every operation, also the differences that are 0
+        std::copy(ea.begin(), ea.end(), r.begin());
+        batch_normalize_scalar(r.data(), ezeros.data(), n);
+        batch_normalize(level, ea.data(), zeros.data(), n);
+        for (size_t i = 0; i < n; i++)
+        {
+            bool ok = r[i] == ea[i] && ezeros[i] == zeros[i];
+            tests_total++;
+            tests_pass += ok;
+            tests_fail += !ok;
+            if (!ok && (fail++ < 10))
+                std::cout << simd_name(level) << " normalize lane " << i << "  FAIL\n";
+        }
+        std::cout << "Alignment and normalization " << simd_name(level) << ": lanes checked: " << 3 * n << "  mismatches: " << fail << "\n";
+    }
+}
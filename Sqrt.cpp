@@ -0,0 +1,132 @@
+/*  Copyright (C) 2021  Goran Devic
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+*/
+#include "Common.h"
+
+// Square root by shift and subtract, one digit of the root per iteration
+// Square root heuristic:
+// - If the radicand is negative, signal error, done.
+// - If the radicand is zero, return zero, done.
+// - Make the exponent even, moving one digit of the mantissa into the integer part if it was odd;
+//   the exponent of the result is half of it
+// - For each digit of the root, shift the next pair of radicand digits into the remainder
+// - Subtract the odd numbers 20 * root + 1, 20 * root + 3, ... from the remainder while it is
+//   large enough, counting them into the next root digit since 1 + 3 + ... + (2d - 1) == d * d
+// - The root is always normalized since the integer part of the radicand is in [1, 100)
+
+template<int M>
+TReg<M> sqrt(const TReg<M> &x)
+{
+    TReg<M> result;
+
+    TAsr<M> scratch1(x); // scratch1 == Radicand == x, the digit pairs are shifted out of its top
+    TAsr<M> scratch2; // Remainder
+    scratch_clear(scratch2);
+    TAsr<M> scratch3; // result, the root is accumulated in the lowest digits
+    scratch_clear(scratch3);
+    TAsr<M> scratch4; // Odd number being subtracted
+    TAsr<M> two; // Step between the odd numbers
+    scratch_clear(two);
+    two.mant[TAsr<M>::S - 1] = '2';
+
+    if (scratch_is_0(scratch1))
+        return result; // Return zero
+    if (x.sign)
+    {
+        result.flags = FLAG_DOMAIN; // The root of a negative number is an error
+        return result;
+    }
+
+    // The exponent of the result is half of the (even) exponent of the radicand
+    int pow = int(x.exps) - 128;
+    if (!(pow & 1))
+        scratch_shr(scratch1); // The integer part of the radicand is the single digit pair "0d"
+    result.exps = uint8_t(128 + (pow - (pow & 1)) / 2);
+
+    // ----------- SQUARE ROOT OPERATION -----------
+    const int S = TAsr<M>::S;
+    for (int i = 0; i < M; i++)
+    {
+        // Bring down the next pair of radicand digits
+        scratch_shl(scratch2, 2);
+        scratch2.mant[S - 2] = scratch1.mant[0];
+        scratch2.mant[S - 1] = scratch1.mant[1];
+        scratch_shl(scratch1, 2);
+
+        // The first odd number is 20 * root + 1
+        scratch4 = scratch3;
+        scratch_add(scratch4, scratch3);
+        scratch_shl(scratch4);
+        scratch4.mant[S - 1] = '1';
+
+        scratch_shl(scratch3); // Make room for the next root digit
+        while (scratch_is_greater_or_equal(scratch2, scratch4)) // The odd number will go into the remainder
+        {
+            // The borrow will never undeflow the final value since we are always subtracting a smaller value from the larger one
+            if (scratch_sub(scratch2, scratch4))
+                std::cerr << "Unexpected borrow in " << __FUNCTION__ << ":" << __LINE__ << "\n";
+            scratch_add(scratch4, two);
+
+            if (scratch3.mant[S - 1] > '9')
+                std::cerr << "Unexpected scratch mant digit " << scratch3.mant[S - 1] << " i=" << i << " " << __FUNCTION__ << ":" << __LINE__ << "\n";
+
+            scratch3.mant[S - 1]++; // Increment the root digit by one
+        }
+    }
+
+    memcpy(result.mant, &scratch3.mant[S - M], M);
+
+    return result;
+}
+
+#define INSTANTIATE(M) \
+    template TReg<M> sqrt(const TReg<M> &);
+PROOF_WIDTHS(INSTANTIATE)
+
+// Runs the square root of the test numbers and the randomized arguments at the width M against the exact oracle
+template<int M>
+static void sqrt_run(const std::vector<std::string> &args)
+{
+    uint32_t total = 0, pass = 0, fail = 0;
+    int test_number = 1;
+    for (const std::string &a : args)
+    {
+        TReg<M> x = input<M>(a.c_str());
+        TReg<M> result = sqrt(x);
+        TReg<M> expected;
+        int status = exact_sqrt_check(x, result, expected);
+        if (status == CHECK_FAIL)
+            std::cout << "sqrt(" << a << ") = " << (result.sign ? '-' : '+') << result.mant << " (" << int(result.exps) << ") " << test_number
+                      << "  expected " << (expected.sign ? '-' : '+') << expected.mant << " (" << int(expected.exps) << ")  FAIL\n";
+        pass += status == CHECK_OK;
+        fail += status == CHECK_FAIL;
+        total++;
+        test_number++;
+    }
+
+    std::cout << "Square root at " << std::setw(2) << M << " digits: arguments checked: " << total << "  fail: " << fail << "  rounding errors: " << (total - (pass + fail)) << "\n";
+    tests_total += total;
+    tests_pass += pass;
+    tests_fail += fail;
+}
+
+void sqrt_test()
+{
+    std::cout << "SQUARE ROOT TEST\n";
+
+    // The test numbers of both signs and the pseudo-random exponential arguments, at every width
+    std::vector<std::string> args;
+    const std::deque<TCORPUSNUMBER> &c = corpus();
+    for (const TCORPUSNUMBER &n : c)
+        args.push_back(n.src[0]), args.push_back(n.src[1]);
+    rnd.seed(43); // Reproducible random number seed
+    for (int i = 0; i < 2000; i++)
+        args.push_back(random_operand(rnd, c[rnd() % c.size()].src[0]));
+
+#define RUN_SQRT(M) sqrt_run<M>(args);
+    PROOF_WIDTHS(RUN_SQRT)
+}
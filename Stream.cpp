@@ -0,0 +1,161 @@
+/*  Copyright (C) 2021  Goran Devic
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+*/
+#include "Common.h"
+
+// Streaming expression evaluator:
+// - Every input line holds one operation in the same layout as the test printouts:
+//   "<16 char input buffer> <op> <16 char input buffer>", op being one of + - * /
+// - The input is read in large blocks and the lines are parsed in place by the lean packed parser,
+//   without copies or per-line allocations
+// - The results are written into an output block which is flushed when full, so the memory use is
+//   bounded no matter how large the input is
+// - Every input line produces exactly one output line; malformed lines (including operands that do
+//   not follow the input rules) produce "ERROR" and are
+//   reported on stderr together with their line number
+
+#define STREAM_BLOCK  (1 << 20) // Size of the input and output blocks
+#define LINE_SIZE     35        // 16 + 3 + 16 characters, not counting the end of line
+#define RESULT_SIZE   24        // Longest formatted result, including the end of line
+
+// Formats a register as "+12345678901234 E+05" into buf, returns the number of characters written
+static int format_result(const TREG &r, char *buf)
+{
+    if (r.flags & FLAGS_ERROR)
+    {
+        const char *text = (r.flags & FLAG_DIV0) ? " *** DIV0 *** \n" : " *** ERROR *** \n";
+        std::memcpy(buf, text, strlen(text));
+        return int(strlen(text));
+    }
+    int pow = (r.exps & 0x80) ? r.exps & 0x7F : (128 + (~r.exps + 1)) & 0x7F;
+    char *p = buf;
+    *p++ = r.sign ? '-' : '+';
+    std::memcpy(p, r.mant, MAX_MANT);
+    p += MAX_MANT;
+    *p++ = ' ';
+    *p++ = 'E';
+    *p++ = (r.exps & 0x80) ? '+' : '-';
+    *p++ = '0' + pow / 10;
+    *p++ = '0' + pow % 10;
+    *p++ = '\n';
+    return int(p - buf);
+}
+
+// Evaluates one line (without the end of line), returns false if it is malformed
+static bool eval_line(const char *line, size_t len, int engine, TCACHE *cache, TREG &result)
+{
+    while (len && line[len - 1] == '\r')
+        len--;
+    if ((len != LINE_SIZE) || (line[16] != ' ') || (line[18] != ' '))
+        return false;
+    const char *ops = "+-*/";
+    const char *op = strchr(ops, line[17]);
+    if (!op || !line[17])
+        return false;
+
+    // Parse the operands in place, straight into packed registers
+    TPREG x, y;
+    if (!input_packed(line, x) || !input_packed(line + 19, y))
+        return false;
+
+    int o = int(op - ops);
+    if (cache)
+        unpack(cached_compute(*cache, o, x, y, engine), result);
+    else if (engine == ENGINE_PACKED)
+        unpack(o < 2 ? add_sub(x, y, o == 1) : (o == 2 ? mult(x, y) : div(x, y)), result);
+    else
+    {
+        TREG a, b;
+        unpack(x, a);
+        unpack(y, b);
+        result = engine_compute(o, a, b, engine);
+    }
+    return true;
+}
+
+// Reads the lines from the input stream, writes the results to the output stream; repeated operations
+// are optionally served from the memoization cache. Returns the number of malformed lines.
+uint64_t stream_eval(FILE *in, FILE *out, int engine, bool memo)
+{
+    static TCACHE cache; // Static storage keeps the cache sets aligned to the cache lines
+    std::vector<char> ibuf(STREAM_BLOCK), obuf(STREAM_BLOCK);
+    size_t ilen = 0, olen = 0;
+    uint64_t lines = 0, errors = 0;
+    bool eof = false;
+    bool skipping = false; // Dropping the rest of a line that did not fit into the input block
+
+    auto reserve = [&]()
+    {
+        if (olen + RESULT_SIZE > obuf.size())
+        {
+            fwrite(obuf.data(), 1, olen, out);
+            olen = 0;
+        }
+    };
+    auto error = [&]()
+    {
+        std::cerr << "Malformed line " << lines << "\n";
+        std::memcpy(obuf.data() + olen, "ERROR\n", 6);
+        olen += 6;
+        errors++;
+    };
+
+    while (!eof || ilen)
+    {
+        if (!eof)
+        {
+            size_t n = fread(ibuf.data() + ilen, 1, ibuf.size() - ilen, in);
+            ilen += n;
+            eof = n == 0;
+        }
+
+        // Process all complete lines in the block; at the end of the input the last line may not be terminated
+        size_t start = 0;
+        while (start < ilen)
+        {
+            const char *nl = (const char *) memchr(ibuf.data() + start, '\n', ilen - start);
+            if (skipping)
+            {
+                start = nl ? size_t(nl - ibuf.data()) + 1 : ilen;
+                skipping = !nl;
+                continue;
+            }
+            if (!nl && !eof)
+                break;
+            size_t len = nl ? size_t(nl - ibuf.data()) - start : ilen - start;
+
+            reserve();
+            TREG result;
+            lines++;
+            if (eval_line(ibuf.data() + start, len, engine, memo ? &cache : nullptr, result))
+                olen += format_result(result, obuf.data() + olen);
+            else
+                error();
+            start += len + (nl != nullptr);
+        }
+
+        // Move the incomplete line to the beginning of the block
+        std::memmove(ibuf.data(), ibuf.data() + start, ilen - start);
+        ilen -= start;
+        if (ilen == ibuf.size()) // A line that does not fit into a block can not be valid
+        {
+            reserve();
+            lines++;
+            error();
+            ilen = 0;
+            skipping = true;
+        }
+    }
+    fwrite(obuf.data(), 1, olen, out);
+    fflush(out);
+
+    std::cerr << "Lines: " << lines << "  errors: " << errors;
+    if (memo)
+        std::cerr << "  cache hits: " << cache.hits << "  misses: " << cache.misses;
+    std::cerr << "\n";
+    return errors;
+}
@@ -1,55 +1,84 @@
+#include <algorithm>
 #include <cmath>
+#include <cstddef>
+#include <cstdio>
 #include <cstring>
 #include <iomanip>
 #include <iostream>
 #include <sstream>
+#include <string>
+#include <type_traits>
+#include <vector>
 
 #define MAX_MANT 14
 #define MAX_SCRATCH  (MAX_MANT + 2)
 
-static_assert(MAX_SCRATCH >= (MAX_MANT + 1), "MAX_SCRATCH needs to be at least (MAX_MANT + 1)");
+// Registers, scratch registers and the char engine algorithms are templates on the mantissa width (M),
+// so that several hardware design points can be verified side by side in the same binary.
+// MAX_MANT is the width of the main design point; the algorithms are instantiated for these widths:
+#define PROOF_WIDTHS(X) X(10) X(14) X(20)
 
-extern uint32_t tests_total;
-extern uint32_t tests_pass;
-extern uint32_t tests_fail;
+extern uint64_t tests_total;
+extern uint64_t tests_pass;
+extern uint64_t tests_fail;
 
-// Structure that abstracts a (normalized) register
-typedef struct TReg
+// Result of comparing a register against its verification control value
+enum { CHECK_OK, CHECK_NEAR, CHECK_FAIL };
+
+// Status flags of the operation that produced a register value:
+// - An overflow saturates to the largest magnitude and an underflow flushes to zero
+// - The value of a division by zero, or of an argument outside of the domain of a function, is zero
+enum { FLAG_OVERFLOW = 1, FLAG_UNDERFLOW = 2, FLAG_DIV0 = 4, FLAG_DOMAIN = 8 };
+#define FLAGS_ERROR (FLAG_DIV0 | FLAG_DOMAIN) // The value is not a result
+
+#define EXP_MAX 99 // Exponents are shown as E-99..E+99
+
+// Structure that abstracts a (normalized) register with M mantissa digits
+// This is a plain value type: it is trivially copyable and does not allocate
+template<int M>
+struct TReg
 {
     // Registers will use BCD nibbles, but here we use chars
-    char mant[MAX_MANT + 1]; // +1 to store a terminating zero; hw will not have that
+    char mant[M + 1]; // +1 to store a terminating zero; hw will not have that
     bool sign; // Set to true for negative mantissa
     uint8_t exps; // 8-bit exponent with a bias of 128
+    uint8_t flags; // FLAG_* of the operation that produced the value
 
-    TReg() : sign(false), exps(128), src(""), fp(0)
+    TReg() : sign(false), exps(128), flags(0)
     {
-        std::memset(mant, '0', MAX_MANT);
-        mant[MAX_MANT] = 0;
+        std::memset(mant, '0', M);
+        mant[M] = 0;
     }
 
+    bool operator==(const TReg &r) const { return !memcmp(mant, r.mant, M) && (sign == r.sign) && (exps == r.exps) && (flags == r.flags); }
+    bool operator!=(const TReg &r) const { return !(*this == r); }
+};
+typedef TReg<MAX_MANT> TREG;
+
+static_assert(std::is_trivially_copyable<TREG>::value, "TREG needs to be trivially copyable");
+
+template<int M> TReg<M> input(const char *in);
+inline TREG input(const char *in) { return input<MAX_MANT>(in); }
+
+// Verification and reporting side-car of a register: holds the register value together with
+// the source input buffer and the control value computed in floating point
+template<int M>
+struct TVerif
+{
+    TReg<M> reg; // Register value computed by the algorithm under test
+    const char *src; // Source input string, used in print
+    double fp; // For verification, "double" should have matching 15 digits of precision
+
     // Constructor to use when loading a register with the user input buffer (from the input parser)
-    TReg(const char *in) : TReg()
+    TVerif(const char *in) : reg(input<M>(in)), src(in), fp(0)
     {
         if (strlen(in) != 16)
             std::cerr << "Unexpected str size of " << strlen(in) << __FUNCTION__ << ":" << __LINE__ << "\n";
-        src = in;
         read_fp_from_src();
-        format_verif_from_fp();
     }
 
-    // Constructor to use when creating a new register for computation
-    TReg(double f) : TReg()
-    {
-        fp = f;
-        format_verif_from_fp();
-    }
-
-    // Copy constructor
-    TReg(const TReg &r) : sign(r.sign), exps(r.exps), src(r.src), fp(r.fp)
-    {
-        memcpy(mant, r.mant, MAX_MANT + 1);
-        verif << r.verif.str();
-    }
+    // Constructor to use with the result of a computation and its expected (control) value
+    TVerif(const TReg<M> &r, double f) : reg(r), src(""), fp(f) {}
 
     // Given the source input buffer, reads a floating point number into the verification member variable (fp)
     void read_fp_from_src()
@@ -67,16 +96,34 @@ typedef struct TReg
     }
 
     // Prints out the verification value (fp) into the string
-    void format_verif_from_fp()
+    std::string format_verif_from_fp() const
     {
+        std::ostringstream verif;
         verif << ((*(long long *) &fp & 0x8000000000000000ll) ? "" : "+"); // Echo "+" for positive numbers
-        verif.precision(MAX_MANT - 1); // Set the output precision, the number of digits, minus the first digit before '.'
+        verif.precision(M - 1); // Set the output precision, the number of digits, minus the first digit before '.'
         verif << std::scientific << fp;
+        return verif.str();
     }
 
-    // Prints out the register value, verification control value and whether they match or not
-    void print(int id = 0)
+    // Formats the register value and verification control value into a line of text and
+    // returns whether they match (CHECK_OK), differ by a rounding error (CHECK_NEAR) or not at all (CHECK_FAIL)
+    // If error is not nullptr, it receives the relative difference used for that decision
+    int check(std::string &line, uint64_t id = 0, double *error = nullptr) const
     {
+        const char *mant = reg.mant;
+        bool sign = reg.sign;
+        uint8_t exps = reg.exps;
+        std::ostringstream text;
+
+        if (reg.flags & FLAG_DIV0)
+            text << " *** DIV0 *** ";
+        else if (reg.flags & FLAG_DOMAIN)
+            text << " *** ERROR *** ";
+        else if (reg.flags & FLAG_OVERFLOW)
+            text << " *** OVERFLOW *** ";
+        else if (reg.flags & FLAG_UNDERFLOW)
+            text << " *** UNDERFLOW *** ";
+
         std::ostringstream native;
         int pow = (exps & 0x80) ? exps & 0x7F : (128 + (~exps + 1)) & 0x7F;
         native << (sign ? "-" : "+");
@@ -84,8 +131,7 @@ typedef struct TReg
         native << ((exps & 0x80) ? "e+" : "e-");
         native << std::setfill('0') << std::setw(2) << pow;
 
-        // XXX Signal for division by zero
-        if (exps == 0)
+        if (reg.flags & FLAGS_ERROR)
             native.str(sign ? "-inf" : "+inf");
 
         // We want to detect implicit imprecision caused by rounding errors of the control fp
@@ -96,43 +142,222 @@ typedef struct TReg
         if (sscanf(native.str().c_str(), "%lf", &native_fp) != 1)
             std::cerr << "Error reading native_fp in " << __FUNCTION__ << ":" << __LINE__ << "\n";
 
-        // Detect a rounding error equivalent to the magnitude of the last digit of the mantissa
-        double max_diff = std::pow(10, -(MAX_MANT - 2));
+        // Detect a rounding error equivalent to the magnitude of the last digit of the mantissa;
+        // a double can not resolve more than 15 digits, which limits the check of the wider registers
+        double max_diff = std::pow(10, -(std::min(M, 15) - 2));
         double diff = fabs(native_fp - fp);
         diff *= std::pow(10, -pow);
         bool rounding_error = diff <= max_diff;
 
-        printf("%s = %c%s E%c%02d (%3d) %4d  ", src, sign ? '-' : '+', mant, (exps & 0x80) ? '+' : '-', pow, exps, id);
-        std::cout << native.str() << " vs. " << verif.str() << "  ";
-        if (native.str() == verif.str())
-            std::cout << "OK\n", tests_pass++;
+        // A saturated value is right if the control value is outside of the exponent range the same way
+        bool saturated = reg.flags & (FLAG_OVERFLOW | FLAG_UNDERFLOW);
+        if (saturated)
+        {
+            bool outside = (reg.flags & FLAG_OVERFLOW) ? fabs(fp) >= 1e100 : fabs(fp) < 1e-99;
+            diff = outside ? 0 : HUGE_VAL;
+            rounding_error = false;
+        }
+        // A division by zero is right for any control value that is not finite: x / 0 is an infinity, 0 / 0 is a NaN
+        bool div0 = (reg.flags & FLAG_DIV0) && !std::isfinite(fp);
+        if (div0)
+            diff = 0;
+        if (error)
+            *error = diff;
+
+        char buf[64];
+        snprintf(buf, sizeof(buf), "%s = %c%s E%c%02d (%3d) %4llu  ", src, sign ? '-' : '+', mant, (exps & 0x80) ? '+' : '-', pow, exps, (unsigned long long) id);
+        std::string verif = format_verif_from_fp();
+        text << buf << native.str() << " vs. " << verif << "  ";
+        int status;
+        if ((saturated || div0) ? diff == 0 : native.str() == verif)
+            text << "OK\n", status = CHECK_OK;
         else
-            std::cout << (rounding_error ? "NEAR" : "FAIL") << " (" << diff << ")" << "\n", tests_fail += !rounding_error;
-        tests_total++;
+            text << (rounding_error ? "NEAR" : "FAIL") << " (" << diff << ")" << "\n", status = rounding_error ? CHECK_NEAR : CHECK_FAIL;
+        line = text.str();
+        return status;
     }
 
-    const char *src; // Source input string, used in print
-    double fp{}; // For verification, "double" should have matching 15 digits of precision
-    std::ostringstream verif;
-} TREG;
+    // Prints out the register value, verification control value and whether they match or not
+    void print(int id = 0)
+    {
+        std::string line;
+        int status = check(line, id);
+        std::cout << line;
+        tests_pass += status == CHECK_OK;
+        tests_fail += status == CHECK_FAIL;
+        tests_total++;
+    }
+};
+typedef TVerif<MAX_MANT> TVERIF;
 
-// Structure that abstracts an arithmetic scratch register
-typedef struct TAsr
+// Structure that abstracts an arithmetic scratch register for registers with M mantissa digits
+template<int M>
+struct TAsr
 {
+    static const int S = M + 2; // Number of scratch digits
+
     // Registers will use BCD nibbles, but here we use chars
-    char mant[MAX_SCRATCH + 1]; // +1 to store a terminating zero; hw will not have that
+    char mant[S + 1]; // +1 to store a terminating zero; hw will not have that
 
     TAsr()
     {
         // Construct a scratch register with an invalid value to detect if an algorithm does not properly clear it
-        std::memset(mant, 'X', MAX_SCRATCH);
-        mant[MAX_SCRATCH] = 0;
+        std::memset(mant, 'X', S);
+        mant[S] = 0;
     }
 
-    TAsr(TREG &r) : TAsr()
+    TAsr(const TReg<M> &r) : TAsr()
     {
-        std::memcpy(mant, r.mant, MAX_MANT); // Copy the mantissa of a register
-        std::memset(mant + MAX_MANT, '0', MAX_SCRATCH - MAX_MANT); // Clear the extra nibbles
+        std::memcpy(mant, r.mant, M); // Copy the mantissa of a register
+        std::memset(mant + M, '0', S - M); // Clear the extra nibbles
     }
+};
+typedef TAsr<MAX_MANT> TASR;
+
+static_assert(TASR::S == MAX_SCRATCH, "MAX_SCRATCH needs to match the scratch register of MAX_MANT");
+
+// Double-length scratch register, holds the complete (2 * M digits) product of two mantissas and
+// a carry digit. Its width is odd, so it never collides with a register width of PROOF_WIDTHS
+template<int M> using TAsrWide = TAsr<2 * M - 1>;
+
+static_assert(TAsrWide<MAX_MANT>::S >= 2 * MAX_MANT + 1, "Wide scratch register needs to hold the full product and a carry digit");
+
+// Packed BCD scratch register: two BCD nibbles per byte, the whole scratch held in one 64-bit word.
+// The most significant digit ([0] of a TASR) is stored in the topmost nibble, so that a numerical
+// compare of two packed registers is the same as the digit-by-digit compare of their chars
+typedef uint64_t TPASR;
+
+static_assert(MAX_SCRATCH <= 16, "Packed scratch register can hold at most 16 BCD digits");
+
+// Constants of the packed BCD (SWAR) kernels
+#define BCD_SIXES    0x6666666666666666ull // Decimal adjust value for every nibble
+#define BCD_CARRIES  0x1111111111111110ull // Bit 0 of every nibble except the lowest one
+#define BCD_TOP_SIX  0x6000000000000000ull // Decimal adjust value for the topmost nibble
+
+// Mask of the packed nibbles that belong to a register mantissa (MAX_MANT topmost nibbles)
+#define PACKED_MANT_MASK  (~0ull << (4 * (16 - MAX_MANT)))
+
+// Structure that abstracts a (normalized) register using packed BCD nibbles
+typedef struct TPReg
+{
+    TPASR mant; // MAX_MANT packed BCD digits in the topmost nibbles, remaining nibbles are zero
+    bool sign; // Set to true for negative mantissa
+    uint8_t exps; // 8-bit exponent with a bias of 128
+    uint8_t flags; // FLAG_* of the operation that produced the value
+
+    TPReg() : mant(0), sign(false), exps(128), flags(0) {}
+} TPREG;
+
+// Structure that abstracts a batch of packed registers stored as a structure of arrays,
+// so that the per-digit work of many independent registers can run back to back
+typedef struct TBatch
+{
+    std::vector<TPASR> mant; // Packed mantissas
+    std::vector<uint8_t> sign; // Set to 1 for negative mantissa
+    std::vector<uint8_t> exps; // 8-bit exponents with a bias of 128
+    std::vector<uint8_t> flags; // FLAG_* of every lane
+
+    TBatch(size_t n = 0) : mant(n), sign(n), exps(n, 128), flags(n) {}
+
+    size_t size() const { return mant.size(); }
+    void resize(size_t n) { mant.resize(n); sign.resize(n); exps.resize(n, 128); flags.resize(n); }
+
+    TPREG get(size_t i) const
+    {
+        TPREG r;
+        r.mant = mant[i];
+        r.sign = sign[i];
+        r.exps = exps[i];
+        r.flags = flags[i];
+        return r;
+    }
+
+    void set(size_t i, const TPREG &r)
+    {
+        mant[i] = r.mant;
+        sign[i] = r.sign;
+        exps[i] = r.exps;
+        flags[i] = r.flags;
+    }
+} TBATCH;
+
+// Scratch space of the batch operations. It is owned by the caller and only grows, so once it has
+// the size of a batch, the batch operations do not allocate
+typedef struct TBatchWork
+{
+    std::vector<TPASR> x, y; // Aligned operands of the addition and subtraction, in the batch lane order
+    std::vector<uint8_t> op; // Effective operation of every batch lane, see batch_align()
+    std::vector<TPASR> a, b, r; // Operands and results of the lane kernels
+    std::vector<uint8_t> c; // Carries/borrows of the lane kernels
+    std::vector<uint8_t> zeros; // Leading zero digits of the differences
+    std::vector<uint32_t> lane; // Batch lane of every kernel operand
+    std::vector<TPASR> multiple; // Multiples 0x..9x of the multiplicands, one row of lanes per multiple
+
+    void resize(size_t n)
+    {
+        x.resize(n); y.resize(n); op.resize(n);
+        a.resize(n); b.resize(n); r.resize(n); c.resize(n); zeros.resize(n); lane.resize(n);
+        multiple.resize(10 * n);
+    }
+} TBATCHWORK;
+
+// Memoization cache of packed engine results, keyed on (op, x, y) after a sign canonicalization.
+// It is a fixed size, 2-way set associative table; each set fills exactly one cache line
+#define CACHE_SETS_LOG2 12
+
+typedef struct TCacheEntry
+{
+    TPASR x_mant, y_mant, r_mant; // Operands (signs canonicalized) and the result mantissa
+    uint8_t x_exps, y_exps, r_exps, r_flags;
+    uint8_t op; // Canonical operation + 1; 0 marks an empty entry
+    bool y_sign, r_sign;
+} TCACHEENTRY;
+
+struct alignas(64) TCacheSet
+{
+    TCACHEENTRY way[2]; // way[0] is the most recently inserted entry
+};
+static_assert(sizeof(TCacheSet) == 64, "A cache set needs to fill one cache line");
+
+typedef struct TCache
+{
+    TCacheSet set[1 << CACHE_SETS_LOG2];
+    uint64_t hits;
+    uint64_t misses;
+
+    TCache() : set(), hits(0), misses(0) {}
+} TCACHE;
+
+// Bump allocator for short lived per-batch records: allocations are carved out of large chunks and
+// all of them are released at once by reset(). The chunks are kept, so once the arena has grown to
+// the size of a batch, it does not allocate any more memory
+typedef struct TArena
+{
+    std::vector<std::vector<char>> chunks;
+    size_t chunk; // Index of the current chunk
+    size_t used; // Bytes used in the current chunk
+    size_t chunk_size;
+
+    TArena(size_t size = 1 << 16) : chunk(0), used(0), chunk_size(size) {}
+
+    void *alloc(size_t n, size_t align = alignof(std::max_align_t))
+    {
+        for (;;)
+        {
+            size_t start = (used + align - 1) & ~(align - 1);
+            if ((chunk < chunks.size()) && (start + n <= chunks[chunk].size()))
+            {
+                used = start + n;
+                return chunks[chunk].data() + start;
+            }
+            if (chunk < chunks.size()) // Move on to the next chunk
+                chunk++, used = 0;
+            if (chunk == chunks.size())
+                chunks.emplace_back(std::max(n + align, chunk_size));
+        }
+    }
+
+    template<typename T> T *alloc_array(size_t n) { return static_cast<T *>(alloc(n * sizeof(T), alignof(T))); }
 
-} TASR;
+    void reset() { chunk = 0; used = 0; }
+} TARENA;
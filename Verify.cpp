@@ -0,0 +1,360 @@
+/*  Copyright (C) 2021  Goran Devic
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+*/
+#include "Common.h"
+#include <atomic>
+#include <chrono>
+#include <thread>
+#ifdef _WIN32
+#include <io.h>
+#define isatty _isatty
+#define fileno _fileno
+#else
+#include <unistd.h>
+#endif
+
+// Parallel randomized verification driver:
+// - The case space is split into shards of SHARD_CASES cases each
+// - Every shard has its own seeded random number generator and its own counters, so the shards
+//   are independent of each other and of the order in which they run
+// - A pool of threads keeps picking up the next unprocessed shard
+// - The printout of every shard is handed to the output writer, which writes it in the shard order, so
+//   the output is identical no matter how many threads are used
+// - Optionally, every shard writes the golden records of its cases at their test IDs
+// - Every thread counts its cases in its own statistics block; a reporter thread periodically sums up
+//   the blocks without locking them and prints the progress to stderr, so it never contends on std::cout
+
+#define SHARD_CASES 10000
+#define SHARD_SEED  43 // Seed of the first shard; each following shard uses the next seed
+#define VERIFY_BATCH 1000 // Cases of a shard processed together with the exact oracle
+#define PROGRESS_MS  1000 // Interval of the progress reports
+
+TStats::TStats()
+{
+    for (auto &op : counts)
+        for (auto &c : op)
+            c.store(0, std::memory_order_relaxed);
+    for (auto &e : errors)
+        for (auto &c : e)
+            c.store(0, std::memory_order_relaxed);
+}
+
+// Decade of the relative error: 0 for [1, inf) and for the errors that are not finite, d for [1e-d, 1e-(d-1)),
+// and STAT_DECADES - 1 for anything smaller
+static int stat_decade(double error)
+{
+    if (!(error < 1.0))
+        return 0;
+    if (error <= 0.0)
+        return STAT_DECADES - 1;
+    return std::min(STAT_DECADES - 1, int(std::ceil(-std::log10(error))));
+}
+
+void TStats::add(int op, int status, double error)
+{
+    // A single writer: a relaxed load and store is all it takes, without a locked read-modify-write
+    std::atomic<uint64_t> &c = counts[op][status];
+    c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    if (status != CHECK_OK)
+    {
+        std::atomic<uint64_t> &e = errors[status == CHECK_FAIL][stat_decade(error)];
+        e.store(e.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+}
+
+void TStats::merge(const TStats &s)
+{
+    for (int op = 0; op < STAT_OPS; op++)
+        for (int i = 0; i < 3; i++)
+            counts[op][i].store(counts[op][i].load(std::memory_order_relaxed) + s.counts[op][i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+    for (int k = 0; k < 2; k++)
+        for (int d = 0; d < STAT_DECADES; d++)
+            errors[k][d].store(errors[k][d].load(std::memory_order_relaxed) + s.errors[k][d].load(std::memory_order_relaxed), std::memory_order_relaxed);
+}
+
+uint64_t TStats::total(int status) const
+{
+    uint64_t n = 0;
+    for (int op = 0; op < STAT_OPS; op++)
+        n += counts[op][status].load(std::memory_order_relaxed);
+    return n;
+}
+
+// Runs one operation (op: 0 +, 1 -, 2 *, 3 /) using the selected engine
+TREG engine_compute(int op, const TREG &x, const TREG &y, int engine)
+{
+    if (engine == ENGINE_CHAR)
+        return op < 2 ? add_sub(x, y, op == 1) : (op == 2 ? mult(x, y) : div(x, y));
+    if (engine == ENGINE_FAST)
+        return op < 2 ? add_sub(x, y, op == 1) : (op == 2 ? mult_column(x, y) : div_table(x, y));
+    TPREG px = pack(x);
+    TPREG py = pack(y);
+    TREG result;
+    unpack(op < 2 ? add_sub(px, py, op == 1) : (op == 2 ? mult(px, py) : div(px, py)), result);
+    return result;
+}
+
+// Runs one operation using the selected engine, together with its floating point control value
+static TVERIF compute(int op, const TVERIF &x, const TVERIF &y, int engine)
+{
+    TVERIF result(TREG(), op == 0 ? x.fp + y.fp : (op == 1 ? x.fp - y.fp : (op == 2 ? x.fp * y.fp : x.fp / y.fp)));
+    result.reg = engine_compute(op, x.reg, y.reg, engine);
+    return result;
+}
+
+// Draws the operation of a case from the selected ones; with all of them selected, this is a single draw
+static int verify_op(std::minstd_rand &r, int ops)
+{
+    int op;
+    do
+        op = r() % 4;
+    while (!((ops >> op) & 1));
+    return op;
+}
+
+// Returns the value of the register as a double, infinity for the error signal
+static double reg_to_double(const TREG &r)
+{
+    if (r.flags & FLAGS_ERROR)
+        return HUGE_VAL;
+    double v = 0;
+    for (int i = 0; i < MAX_MANT; i++)
+        v = v * 10 + (r.mant[i] - '0');
+    return (r.sign ? -v : v) * std::pow(10.0, int(r.exps) - 128 - (MAX_MANT - 1));
+}
+
+// Relative difference of the register from the expected one, on the same scale as the floating point check
+static double reg_error(const TREG &r, const TREG &expected)
+{
+    double a = reg_to_double(r), b = reg_to_double(expected);
+    if (std::isinf(a) || std::isinf(b))
+        return a == b ? 0.0 : HUGE_VAL;
+    return b ? std::fabs(a - b) / std::fabs(b) : std::fabs(a);
+}
+
+// Result record of one case of a batch
+struct TCaseRecord
+{
+    const char *a, *b; // Operand input buffers
+    int op;
+    TREG value, expected;
+};
+
+void verify_exact_batch(std::minstd_rand &r, uint64_t id, uint64_t cases, int engine, TARENA &arena, TSTATS &stats, std::string &text,
+                        TGOLDEN *golden, int ops, bool verbose)
+{
+    static const char *op_str[4] = { " + ", " - ", " * ", " / " };
+    static const char *status_str[3] = { "OK", "NEAR", "FAIL" };
+
+    // Generate all operands of the batch first, then compute and check them
+    const std::deque<TCORPUSNUMBER> &c = corpus();
+    TCaseRecord *rec = arena.alloc_array<TCaseRecord>(cases);
+    for (uint64_t i = 0; i < cases; i++)
+    {
+        rec[i].op = verify_op(r, ops);
+        char *a = arena.alloc_array<char>(17);
+        random_operand(r, c[r() % c.size()].src[0], a);
+        char *b = arena.alloc_array<char>(17);
+        random_operand(r, c[r() % c.size()].src[0], b);
+        rec[i].a = a, rec[i].b = b;
+    }
+
+    for (uint64_t i = 0; i < cases; i++)
+    {
+        // Compare in memory against the exact oracle, format the text only for the failures
+        TREG x = input(rec[i].a);
+        TREG y = input(rec[i].b);
+        rec[i].value = engine_compute(rec[i].op, x, y, engine);
+        int status = exact_check(x, y, rec[i].op, rec[i].value, rec[i].expected);
+        stats.add(rec[i].op, status, status == CHECK_OK ? 0.0 : reg_error(rec[i].value, rec[i].expected));
+        if (golden)
+            golden[i] = golden_record(rec[i].op, x, y, rec[i].value, status);
+        if (verbose || (status == CHECK_FAIL))
+        {
+            // Format straight into the text, without any temporary strings
+            const TREG &v = rec[i].value, &e = rec[i].expected;
+            char buf[128];
+            int n = snprintf(buf, sizeof(buf), "%s%s%s = %c%s (%3d) %llu  expected %c%s (%3d)  %s\n", rec[i].a, op_str[rec[i].op], rec[i].b,
+                             v.sign ? '-' : '+', v.mant, v.exps, (unsigned long long) (id + i), e.sign ? '-' : '+', e.mant, e.exps, status_str[status]);
+            text.append(buf, size_t(n));
+        }
+    }
+    arena.reset();
+}
+
+static void verify_shard(int shard, uint64_t cases, int engine, bool exact, bool verbose, std::string &text, TSTATS &stats, TGOLDENFILE *golden, int ops)
+{
+    static const char *op_str[4] = { " + ", " - ", " * ", " / " };
+    std::minstd_rand r(SHARD_SEED + shard);
+    std::vector<TGOLDEN> records(golden ? cases : 0);
+
+    if (exact)
+    {
+        TARENA arena;
+        for (uint64_t i = 0; i < cases; i += VERIFY_BATCH)
+            verify_exact_batch(r, uint64_t(shard) * SHARD_CASES + i + 1, std::min<uint64_t>(VERIFY_BATCH, cases - i), engine, arena, stats, text,
+                               golden ? &records[i] : nullptr, ops, verbose);
+        if (golden)
+            golden->write(uint64_t(shard) * SHARD_CASES + 1, records.data(), records.size());
+        return;
+    }
+
+    const std::deque<TCORPUSNUMBER> &c = corpus();
+    std::string line;
+    for (uint64_t i = 0; i < cases; i++)
+    {
+        int op = verify_op(r, ops);
+        std::string s1 = random_operand(r, c[r() % c.size()].src[0]);
+        std::string s2 = random_operand(r, c[r() % c.size()].src[0]);
+        uint64_t id = uint64_t(shard) * SHARD_CASES + i + 1;
+
+        TVERIF x(s1.c_str()), y(s2.c_str());
+        TVERIF value = compute(op, x, y, engine);
+        double error = 0;
+        int status = value.check(line, id, &error);
+        stats.add(op, status, error);
+        if (verbose || (status == CHECK_FAIL))
+            text.append(s1).append(op_str[op]).append(s2).append(line);
+        if (golden)
+            records[i] = golden_record(op, x.reg, y.reg, value.reg, status);
+    }
+    if (golden)
+        golden->write(uint64_t(shard) * SHARD_CASES + 1, records.data(), records.size());
+}
+
+// Prints the cases by operation and the histogram of the relative errors of the NEAR and FAIL cases
+static void verify_print_stats(const TSTATS &s)
+{
+    static const char op_char[STAT_OPS] = { '+', '-', '*', '/' };
+    for (int op = 0; op < STAT_OPS; op++)
+    {
+        uint64_t near = s.counts[op][CHECK_NEAR].load(std::memory_order_relaxed), fail = s.counts[op][CHECK_FAIL].load(std::memory_order_relaxed);
+        uint64_t n = s.counts[op][CHECK_OK].load(std::memory_order_relaxed) + near + fail;
+        if (n)
+            std::cout << "Operation " << op_char[op] << ": cases: " << n << "  fail: " << fail << "  rounding errors: " << near << "\n";
+    }
+    bool header = false;
+    for (int d = 0; d < STAT_DECADES; d++)
+    {
+        uint64_t near = s.errors[0][d].load(std::memory_order_relaxed), fail = s.errors[1][d].load(std::memory_order_relaxed);
+        if (!near && !fail)
+            continue;
+        if (!header)
+            std::cout << "Relative error            NEAR        FAIL\n", header = true;
+        char range[24];
+        if (d == 0)
+            snprintf(range, sizeof(range), ">= 1");
+        else if (d == STAT_DECADES - 1)
+            snprintf(range, sizeof(range), "< 1e-%d", d - 1);
+        else
+            snprintf(range, sizeof(range), "1e-%d .. 1e-%d", d, d - 1);
+        printf("  %-16s %10llu  %10llu\n", range, (unsigned long long) near, (unsigned long long) fail);
+    }
+}
+
+// Sums up the statistics blocks while they are being written and prints the progress to stderr every
+// PROGRESS_MS, until done is set
+static void verify_progress(const std::vector<TSTATS> &stats, uint64_t cases, const std::atomic<bool> &done)
+{
+    static const char op_char[STAT_OPS] = { '+', '-', '*', '/' };
+    bool tty = isatty(fileno(stderr));
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now(), last = start;
+    uint64_t last_ops[STAT_OPS] = {};
+    bool printed = false;
+    while (!done)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        double t = std::chrono::duration<double>(now - last).count();
+        if (done || (t * 1000 < PROGRESS_MS))
+            continue;
+
+        uint64_t ops[STAT_OPS] = {}, total = 0;
+        for (const TSTATS &s : stats)
+            for (int op = 0; op < STAT_OPS; op++)
+                for (int i = 0; i < 3; i++)
+                    ops[op] += s.counts[op][i].load(std::memory_order_relaxed);
+        for (int op = 0; op < STAT_OPS; op++)
+            total += ops[op];
+        fprintf(stderr, "%5.1f%%  %llu of %llu cases in %.0f s  M cases/s:", 100.0 * total / cases, (unsigned long long) total,
+                (unsigned long long) cases, std::chrono::duration<double>(now - start).count());
+        for (int op = 0; op < STAT_OPS; op++)
+        {
+            fprintf(stderr, "  %c %.2f", op_char[op], (ops[op] - last_ops[op]) / t / 1e6);
+            last_ops[op] = ops[op];
+        }
+        fprintf(stderr, tty ? "   \r" : "\n");
+        fflush(stderr);
+        last = now;
+        printed = true;
+    }
+    if (printed && tty)
+        fprintf(stderr, "\n");
+}
+
+// Runs the given number of randomized cases on all four operations using a pool of threads.
+// The results are checked against the floating point control values, or against the exact oracle.
+// Returns the number of failed cases.
+uint64_t verify_parallel(uint64_t cases, int threads, int engine, bool exact, const char *golden, int ops, uint64_t key, bool verbose, const char *output)
+{
+    if (threads <= 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+
+    int shards = int((cases + SHARD_CASES - 1) / SHARD_CASES);
+    std::vector<TSTATS> stats(threads);
+    std::atomic<int> next_shard(0);
+    std::atomic<bool> done(false);
+
+    static const char *engine_name[3] = { "char", "fast", "packed" };
+    std::cout << "PARALLEL RANDOMIZED TESTS (" << engine_name[engine] << " engine, " << cases << " cases, "
+              << shards << " shards" << (exact ? ", exact oracle" : "") << ")\n";
+    std::cerr << "Running on " << threads << " threads\n"; // Not in the printout, which does not depend on the threads
+
+    TGOLDENFILE file;
+    if (golden && !file.open(golden, cases, engine, exact, key))
+        return std::cerr << "Unable to write " << golden << "\n", 1;
+
+    TOUTPUT out;
+    if (!out.open(output, shards))
+        return std::cerr << "Unable to write " << output << "\n", 1;
+
+    auto worker = [&](int thread)
+    {
+        std::string text; // The buffers are recycled by the output writer
+        int shard;
+        while ((shard = next_shard++) < shards)
+        {
+            uint64_t count = std::min<uint64_t>(SHARD_CASES, cases - uint64_t(shard) * SHARD_CASES);
+            if (verbose)
+                text.reserve(count * 128);
+            verify_shard(shard, count, engine, exact, verbose, text, stats[thread], golden ? &file : nullptr, ops);
+            out.submit(shard, text);
+        }
+    };
+    std::thread progress(verify_progress, std::cref(stats), cases, std::cref(done));
+    std::vector<std::thread> pool;
+    for (int i = 0; i < threads; i++)
+        pool.emplace_back(worker, i);
+    for (std::thread &t : pool)
+        t.join();
+    done = true;
+    progress.join();
+
+    if (!out.close())
+        return std::cerr << "Unable to write " << (output ? output : "stdout") << "\n", 1;
+
+    TSTATS total;
+    for (const TSTATS &s : stats)
+        total.merge(s);
+
+    uint64_t fail = total.total(CHECK_FAIL);
+    std::cout << "Total tests: " << cases << "  fail: " << fail << "  rounding errors: " << total.total(CHECK_NEAR) << "\n";
+    verify_print_stats(total);
+    if (golden && !file.close())
+        return std::cerr << "Unable to write " << golden << "\n", fail + 1;
+    return fail;
+}
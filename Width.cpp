@@ -0,0 +1,77 @@
+/*  Copyright (C) 2021  Goran Devic
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+*/
+#include "Common.h"
+
+// Register width test: runs the char engine algorithms instantiated for every one of the PROOF_WIDTHS
+// design points over the same set of operands. The input buffer is the same 16 characters for every
+// width, so a narrower register truncates the typed in digits. Results are checked against the exact
+// oracle since a double can not verify more than 15 digits.
+
+// Runs one operation at the width M, returns the check status
+template<int M>
+static int width_check(const char *a, const TReg<M> &x, const char *b, const TReg<M> &y, int op, int id)
+{
+    static const char *op_str[4] = { " + ", " - ", " * ", " / " };
+    TReg<M> result = op < 2 ? add_sub(x, y, op == 1) : (op == 2 ? mult(x, y) : div(x, y));
+    TReg<M> expected;
+    int status = exact_check(x, y, op, result, expected);
+    if (status == CHECK_FAIL)
+        std::cout << a << op_str[op] << b << " = " << (result.sign ? '-' : '+') << result.mant << " (" << int(result.exps) << ") " << id
+                  << "  expected " << (expected.sign ? '-' : '+') << expected.mant << " (" << int(expected.exps) << ")  FAIL\n";
+
+    // The faster variants need to match the reference algorithms at every width
+    bool mismatch = (op == 2 && mult_column(x, y) != result) || (op == 3 && div_table(x, y) != result);
+    if (mismatch)
+        std::cout << a << op_str[op] << b << " *** " << (op == 2 ? "mult_column()" : "div_table()") << " mismatch at " << M << " digits ***\n";
+    return mismatch ? CHECK_FAIL : status;
+}
+
+template<int M>
+static void width_run(const std::deque<TCORPUSNUMBER> &c)
+{
+    uint32_t total = 0, pass = 0, fail = 0;
+    int test_number = 1;
+
+    // Load the corpus into the registers of this width once, for both mantissa signs
+    std::vector<TReg<M>> regs[2];
+    for (const TCORPUSNUMBER &n : c)
+        for (int sign = 0; sign < 2; sign++)
+            regs[sign].push_back(input<M>(n.src[sign]));
+
+    // Run all four operations using our set of test numbers and all sign variations
+    for (int op = 0; op < 4; op++)
+    {
+        for (int signs = 0; signs < 4; signs++)
+        {
+            int sx = signs & 1, sy = (signs >> 1) & 1;
+            for (size_t i = 0; i < c.size(); i++)
+            {
+                for (size_t j = 0; j < c.size(); j++)
+                {
+                    int status = width_check<M>(c[i].src[sx], regs[sx][i], c[j].src[sy], regs[sy][j], op, test_number++);
+                    pass += status == CHECK_OK;
+                    fail += status == CHECK_FAIL;
+                    total++;
+                }
+            }
+        }
+    }
+
+    std::cout << "Width " << std::setw(2) << M << " digits: operations checked: " << total << "  fail: " << fail << "  rounding errors: " << (total - (pass + fail)) << "\n";
+    tests_total += total;
+    tests_pass += pass;
+    tests_fail += fail;
+}
+
+void width_test()
+{
+    std::cout << "REGISTER WIDTH TEST\n";
+
+#define RUN_WIDTH(M) width_run<M>(corpus());
+    PROOF_WIDTHS(RUN_WIDTH)
+}